@@ -71,7 +71,9 @@ struct EVP_PKEY_Delete {
 typedef UniquePtr<EVP_PKEY, EVP_PKEY_Delete> Unique_EVP_PKEY;
 
 TrustyAtapOps::TrustyAtapOps() {}
-TrustyAtapOps::~TrustyAtapOps() {}
+TrustyAtapOps::~TrustyAtapOps() {
+    EVP_PKEY_free(_auth_key);
+}
 
 struct PKCS8_PRIV_KEY_INFO_Delete {
     void operator()(PKCS8_PRIV_KEY_INFO* p) const {
@@ -215,26 +217,21 @@ AtapResult TrustyAtapOps::write_hex_uuid(
     return ATAP_RESULT_OK;
 }
 
-AtapResult TrustyAtapOps::auth_key_sign(const uint8_t* nonce,
-                                        uint32_t nonce_len,
-                                        uint8_t sig[ATAP_SIGNATURE_LEN_MAX],
-                                        uint32_t* sig_len) {
-    AtapKeyType key_type;
-    keymaster_error_t result = KM_ERROR_OK;
-    AtapResult atap_result = get_auth_key_type(&key_type);
-    if (atap_result != ATAP_RESULT_OK) {
-        LOG_E("Failed to get key type", 0);
-        return atap_result;
-    }
-    if (key_type == ATAP_KEY_TYPE_NONE) {
-        return ATAP_RESULT_ERROR_UNSUPPORTED_OPERATION;
-    }
+AtapResult TrustyAtapOps::get_auth_key(AttestationKeySlot key_slot,
+                                       EVP_PKEY** pkey) {
     SecureStorageManager* ss_manager = SecureStorageManager::get_instance();
     if (ss_manager == nullptr) {
         return ATAP_RESULT_ERROR_STORAGE;
     }
-    AttestationKeySlot key_slot = MapKeyTypeToSlot(key_type);
+    if (_auth_key && _auth_key_slot == key_slot &&
+        _auth_key_generation == ss_manager->AttestationKeyGeneration()) {
+        *pkey = _auth_key;
+        return ATAP_RESULT_OK;
+    }
+    EVP_PKEY_free(_auth_key);
+    _auth_key = nullptr;
 
+    keymaster_error_t result = KM_ERROR_OK;
     KeymasterKeyBlob key_blob =
             ss_manager->ReadKeyFromStorage(key_slot, &result);
     if (result != KM_ERROR_OK) {
@@ -251,12 +248,40 @@ AtapResult TrustyAtapOps::auth_key_sign(const uint8_t* nonce,
         LOG_E("Error parsing pkcs8 format private key.", 0);
         return ATAP_RESULT_ERROR_INVALID_INPUT;
     }
-    Unique_EVP_PKEY pkey(EVP_PKCS82PKEY(pkcs8.get()));
-    if (!pkey.get()) {
+    Unique_EVP_PKEY parsed_key(EVP_PKCS82PKEY(pkcs8.get()));
+    if (!parsed_key.get()) {
         LOG_E("Error parsing pkcs8 private key to EVP_PKEY.", 0);
         return ATAP_RESULT_ERROR_INVALID_INPUT;
     }
 
+    _auth_key = parsed_key.release();
+    _auth_key_slot = key_slot;
+    _auth_key_generation = ss_manager->AttestationKeyGeneration();
+    *pkey = _auth_key;
+    return ATAP_RESULT_OK;
+}
+
+AtapResult TrustyAtapOps::auth_key_sign(const uint8_t* nonce,
+                                        uint32_t nonce_len,
+                                        uint8_t sig[ATAP_SIGNATURE_LEN_MAX],
+                                        uint32_t* sig_len) {
+    AtapKeyType key_type;
+    AtapResult atap_result = get_auth_key_type(&key_type);
+    if (atap_result != ATAP_RESULT_OK) {
+        LOG_E("Failed to get key type", 0);
+        return atap_result;
+    }
+    if (key_type == ATAP_KEY_TYPE_NONE) {
+        return ATAP_RESULT_ERROR_UNSUPPORTED_OPERATION;
+    }
+    AttestationKeySlot key_slot = MapKeyTypeToSlot(key_type);
+
+    EVP_PKEY* pkey;
+    atap_result = get_auth_key(key_slot, &pkey);
+    if (atap_result != ATAP_RESULT_OK) {
+        return atap_result;
+    }
+
     Unique_EVP_MD_CTX mdctx(EVP_MD_CTX_create());
 
     if (!mdctx.get()) {
@@ -265,7 +290,7 @@ AtapResult TrustyAtapOps::auth_key_sign(const uint8_t* nonce,
     }
     EVP_PKEY_CTX* evp_pkey_ctx;
     if (1 != EVP_DigestSignInit(mdctx.get(), &evp_pkey_ctx, EVP_sha512(), NULL,
-                                pkey.get())) {
+                                pkey)) {
         return ATAP_RESULT_ERROR_OOM;
     }
     if (key_type == ATAP_KEY_TYPE_RSA_SOM &&
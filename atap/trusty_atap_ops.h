@@ -26,6 +26,9 @@
 #define TRUSTY_ATAP_OPS_H_
 
 #include "ops/openssl_ops.h"
+#include "secure_storage_manager.h"
+
+#include <openssl/evp.h>
 
 namespace keymaster {
 
@@ -65,8 +68,16 @@ public:
                              uint32_t* sig_len) override;
 
 private:
+    // Returns the parsed private key in |key_slot|. The key is kept until the
+    // slot is rewritten, so that repeated signing doesn't parse it again.
+    AtapResult get_auth_key(AttestationKeySlot key_slot, EVP_PKEY** pkey);
+
     bool _auth_key_type_init = false;
     AtapKeyType _auth_key_type;
+
+    EVP_PKEY* _auth_key = nullptr;
+    AttestationKeySlot _auth_key_slot = AttestationKeySlot::kInvalid;
+    uint32_t _auth_key_generation = 0;
 };
 
 }  // namespace keymaster
@@ -0,0 +1,560 @@
+/*
+ * Copyright 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * This app measures keymaster latency and throughput end to end, over the
+ * same IPC port the HAL uses.  To run it, build keymaster with
+ * KEYMASTER_ALLOW_TA_CONNECT=true so that the port accepts connections from
+ * apps, include trusty/user/app/keymaster/device_benchmark in
+ * TRUSTY_ALL_USER_TASKS and run the com.android.keymaster-benchmark unittest
+ * port once Android has configured keymaster.
+ *
+ * It generates RSA, EC and AES keys with and without rollback resistance,
+ * runs begin/update/finish over several chunk sizes, generates attested keys
+ * if attestation keys are provisioned and deletes every key it creates.  Mean,
+ * median and 99th percentile latencies and the operation rate are logged for
+ * every step.
+ *
+ * Before benchmarking, it checks that a single-use key is rejected the second
+ * time it is used, which the key blob cache must not get in the way of.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+
+#include <lib/unittest/unittest.h>
+#include <trusty/time.h>
+#include <trusty_ipc.h>
+#include <trusty_unittest.h>
+#include <uapi/err.h>
+
+#include <keymaster/UniquePtr.h>
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/authorization_set.h>
+#include "ipc/keymaster_ipc.h"
+
+#undef STRINGIFY
+#include "trusty_logger.h"
+
+#define TLOG_TAG "km_benchmark"
+#include <trusty_log.h>
+
+using namespace keymaster;
+
+static constexpr int32_t kMessageVersion = 4;
+static constexpr size_t kMaxSamples = 64;
+static constexpr size_t kChunkSizes[] = {64, 512, 2048};
+static constexpr size_t kNumChunkSizes =
+        sizeof(kChunkSizes) / sizeof(kChunkSizes[0]);
+
+static uint64_t now_ns() {
+    int64_t ns = 0;
+    trusty_gettime(0, &ns);
+    return static_cast<uint64_t>(ns);
+}
+
+/*
+ * Collects the latency samples of one benchmark step and logs a summary.
+ */
+class LatencyStats {
+public:
+    void Add(uint64_t ns) {
+        if (count_ < kMaxSamples) {
+            samples_[count_++] = ns;
+        }
+    }
+
+    void Report(const char* workload, const char* step) {
+        if (!count_) {
+            return;
+        }
+        uint64_t total = 0;
+        for (size_t i = 0; i < count_; i++) {
+            total += samples_[i];
+        }
+        std::sort(samples_, samples_ + count_);
+        uint64_t p50 = samples_[count_ / 2];
+        uint64_t p99 = samples_[(count_ * 99) / 100];
+        uint64_t ops_per_ks =
+                total ? (count_ * 1000ULL * 1000000000ULL) / total : 0;
+        TLOGI("%s %s: n=%zu mean=%llu us p50=%llu us p99=%llu us "
+              "%llu.%03llu ops/s\n",
+              workload, step, count_,
+              static_cast<unsigned long long>(total / count_ / 1000),
+              static_cast<unsigned long long>(p50 / 1000),
+              static_cast<unsigned long long>(p99 / 1000),
+              static_cast<unsigned long long>(ops_per_ks / 1000),
+              static_cast<unsigned long long>(ops_per_ks % 1000));
+    }
+
+private:
+    uint64_t samples_[kMaxSamples];
+    size_t count_ = 0;
+};
+
+/*
+ * Sends requests to the non-secure keymaster port and collects the possibly
+ * multi-message responses.
+ */
+class KeymasterConnection {
+public:
+    ~KeymasterConnection() {
+        if (chan_ != INVALID_IPC_HANDLE) {
+            close(chan_);
+        }
+    }
+
+    bool Connect() {
+        long rc = connect(KEYMASTER_PORT, IPC_CONNECT_WAIT_FOR_PORT);
+        if (rc < 0) {
+            TLOGE("failed (%ld) to connect to %s\n", rc, KEYMASTER_PORT);
+            return false;
+        }
+        chan_ = static_cast<handle_t>(rc);
+        return true;
+    }
+
+    keymaster_error_t Call(uint32_t cmd,
+                           const Serializable& req,
+                           KeymasterResponse* rsp) {
+        keymaster_message* hdr = reinterpret_cast<keymaster_message*>(buf_);
+        size_t req_size = req.SerializedSize();
+        if (sizeof(*hdr) + req_size > sizeof(buf_)) {
+            TLOGE("request for cmd %u too large: %zu\n", cmd, req_size);
+            return KM_ERROR_INVALID_INPUT_LENGTH;
+        }
+        hdr->cmd = cmd;
+        req.Serialize(hdr->payload, buf_ + sizeof(buf_));
+
+        struct iovec iov = {buf_, sizeof(*hdr) + req_size};
+        ipc_msg_t msg = {1, &iov, 0, NULL};
+        long rc = send_msg(chan_, &msg);
+        if (rc < 0) {
+            TLOGE("failed (%ld) to send cmd %u\n", rc, cmd);
+            return KM_ERROR_UNKNOWN_ERROR;
+        }
+
+        rsp_size_ = 0;
+        bool done = false;
+        while (!done) {
+            if (!ReadResponsePart(cmd, &done)) {
+                return KM_ERROR_UNKNOWN_ERROR;
+            }
+        }
+
+        const uint8_t* p = rsp_.get();
+        if (!rsp->Deserialize(&p, rsp_.get() + rsp_size_)) {
+            TLOGE("failed to deserialize response to cmd %u\n", cmd);
+            return KM_ERROR_UNKNOWN_ERROR;
+        }
+        return rsp->error;
+    }
+
+private:
+    bool ReadResponsePart(uint32_t cmd, bool* done) {
+        uevent_t ev;
+        long rc = wait(chan_, &ev, INFINITE_TIME);
+        if (rc != NO_ERROR || !(ev.event & IPC_HANDLE_POLL_MSG)) {
+            TLOGE("failed (%ld, 0x%x) waiting for response to cmd %u\n", rc,
+                  ev.event, cmd);
+            return false;
+        }
+
+        ipc_msg_info_t inf;
+        rc = get_msg(chan_, &inf);
+        if (rc != NO_ERROR) {
+            TLOGE("failed (%ld) to get response to cmd %u\n", rc, cmd);
+            return false;
+        }
+
+        struct iovec iov = {buf_, sizeof(buf_)};
+        ipc_msg_t msg = {1, &iov, 0, NULL};
+        rc = read_msg(chan_, inf.id, 0, &msg);
+        put_msg(chan_, inf.id);
+        if (rc < static_cast<long>(sizeof(keymaster_message)) ||
+            static_cast<size_t>(rc) != inf.len) {
+            TLOGE("failed (%ld) to read response to cmd %u\n", rc, cmd);
+            return false;
+        }
+
+        keymaster_message* hdr = reinterpret_cast<keymaster_message*>(buf_);
+        if ((hdr->cmd & ~KEYMASTER_STOP_BIT) != (cmd | KEYMASTER_RESP_BIT)) {
+            TLOGE("unexpected response 0x%x to cmd %u\n", hdr->cmd, cmd);
+            return false;
+        }
+
+        size_t part_size = inf.len - sizeof(*hdr);
+        if (rsp_size_ + part_size > kMaxResponseSize) {
+            TLOGE("response to cmd %u too large\n", cmd);
+            return false;
+        }
+        memcpy(rsp_.get() + rsp_size_, hdr->payload, part_size);
+        rsp_size_ += part_size;
+        *done = hdr->cmd & KEYMASTER_STOP_BIT;
+        return true;
+    }
+
+    static constexpr size_t kMaxResponseSize = 8 * KEYMASTER_MAX_BUFFER_LENGTH;
+
+    handle_t chan_ = INVALID_IPC_HANDLE;
+    uint8_t buf_[KEYMASTER_MAX_BUFFER_LENGTH];
+    UniquePtr<uint8_t[]> rsp_{new uint8_t[kMaxResponseSize]};
+    size_t rsp_size_ = 0;
+};
+
+static keymaster_error_t generate_key(KeymasterConnection* km,
+                                      const AuthorizationSet& params,
+                                      KeymasterKeyBlob* key_blob,
+                                      uint64_t* elapsed_ns) {
+    GenerateKeyRequest req(kMessageVersion);
+    req.key_description.Reinitialize(params);
+    GenerateKeyResponse rsp(kMessageVersion);
+
+    uint64_t start = now_ns();
+    keymaster_error_t error = km->Call(KM_GENERATE_KEY, req, &rsp);
+    *elapsed_ns = now_ns() - start;
+
+    if (error == KM_ERROR_OK) {
+        *key_blob = std::move(rsp.key_blob);
+    }
+    return error;
+}
+
+static keymaster_error_t delete_key(KeymasterConnection* km,
+                                    const KeymasterKeyBlob& key_blob,
+                                    uint64_t* elapsed_ns) {
+    DeleteKeyRequest req(kMessageVersion);
+    req.SetKeyMaterial(key_blob);
+    DeleteKeyResponse rsp(kMessageVersion);
+
+    uint64_t start = now_ns();
+    keymaster_error_t error = km->Call(KM_DELETE_KEY, req, &rsp);
+    *elapsed_ns = now_ns() - start;
+    return error;
+}
+
+struct OperationStats {
+    LatencyStats begin;
+    LatencyStats update;
+    LatencyStats finish;
+};
+
+static keymaster_error_t run_operation(KeymasterConnection* km,
+                                       const KeymasterKeyBlob& key_blob,
+                                       keymaster_purpose_t purpose,
+                                       const AuthorizationSet& begin_params,
+                                       const uint8_t* data,
+                                       size_t data_size,
+                                       OperationStats* stats) {
+    BeginOperationRequest begin_req(kMessageVersion);
+    begin_req.purpose = purpose;
+    begin_req.SetKeyMaterial(key_blob);
+    begin_req.additional_params.Reinitialize(begin_params);
+    BeginOperationResponse begin_rsp(kMessageVersion);
+
+    uint64_t start = now_ns();
+    keymaster_error_t error =
+            km->Call(KM_BEGIN_OPERATION, begin_req, &begin_rsp);
+    stats->begin.Add(now_ns() - start);
+    if (error != KM_ERROR_OK) {
+        return error;
+    }
+
+    UpdateOperationRequest update_req(kMessageVersion);
+    update_req.op_handle = begin_rsp.op_handle;
+    update_req.input.Reinitialize(data, data_size);
+    UpdateOperationResponse update_rsp(kMessageVersion);
+
+    start = now_ns();
+    error = km->Call(KM_UPDATE_OPERATION, update_req, &update_rsp);
+    stats->update.Add(now_ns() - start);
+    if (error != KM_ERROR_OK) {
+        return error;
+    }
+
+    FinishOperationRequest finish_req(kMessageVersion);
+    finish_req.op_handle = begin_rsp.op_handle;
+    FinishOperationResponse finish_rsp(kMessageVersion);
+
+    start = now_ns();
+    error = km->Call(KM_FINISH_OPERATION, finish_req, &finish_rsp);
+    stats->finish.Add(now_ns() - start);
+    return error;
+}
+
+struct Workload {
+    const char* name;
+    AuthorizationSet key_params;
+    keymaster_purpose_t purpose;
+    AuthorizationSet begin_params;
+    bool attestable;
+    size_t iterations;
+};
+
+static void add_certificate_params(AuthorizationSetBuilder* builder) {
+    builder->Authorization(TAG_CERTIFICATE_NOT_BEFORE, 0)
+            .Authorization(TAG_CERTIFICATE_NOT_AFTER, 253402300799000ULL);
+}
+
+static Workload rsa_workload() {
+    AuthorizationSetBuilder key_params;
+    key_params.RsaSigningKey(2048, 65537)
+            .Digest(KM_DIGEST_SHA_2_256)
+            .Padding(KM_PAD_RSA_PSS)
+            .Authorization(TAG_NO_AUTH_REQUIRED);
+    add_certificate_params(&key_params);
+    return {"RSA-2048",
+            key_params.build(),
+            KM_PURPOSE_SIGN,
+            AuthorizationSetBuilder()
+                    .Digest(KM_DIGEST_SHA_2_256)
+                    .Padding(KM_PAD_RSA_PSS)
+                    .build(),
+            true,
+            8};
+}
+
+static Workload ec_workload() {
+    AuthorizationSetBuilder key_params;
+    key_params.EcdsaSigningKey(256)
+            .Digest(KM_DIGEST_SHA_2_256)
+            .Authorization(TAG_NO_AUTH_REQUIRED);
+    add_certificate_params(&key_params);
+    return {"EC-P256",
+            key_params.build(),
+            KM_PURPOSE_SIGN,
+            AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256).build(),
+            true,
+            32};
+}
+
+static Workload aes_workload() {
+    return {"AES-256-GCM",
+            AuthorizationSetBuilder()
+                    .AesEncryptionKey(256)
+                    .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
+                    .Padding(KM_PAD_NONE)
+                    .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                    .Authorization(TAG_NO_AUTH_REQUIRED)
+                    .build(),
+            KM_PURPOSE_ENCRYPT,
+            AuthorizationSetBuilder()
+                    .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
+                    .Padding(KM_PAD_NONE)
+                    .Authorization(TAG_MAC_LENGTH, 128)
+                    .build(),
+            false,
+            32};
+}
+
+/*
+ * Generates, uses and deletes keys of one workload.  Returns false if any
+ * step fails.
+ */
+static bool run_workload(KeymasterConnection* km,
+                         const Workload& workload,
+                         bool rollback_resistant) {
+    AuthorizationSet key_params(workload.key_params);
+    if (rollback_resistant) {
+        key_params.push_back(TAG_ROLLBACK_RESISTANCE);
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s%s", workload.name,
+             rollback_resistant ? " rollback-resistant" : "");
+
+    static uint8_t data[kChunkSizes[kNumChunkSizes - 1]];
+    memset(data, 0xa5, sizeof(data));
+
+    LatencyStats generate_stats;
+    LatencyStats delete_stats;
+    OperationStats op_stats[kNumChunkSizes];
+
+    for (size_t i = 0; i < workload.iterations; i++) {
+        KeymasterKeyBlob key_blob;
+        uint64_t elapsed;
+        keymaster_error_t error =
+                generate_key(km, key_params, &key_blob, &elapsed);
+        if (error == KM_ERROR_ROLLBACK_RESISTANCE_UNAVAILABLE) {
+            TLOGI("%s: rollback resistance unavailable, skipping\n", name);
+            return true;
+        }
+        if (error != KM_ERROR_OK) {
+            TLOGE("%s: GenerateKey failed (%d)\n", name, error);
+            return false;
+        }
+        generate_stats.Add(elapsed);
+
+        for (size_t c = 0; c < kNumChunkSizes; c++) {
+            error = run_operation(km, key_blob, workload.purpose,
+                                  workload.begin_params, data, kChunkSizes[c],
+                                  &op_stats[c]);
+            if (error != KM_ERROR_OK) {
+                TLOGE("%s: %zu byte operation failed (%d)\n", name,
+                      kChunkSizes[c], error);
+                delete_key(km, key_blob, &elapsed);
+                return false;
+            }
+        }
+
+        error = delete_key(km, key_blob, &elapsed);
+        if (error != KM_ERROR_OK) {
+            TLOGE("%s: DeleteKey failed (%d)\n", name, error);
+            return false;
+        }
+        delete_stats.Add(elapsed);
+    }
+
+    generate_stats.Report(name, "generate");
+    for (size_t c = 0; c < kNumChunkSizes; c++) {
+        char step[32];
+        snprintf(step, sizeof(step), "begin %zu", kChunkSizes[c]);
+        op_stats[c].begin.Report(name, step);
+        snprintf(step, sizeof(step), "update %zu", kChunkSizes[c]);
+        op_stats[c].update.Report(name, step);
+        snprintf(step, sizeof(step), "finish %zu", kChunkSizes[c]);
+        op_stats[c].finish.Report(name, step);
+    }
+    delete_stats.Report(name, "delete");
+    return true;
+}
+
+/*
+ * Generates and deletes attested keys of one workload.  Attestation needs
+ * provisioned attestation keys, so devices without them skip this step.  An
+ * empty attestation key slot is reported as KM_ERROR_INVALID_ARGUMENT; any
+ * other error fails the benchmark.
+ */
+static bool run_attestation_workload(KeymasterConnection* km,
+                                     const Workload& workload) {
+    static const uint8_t challenge[] = "km_benchmark challenge";
+    static const uint8_t app_id[] = "km_benchmark";
+    AuthorizationSet key_params(workload.key_params);
+    key_params.push_back(TAG_ATTESTATION_CHALLENGE, challenge,
+                         sizeof(challenge) - 1);
+    key_params.push_back(TAG_ATTESTATION_APPLICATION_ID, app_id,
+                         sizeof(app_id) - 1);
+
+    LatencyStats attest_stats;
+    for (size_t i = 0; i < workload.iterations; i++) {
+        KeymasterKeyBlob key_blob;
+        uint64_t elapsed;
+        keymaster_error_t error =
+                generate_key(km, key_params, &key_blob, &elapsed);
+        if (error == KM_ERROR_INVALID_ARGUMENT && i == 0) {
+            TLOGI("%s: no attestation keys, skipping\n", workload.name);
+            return true;
+        }
+        if (error != KM_ERROR_OK) {
+            TLOGE("%s: attested GenerateKey failed (%d)\n", workload.name,
+                  error);
+            return false;
+        }
+        attest_stats.Add(elapsed);
+
+        error = delete_key(km, key_blob, &elapsed);
+        if (error != KM_ERROR_OK) {
+            TLOGE("%s: DeleteKey failed (%d)\n", workload.name, error);
+            return false;
+        }
+    }
+    attest_stats.Report(workload.name, "generate attested");
+    return true;
+}
+
+/*
+ * Uses a key with TAG_USAGE_COUNT_LIMIT 1 twice.  The second use must fail,
+ * even though the first one just parsed the blob.
+ */
+static bool test_single_use_key(KeymasterConnection* km) {
+    Workload workload = aes_workload();
+    AuthorizationSet key_params(workload.key_params);
+    key_params.push_back(TAG_USAGE_COUNT_LIMIT, 1);
+
+    KeymasterKeyBlob key_blob;
+    uint64_t elapsed;
+    keymaster_error_t error = generate_key(km, key_params, &key_blob, &elapsed);
+    if (error == KM_ERROR_KEYMASTER_NOT_CONFIGURED) {
+        /* version info can only be set once, so leave it to Android */
+        TLOGE("keymaster is not configured, run the benchmark after Android "
+              "has booted\n");
+        return false;
+    }
+    if (error != KM_ERROR_OK) {
+        TLOGE("single-use key: GenerateKey failed (%d)\n", error);
+        return false;
+    }
+
+    static const uint8_t data[64] = {};
+    OperationStats stats;
+    error = run_operation(km, key_blob, workload.purpose, workload.begin_params,
+                          data, sizeof(data), &stats);
+    if (error != KM_ERROR_OK) {
+        TLOGE("single-use key: first use failed (%d)\n", error);
+        delete_key(km, key_blob, &elapsed);
+        return false;
+    }
+
+    error = run_operation(km, key_blob, workload.purpose, workload.begin_params,
+                          data, sizeof(data), &stats);
+    delete_key(km, key_blob, &elapsed);
+    if (error == KM_ERROR_OK) {
+        TLOGE("single-use key: second use succeeded\n");
+        return false;
+    }
+    TLOGI("single-use key: second use rejected (%d)\n", error);
+    return true;
+}
+
+static bool keymaster_benchmark(struct unittest* test) {
+    KeymasterConnection km;
+    if (!km.Connect()) {
+        return false;
+    }
+
+    if (!test_single_use_key(&km)) {
+        return false;
+    }
+
+    Workload workloads[] = {rsa_workload(), ec_workload(), aes_workload()};
+    bool passed = true;
+    for (const Workload& workload : workloads) {
+        passed &= run_workload(&km, workload, false);
+        passed &= run_workload(&km, workload, true);
+        if (workload.attestable) {
+            passed &= run_attestation_workload(&km, workload);
+        }
+    }
+    return passed;
+}
+
+#define PORT_BASE "com.android.keymaster-benchmark"
+
+int main(void) {
+    keymaster::TrustyLogger::initialize();
+
+    struct unittest keymaster_benchmark_unittest = {
+            .port_name = PORT_BASE,
+            .run_test = keymaster_benchmark,
+    };
+    struct unittest* keymaster_benchmark_unittest_p =
+            &keymaster_benchmark_unittest;
+    return unittest_main(&keymaster_benchmark_unittest_p, 1);
+}
@@ -0,0 +1,44 @@
+# Copyright (C) 2021 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+LOCAL_DIR := $(GET_LOCAL_DIR)
+KEYMASTER_ROOT := system/keymaster
+KEYMASTER_DIR := trusty/user/app/keymaster
+MODULE := $(LOCAL_DIR)
+
+MANIFEST := $(LOCAL_DIR)/manifest.json
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/main.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/android_keymaster_messages.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/android_keymaster_utils.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/authorization_set.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/keymaster_tags.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/logger.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/serializable.cpp \
+
+MODULE_LIBRARY_DEPS += \
+	trusty/user/base/lib/libc-trusty \
+	trusty/user/base/lib/libstdc++-trusty \
+	trusty/user/base/lib/unittest \
+
+MODULE_INCLUDES += \
+	$(KEYMASTER_ROOT) \
+	$(LOCAL_DIR) \
+	$(KEYMASTER_DIR) \
+	$(KEYMASTER_ROOT)/include \
+	hardware/libhardware/include \
+
+include make/trusted_app.mk
@@ -15,8 +15,10 @@
  */
 
 /**
- * This app tests the API in app/keymaster/secure_storage_manager.h. To run this
- * test, include trusty/user/app/keymaster/device_unittest in
+ * This app tests the API in app/keymaster/secure_storage_manager.h, which
+ * keys app/keymaster/trusty_key_blob_cache.h may cache, and the deletion of
+ * slots in app/keymaster/trusty_secure_deletion_secret_storage.h. To run
+ * this test, include trusty/user/app/keymaster/device_unittest in
  * TRUSTY_ALL_USER_TASKS, and it will be start once an RPMB proxy becomes
  * available.
  *
@@ -30,28 +32,38 @@
 #include <string.h>
 
 #define typeof(x) __typeof__(x)
+#include <lib/rng/trusty_rng.h>
 #include <lib/storage/storage.h>
 #include <lib/unittest/unittest.h>
 #include <trusty_unittest.h>
 
 #include <keymaster/UniquePtr.h>
 #include <keymaster/android_keymaster_utils.h>
+#include <keymaster/random_source.h>
 #include "secure_storage_manager.h"
+#include "trusty_key_blob_cache.h"
+#include "trusty_secure_deletion_secret_storage.h"
 
 #undef STRINGIFY
 #include "trusty_logger.h"
 
 #define DATA_SIZE 1000
 #define CHAIN_LENGTH 3
+#define SECRETS_FILE_NAME "SecureDeletionSecrets_1"
+#define SECRETS_BLOCK_SIZE 512
 
 #define TLOG_TAG "km_storage_test"
 
 using keymaster::AttestationKeySlot;
 using keymaster::CertificateChain;
+using keymaster::DeserializedKey;
 using keymaster::kAttestationUuidSize;
+using keymaster::KeyBlobCache;
 using keymaster::KeymasterKeyBlob;
 using keymaster::kProductIdSize;
+using keymaster::SecureDeletionData;
 using keymaster::SecureStorageManager;
+using keymaster::TrustySecureDeletionSecretStorage;
 
 uint8_t* NewRandBuf(uint32_t size) {
     uint8_t* buf = new uint8_t[size];
@@ -329,6 +341,212 @@ TEST_F(KeymasterTest, TestProductIdStoragePreventOverwrite) {
 }
 #endif
 
+TEST(KeyBlobCacheTest, TestSecureDeletionKeysNotCacheable) {
+    DeserializedKey key;
+
+    key.encrypted_key.format = keymaster::AES_GCM_WITH_SW_ENFORCED;
+    key.key_slot = 0;
+    ASSERT_EQ(true, KeyBlobCache::IsCacheable(key));
+
+    // A key with a slot must be reloaded so that an erased slot is noticed.
+    key.key_slot = 3;
+    ASSERT_EQ(false, KeyBlobCache::IsCacheable(key));
+
+    key.encrypted_key.format = keymaster::AES_GCM_WITH_SECURE_DELETION;
+    ASSERT_EQ(false, KeyBlobCache::IsCacheable(key));
+
+    key.key_slot = 0;
+    ASSERT_EQ(false, KeyBlobCache::IsCacheable(key));
+
+test_abort:;
+}
+
+class TestRandomSource : public keymaster::RandomSource {
+public:
+    keymaster_error_t GenerateRandom(uint8_t* buf,
+                                     size_t length) const override {
+        if (trusty_rng_secure_rand(buf, length) != 0) {
+            return KM_ERROR_UNKNOWN_ERROR;
+        }
+        return KM_ERROR_OK;
+    }
+};
+
+/*
+ * Creates a key with a secure deletion secret and returns its slot, or 0 on
+ * failure.
+ */
+static uint32_t NewKeySlot(TrustySecureDeletionSecretStorage* storage) {
+    std::optional<SecureDeletionData> data =
+            storage->CreateDataForNewKey(true /* secure_deletion */,
+                                         false /* is_upgrade */);
+    if (!data || data->secure_deletion_secret.available_read() == 0) {
+        return 0;
+    }
+    return data->key_slot;
+}
+
+/*
+ * Returns true if |key_slot| holds a secret, i.e. hasn't been deleted.
+ */
+static bool SlotInUse(TrustySecureDeletionSecretStorage* storage,
+                      uint32_t key_slot) {
+    SecureDeletionData data = storage->GetDataForKey(key_slot);
+    return data.secure_deletion_secret.available_read() > 0 &&
+           (data.secure_deletion_secret.peek_read()[0] & 0x80) != 0;
+}
+
+/*
+ * Returns the committed size of the secrets file, read through a session of
+ * its own, or 0 on failure.
+ */
+static storage_off_t SecretsFileSize() {
+    storage_session_t session;
+    file_handle_t handle;
+    storage_off_t size = 0;
+
+    if (storage_open_session(&session, STORAGE_CLIENT_TP_PORT) < 0) {
+        return 0;
+    }
+    if (storage_open_file(session, &handle, SECRETS_FILE_NAME, 0, 0) == 0) {
+        if (storage_get_file_size(handle, &size) < 0) {
+            size = 0;
+        }
+        storage_close_file(handle);
+    }
+    storage_close_session(session);
+    return size;
+}
+
+typedef struct {
+    TestRandomSource* random;
+    TrustySecureDeletionSecretStorage* storage;
+} SecureDeletionTest_t;
+
+static void SecureDeletionTest_SetUp(SecureDeletionTest_t* state) {
+    state->random = new TestRandomSource;
+    state->storage = new TrustySecureDeletionSecretStorage(*state->random);
+
+    // Start each test from an empty secrets file.
+    state->storage->DeleteAllKeys();
+}
+
+static void SecureDeletionTest_TearDown(SecureDeletionTest_t* state) {
+    state->storage->DeleteAllKeys();
+    delete state->storage;
+    delete state->random;
+}
+
+TEST_F(SecureDeletionTest, TestDeleteKeys) {
+    TrustySecureDeletionSecretStorage* storage = _state->storage;
+    // Unsorted, with a repeat, slots that don't hold secure deletion secrets
+    // and slots past the end of the file.
+    const uint32_t slots[] = {6, 3, 4, 3, 0, 1, 40, UINT32_MAX};
+
+    // Slots 0 and 1 hold the factory reset secret, so keys start at slot 2.
+    for (uint32_t slot = 2; slot < 8; ++slot) {
+        ASSERT_EQ(slot, NewKeySlot(storage));
+    }
+
+    storage->DeleteKeys(slots, sizeof(slots) / sizeof(slots[0]));
+
+    // 3 and 4 are zeroed as one run, 6 on its own, and neighbours are kept.
+    ASSERT_EQ(true, SlotInUse(storage, 2));
+    ASSERT_EQ(false, SlotInUse(storage, 3));
+    ASSERT_EQ(false, SlotInUse(storage, 4));
+    ASSERT_EQ(true, SlotInUse(storage, 5));
+    ASSERT_EQ(false, SlotInUse(storage, 6));
+    ASSERT_EQ(true, SlotInUse(storage, 7));
+
+    // Freed slots are reused lowest first, then the file is extended.
+    ASSERT_EQ(3, NewKeySlot(storage));
+    ASSERT_EQ(4, NewKeySlot(storage));
+    ASSERT_EQ(6, NewKeySlot(storage));
+    ASSERT_EQ(8, NewKeySlot(storage));
+
+test_abort:;
+}
+
+TEST_F(SecureDeletionTest, TestDeleteKey) {
+    TrustySecureDeletionSecretStorage* storage = _state->storage;
+    uint32_t slot = NewKeySlot(storage);
+    ASSERT_EQ(2, slot);
+    ASSERT_EQ(true, SlotInUse(storage, slot));
+
+    storage->DeleteKey(slot);
+    ASSERT_EQ(false, SlotInUse(storage, slot));
+
+    // Deleting it again, or deleting nothing, is harmless.
+    storage->DeleteKey(slot);
+    storage->DeleteKeys(nullptr, 0);
+    ASSERT_EQ(slot, NewKeySlot(storage));
+
+test_abort:;
+}
+
+TEST_F(SecureDeletionTest, TestShrinkSecretsFile) {
+    TrustySecureDeletionSecretStorage* storage = _state->storage;
+    // Fill the first block, slots 2 to 31, and two slots of the second.
+    for (uint32_t slot = 2; slot < 34; ++slot) {
+        ASSERT_EQ(slot, NewKeySlot(storage));
+    }
+    ASSERT_EQ(2 * SECRETS_BLOCK_SIZE, SecretsFileSize());
+    ASSERT_EQ(false, storage->ShrinkPending());
+
+    // Only deletions from the last block make the file shrinkable.
+    storage->DeleteKey(5);
+    ASSERT_EQ(false, storage->ShrinkPending());
+
+    // Slot 32 is still in use, so the second block is kept.
+    storage->DeleteKey(33);
+    ASSERT_EQ(true, storage->ShrinkPending());
+    ASSERT_EQ(true, storage->ShrinkSecretsFile());
+    ASSERT_EQ(false, storage->ShrinkPending());
+    ASSERT_EQ(2 * SECRETS_BLOCK_SIZE, SecretsFileSize());
+
+    // With the second block empty, the file is cut back to the first block.
+    storage->DeleteKey(32);
+    ASSERT_EQ(true, storage->ShrinkPending());
+    ASSERT_EQ(true, storage->ShrinkSecretsFile());
+    ASSERT_EQ(false, storage->ShrinkPending());
+    ASSERT_EQ(SECRETS_BLOCK_SIZE, SecretsFileSize());
+    ASSERT_EQ(true, SlotInUse(storage, 2));
+    ASSERT_EQ(false, SlotInUse(storage, 5));
+    ASSERT_EQ(true, SlotInUse(storage, 31));
+
+    // The slot map matches the file: the freed slot is reused, then the file
+    // grows by a block again.
+    ASSERT_EQ(5, NewKeySlot(storage));
+    ASSERT_EQ(32, NewKeySlot(storage));
+    ASSERT_EQ(2 * SECRETS_BLOCK_SIZE, SecretsFileSize());
+
+    {
+        // A map loaded from the file agrees.
+        TrustySecureDeletionSecretStorage reloaded(*_state->random);
+        ASSERT_EQ(33, NewKeySlot(&reloaded));
+    }
+
+test_abort:;
+}
+
+TEST_F(SecureDeletionTest, TestShrinkKeepsFirstBlock) {
+    TrustySecureDeletionSecretStorage* storage = _state->storage;
+    const uint32_t slots[] = {2, 3};
+    ASSERT_EQ(2, NewKeySlot(storage));
+    ASSERT_EQ(3, NewKeySlot(storage));
+
+    // The first block holds the factory reset secret, so it is never
+    // truncated, even with no keys left.
+    storage->DeleteKeys(slots, sizeof(slots) / sizeof(slots[0]));
+    ASSERT_EQ(true, storage->ShrinkPending());
+    ASSERT_EQ(true, storage->ShrinkSecretsFile());
+    ASSERT_EQ(false, storage->ShrinkPending());
+    ASSERT_EQ(SECRETS_BLOCK_SIZE, SecretsFileSize());
+    ASSERT_EQ(2, NewKeySlot(storage));
+
+test_abort:;
+}
+
 static bool keymaster_test(struct unittest* test) {
     return RUN_ALL_TESTS();
 }
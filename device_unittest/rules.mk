@@ -34,8 +34,14 @@ MANIFEST := $(LOCAL_DIR)/manifest.json
 
 MODULE_SRCS += \
 	$(KEYMASTER_DIR)/secure_storage_manager.cpp \
+	$(KEYMASTER_DIR)/trusty_key_blob_cache.cpp \
+	$(KEYMASTER_DIR)/trusty_secure_deletion_secret_storage.cpp \
 	$(LOCAL_DIR)/main.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/android_keymaster_utils.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/authorization_set.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/keymaster_tags.cpp \
 	$(KEYMASTER_ROOT)/android_keymaster/logger.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/serializable.cpp \
 	$(KEYMASTER_DIR)/keymaster_attributes.pb.c \
 	$(NANOPB_DIR)/pb_common.c \
 	$(NANOPB_DIR)/pb_encode.c \
@@ -47,6 +53,7 @@ MODULE_LIBRARY_DEPS += \
 	trusty/user/base/lib/rng \
 	trusty/user/base/lib/storage \
 	trusty/user/base/lib/unittest \
+	external/boringssl \
 
 MODULE_COMPILEFLAGS += -DPB_FIELD_16BIT
 MODULE_COMPILEFLAGS += -DPB_NO_STATIC_ASSERT
@@ -0,0 +1,232 @@
+/*
+ * Copyright 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Host benchmarks for the storage and serialization paths, run against the
+ * mock storage.  Each benchmark prints the average wall-clock time per
+ * iteration and, for storage paths, the average number of storage calls,
+ * which is what dominates on a device.
+ *
+ * Serialization is only measured for the requests on the key generation and
+ * operation paths, which are the ones sent often or with large payloads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <keymaster/UniquePtr.h>
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/android_keymaster_utils.h>
+
+#include "secure_storage_manager.h"
+#include "trusty_keymaster_messages.h"
+
+using keymaster::AttestationKeySlot;
+using keymaster::CertificateChain;
+using keymaster::KeymasterKeyBlob;
+using keymaster::SecureStorageManager;
+
+#define KEY_SIZE 2048
+#define CERT_SIZE 2048
+#define CHAIN_LENGTH 3
+
+static const int32_t kMessageVersion = 4;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t total_storage_calls() {
+    SecureStorageManager::StorageStats stats =
+            SecureStorageManager::GetStorageStats();
+    return stats.open_file + stats.read + stats.write + stats.get_file_size +
+           stats.set_file_size + stats.delete_file + stats.end_transaction;
+}
+
+/*
+ * Runs |body| |iterations| times and prints the results.  |body| returns
+ * false on failure, which stops the benchmark.
+ */
+template <typename Body>
+static bool run_benchmark(const char* name, int iterations, Body body) {
+    SecureStorageManager::ResetStorageStats();
+    uint64_t start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        if (!body(i)) {
+            fprintf(stderr, "%s: failed at iteration %d\n", name, i);
+            return false;
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+    printf("%-48s %10llu ns/iter %8.1f storage calls/iter\n", name,
+           static_cast<unsigned long long>(elapsed / iterations),
+           static_cast<double>(total_storage_calls()) / iterations);
+    return true;
+}
+
+static keymaster::UniquePtr<uint8_t[]> new_rand_buf(size_t size) {
+    keymaster::UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    for (size_t i = 0; i < size; i++) {
+        buf[i] = static_cast<uint8_t>(rand());
+    }
+    return buf;
+}
+
+static bool write_attestation_key(SecureStorageManager* ss_manager,
+                                  AttestationKeySlot key_slot,
+                                  const uint8_t* key,
+                                  const uint8_t* cert) {
+    if (ss_manager->WriteKeyToStorage(key_slot, key, KEY_SIZE) !=
+        KM_ERROR_OK) {
+        return false;
+    }
+    for (uint32_t i = 0; i < CHAIN_LENGTH; i++) {
+        if (ss_manager->WriteCertToStorage(key_slot, cert, CERT_SIZE, i) !=
+            KM_ERROR_OK) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool read_attestation_key(SecureStorageManager* ss_manager,
+                                 AttestationKeySlot key_slot) {
+    keymaster_error_t error;
+    KeymasterKeyBlob key = ss_manager->ReadKeyFromStorage(key_slot, &error);
+    if (error != KM_ERROR_OK || key.key_material_size != KEY_SIZE) {
+        return false;
+    }
+    CertificateChain chain;
+    return ss_manager->ReadCertChainFromStorage(key_slot, &chain) ==
+                   KM_ERROR_OK &&
+           chain.entry_count == CHAIN_LENGTH;
+}
+
+static bool benchmark_attestation_keys() {
+    SecureStorageManager* ss_manager = SecureStorageManager::get_instance();
+    if (ss_manager == nullptr ||
+        ss_manager->DeleteAllAttestationData() != KM_ERROR_OK) {
+        return false;
+    }
+
+    keymaster::UniquePtr<uint8_t[]> key = new_rand_buf(KEY_SIZE);
+    keymaster::UniquePtr<uint8_t[]> cert = new_rand_buf(CERT_SIZE);
+    const AttestationKeySlot slots[] = {AttestationKeySlot::kRsa,
+                                        AttestationKeySlot::kEcdsa,
+                                        AttestationKeySlot::kEddsa};
+    const int num_slots = sizeof(slots) / sizeof(slots[0]);
+
+    bool ok = run_benchmark("attestation key write (key + 3 certs)", 100,
+                            [&](int i) {
+                                return write_attestation_key(
+                                        ss_manager, slots[i % num_slots],
+                                        key.get(), cert.get());
+                            }) &&
+              run_benchmark("attestation key read, same slot", 1000,
+                            [&](int) {
+                                return read_attestation_key(
+                                        ss_manager, AttestationKeySlot::kRsa);
+                            }) &&
+              // More slots than the attestation key cache holds, so every
+              // key read misses the cache.
+              run_benchmark("attestation key read, rotating slots", 1000,
+                            [&](int i) {
+                                return read_attestation_key(
+                                        ss_manager, slots[i % num_slots]);
+                            });
+
+    ss_manager->DeleteAllAttestationData();
+    return ok;
+}
+
+/*
+ * Serializes |request| and deserializes it into a fresh message of the same
+ * type, as the client and the service do for each request.
+ */
+template <typename Message>
+static bool round_trip(const Message& request) {
+    size_t size = request.SerializedSize();
+    keymaster::UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    const uint8_t* end = buf.get() + size;
+    if (request.Serialize(buf.get(), end) != end) {
+        return false;
+    }
+    Message parsed(kMessageVersion);
+    const uint8_t* p = buf.get();
+    return parsed.Deserialize(&p, end) && p == end;
+}
+
+static bool benchmark_messages() {
+    keymaster::UniquePtr<uint8_t[]> data = new_rand_buf(1024);
+    keymaster::AuthorizationSet params(keymaster::AuthorizationSetBuilder()
+                                               .RsaSigningKey(2048, 65537)
+                                               .Digest(KM_DIGEST_SHA_2_256)
+                                               .Padding(KM_PAD_RSA_PSS));
+
+    keymaster::GenerateKeyRequest generate(kMessageVersion);
+    generate.key_description = params;
+
+    keymaster::BeginOperationRequest begin(kMessageVersion);
+    begin.purpose = KM_PURPOSE_SIGN;
+    begin.SetKeyMaterial(data.get(), 512);
+    begin.additional_params = params;
+
+    keymaster::UpdateOperationRequest update(kMessageVersion);
+    update.op_handle = 1;
+    update.input.Reinitialize(data.get(), 1024);
+
+    keymaster::FinishOperationRequest finish(kMessageVersion);
+    finish.op_handle = 1;
+    finish.input.Reinitialize(data.get(), 1024);
+
+    keymaster::UpdateOperationBatchRequest update_batch(kMessageVersion);
+    update_batch.op_handle = 1;
+    update_batch.chunk_count = 4;
+    update_batch.chunks.reset(new keymaster::Buffer[4]);
+    for (int i = 0; i < 4; i++) {
+        update_batch.chunks[i].Reinitialize(data.get(), 1024);
+    }
+    update_batch.finish = 1;
+
+    keymaster::GenerateRkpKeyBatchRequest rkp_batch(kMessageVersion);
+    rkp_batch.key_count = keymaster::kMaxRkpKeyBatchKeys;
+
+    const int kIterations = 10000;
+    return run_benchmark("KM_GENERATE_KEY request round trip", kIterations,
+                         [&](int) { return round_trip(generate); }) &&
+           run_benchmark("KM_BEGIN_OPERATION request round trip", kIterations,
+                         [&](int) { return round_trip(begin); }) &&
+           run_benchmark("KM_UPDATE_OPERATION request round trip", kIterations,
+                         [&](int) { return round_trip(update); }) &&
+           run_benchmark("KM_FINISH_OPERATION request round trip", kIterations,
+                         [&](int) { return round_trip(finish); }) &&
+           run_benchmark("KM_UPDATE_OPERATION_BATCH request round trip",
+                         kIterations,
+                         [&](int) { return round_trip(update_batch); }) &&
+           run_benchmark("KM_GENERATE_RKP_KEY_BATCH request round trip",
+                         kIterations,
+                         [&](int) { return round_trip(rkp_batch); });
+}
+
+int main(void) {
+    bool ok = benchmark_attestation_keys();
+    ok = benchmark_messages() && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,65 @@
+# Copyright (C) 2021 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+ATAP_DIR := $(TRUSTY_TOP)/system/iot/attestation/atap
+KEYMASTER_ROOT := system/keymaster
+KEYMASTER_DIR := trusty/user/app/keymaster
+NANOPB_DIR := external/nanopb-c
+HOST_TEST := keymaster_benchmark
+
+HOST_SRCS += \
+	$(KEYMASTER_DIR)/secure_storage_manager.cpp \
+	$(KEYMASTER_DIR)/host_benchmark/main.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/android_keymaster_messages.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/android_keymaster_utils.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/authorization_set.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/keymaster_tags.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/logger.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/serializable.cpp \
+	$(ATAP_DIR)/libatap/atap_util.c \
+	$(ATAP_DIR)/libatap/atap_sysdeps_posix.c \
+	$(KEYMASTER_DIR)/keymaster_attributes.pb.c \
+	$(NANOPB_DIR)/pb_common.c \
+	$(NANOPB_DIR)/pb_encode.c \
+	$(NANOPB_DIR)/pb_decode.c \
+
+HOST_INCLUDE_DIRS := \
+	$(KEYMASTER_ROOT) \
+	$(KEYMASTER_DIR) \
+	$(KEYMASTER_ROOT)/include \
+	hardware/libhardware/include \
+	lib/lib/storage/include \
+	lib/interface/storage/include \
+	$(NANOPB_DIR) \
+	$(ATAP_DIR) \
+
+HOST_FLAGS := -Wpointer-arith \
+	-Wno-deprecated-declarations -fno-exceptions \
+	-Wno-error=c++14-extensions \
+	-DSTORAGE_FAKE \
+	-DKEYMASTER_STORAGE_STATS \
+	-DPB_FIELD_16BIT \
+	-DPB_NO_STATIC_ASSERT \
+
+HOST_LIBS := \
+	stdc++ \
+
+# These rules are used to force .pb.h file to be generated before compiling
+# these files.
+$(KEYMASTER_DIR)/secure_storage_manager.cpp: $(NANOPB_GENERATED_HEADER)
+$(KEYMASTER_DIR)/host_benchmark/main.cpp: $(NANOPB_GENERATED_HEADER)
+
+include trusty/user/app/storage/storage_mock/add_mock_storage.mk
+include make/host_test.mk
@@ -49,18 +49,27 @@ extern "C" {
 }
 
 #include <keymaster/android_keymaster_utils.h>
+#include "ipc/keymaster_multipart_request.h"
 #include "secure_storage_manager.h"
+#include "trusty_keymaster_messages.h"
 
 #define DATA_SIZE 2048
 #define CHAIN_LENGTH 3
 
 #define TLOG_TAG "km_storage_test"
 
+#define MESSAGE_VERSION 4
+
+/* KM_UPDATE_OPERATION_BATCH and KM_DELETE_KEYS, see ipc/keymaster_ipc.h */
+#define UPDATE_BATCH_CMD (34 << 2)
+#define DELETE_KEYS_CMD (37 << 2)
+
 using keymaster::AttestationKeySlot;
 using keymaster::CertificateChain;
 using keymaster::kAttestationUuidSize;
 using keymaster::KeymasterKeyBlob;
 using keymaster::kProductIdSize;
+using keymaster::MultipartRequest;
 using keymaster::SecureStorageManager;
 
 uint8_t* NewRandBuf(size_t size) {
@@ -271,6 +280,122 @@ void DeleteAttestationData() {
 test_abort:;
 }
 
+// Exercises the attestation key cache with more slots than it can hold.
+void TestKeyStorageManySlots() {
+    keymaster_error_t error = KM_ERROR_OK;
+    AttestationKeySlot key_slots[] = {AttestationKeySlot::kRsa,
+                                      AttestationKeySlot::kEcdsa,
+                                      AttestationKeySlot::kEddsa};
+    const size_t num_slots = sizeof(key_slots) / sizeof(key_slots[0]);
+    keymaster::UniquePtr<uint8_t[]> write_key[num_slots];
+    KeymasterKeyBlob key_blob;
+    bool key_exists = true;
+
+    SecureStorageManager* ss_manager = SecureStorageManager::get_instance();
+    ASSERT_NE(nullptr, ss_manager);
+
+    for (size_t i = 0; i < num_slots; i++) {
+        write_key[i].reset(NewRandBuf(DATA_SIZE));
+        ASSERT_NE(nullptr, write_key[i].get());
+        error = ss_manager->WriteKeyToStorage(key_slots[i], write_key[i].get(),
+                                              DATA_SIZE);
+        ASSERT_EQ(KM_ERROR_OK, error);
+    }
+
+    // Read every slot twice, so that both cached and evicted slots are read.
+    for (size_t round = 0; round < 2; round++) {
+        for (size_t i = 0; i < num_slots; i++) {
+            key_blob = ss_manager->ReadKeyFromStorage(key_slots[i], &error);
+            ASSERT_EQ(KM_ERROR_OK, error);
+            ASSERT_EQ(DATA_SIZE, key_blob.key_material_size);
+            ASSERT_EQ(0, memcmp(write_key[i].get(), key_blob.writable_data(),
+                                DATA_SIZE));
+        }
+    }
+
+    // A deleted key must not be served from the cache.
+    error = ss_manager->DeleteKey(AttestationKeySlot::kEddsa, true);
+    ASSERT_EQ(KM_ERROR_OK, error);
+    error = ss_manager->AttestationKeyExists(AttestationKeySlot::kEddsa,
+                                             &key_exists);
+    ASSERT_EQ(KM_ERROR_OK, error);
+    ASSERT_EQ(false, key_exists);
+
+test_abort:;
+}
+
+void TestStagedWrites() {
+    keymaster_error_t error = KM_ERROR_OK;
+    keymaster::UniquePtr<uint8_t[]> write_key;
+    keymaster::UniquePtr<uint8_t[]> write_cert;
+    keymaster::UniquePtr<uint8_t[]> other_key;
+    KeymasterKeyBlob key_blob;
+    bool key_exists = true;
+    uint32_t cert_chain_length;
+
+    SecureStorageManager* ss_manager = SecureStorageManager::get_instance();
+    ASSERT_NE(nullptr, ss_manager);
+
+    write_key.reset(NewRandBuf(DATA_SIZE));
+    ASSERT_NE(nullptr, write_key.get());
+    write_cert.reset(NewRandBuf(DATA_SIZE));
+    ASSERT_NE(nullptr, write_cert.get());
+
+    // Discarded writes must not be stored.
+    error = ss_manager->WriteKeyToStorage(AttestationKeySlot::kRsa,
+                                          write_key.get(), DATA_SIZE, false);
+    ASSERT_EQ(KM_ERROR_OK, error);
+    error = ss_manager->WriteCertToStorage(
+            AttestationKeySlot::kRsa, write_cert.get(), DATA_SIZE, 0, false);
+    ASSERT_EQ(KM_ERROR_OK, error);
+    error = ss_manager->EndTransaction(false);
+    ASSERT_EQ(KM_ERROR_OK, error);
+
+    error = ss_manager->AttestationKeyExists(AttestationKeySlot::kRsa,
+                                             &key_exists);
+    ASSERT_EQ(KM_ERROR_OK, error);
+    ASSERT_EQ(false, key_exists);
+
+    // Committed writes are stored together.
+    error = ss_manager->WriteKeyToStorage(AttestationKeySlot::kRsa,
+                                          write_key.get(), DATA_SIZE, false);
+    ASSERT_EQ(KM_ERROR_OK, error);
+    error = ss_manager->WriteCertToStorage(
+            AttestationKeySlot::kRsa, write_cert.get(), DATA_SIZE, 0, false);
+    ASSERT_EQ(KM_ERROR_OK, error);
+    error = ss_manager->EndTransaction(true);
+    ASSERT_EQ(KM_ERROR_OK, error);
+
+    key_blob = ss_manager->ReadKeyFromStorage(AttestationKeySlot::kRsa, &error);
+    ASSERT_EQ(KM_ERROR_OK, error);
+    ASSERT_EQ(DATA_SIZE, key_blob.key_material_size);
+    ASSERT_EQ(0,
+              memcmp(write_key.get(), key_blob.writable_data(), DATA_SIZE));
+    error = ss_manager->ReadCertChainLength(AttestationKeySlot::kRsa,
+                                            &cert_chain_length);
+    ASSERT_EQ(KM_ERROR_OK, error);
+    ASSERT_EQ(1, cert_chain_length);
+
+    // Reading staged data must not leave it cached once it is discarded.
+    other_key.reset(NewRandBuf(DATA_SIZE));
+    ASSERT_NE(nullptr, other_key.get());
+    error = ss_manager->WriteKeyToStorage(AttestationKeySlot::kRsa,
+                                          other_key.get(), DATA_SIZE, false);
+    ASSERT_EQ(KM_ERROR_OK, error);
+    key_blob = ss_manager->ReadKeyFromStorage(AttestationKeySlot::kRsa, &error);
+    ASSERT_EQ(KM_ERROR_OK, error);
+    error = ss_manager->EndTransaction(false);
+    ASSERT_EQ(KM_ERROR_OK, error);
+
+    key_blob = ss_manager->ReadKeyFromStorage(AttestationKeySlot::kRsa, &error);
+    ASSERT_EQ(KM_ERROR_OK, error);
+    ASSERT_EQ(DATA_SIZE, key_blob.key_material_size);
+    ASSERT_EQ(0,
+              memcmp(write_key.get(), key_blob.writable_data(), DATA_SIZE));
+
+test_abort:;
+}
+
 void TestUuidStorage() {
     keymaster_error_t error = KM_ERROR_OK;
     keymaster::UniquePtr<uint8_t[]> write_uuid;
@@ -373,6 +498,7 @@ void TestFormatChange() {
     AttestationKeySlot key_slots[] = {AttestationKeySlot::kRsa,
                                       AttestationKeySlot::kEcdsa};
     keymaster::UniquePtr<uint8_t[]> write_cert[2][CHAIN_LENGTH];
+    keymaster::UniquePtr<uint8_t[]> proto_key;
     CertificateChain chain;
 
     SecureStorageManager* ss_manager =
@@ -398,6 +524,13 @@ void TestFormatChange() {
         }
     }
 
+    // Write a key in the protobuf format.
+    proto_key.reset(NewRandBuf(DATA_SIZE));
+    ASSERT_NE(nullptr, proto_key.get());
+    error = ss_manager->LegacyWriteProtobufKeyToStorage(
+            AttestationKeySlot::kEddsa, proto_key.get(), DATA_SIZE);
+    ASSERT_EQ(KM_ERROR_OK, error);
+
     // Try to translate the format.
     ss_manager = SecureStorageManager::get_instance();
     ASSERT_NE(nullptr, ss_manager);
@@ -432,6 +565,13 @@ void TestFormatChange() {
         }
     }
 
+    key_blob = ss_manager->ReadKeyFromStorage(AttestationKeySlot::kEddsa,
+                                              &error);
+    ASSERT_EQ(KM_ERROR_OK, error);
+    ASSERT_EQ(DATA_SIZE, key_blob.key_material_size);
+    ASSERT_EQ(0,
+              memcmp(proto_key.get(), key_blob.writable_data(), DATA_SIZE));
+
     DeleteAttestationData();
     ss_manager->DeleteProductId();
     ss_manager->DeleteAttestationUuid();
@@ -487,6 +627,14 @@ TEST_F(KeymasterTest, TestRewriteChain) {
     TestCertChainStorage(AttestationKeySlot::kRsa, true);
 }
 
+TEST_F(KeymasterTest, TestKeyStorageManySlots) {
+    TestKeyStorageManySlots();
+}
+
+TEST_F(KeymasterTest, TestStagedWrites) {
+    TestStagedWrites();
+}
+
 TEST_F(KeymasterTest, TestCertStorageInvalid) {
     TestCertStorageInvalid(AttestationKeySlot::kRsa);
 }
@@ -505,8 +653,206 @@ TEST_F(KeymasterTest, TestProductIdStoragePreventOverwrite) {
 }
 #endif
 
+/*
+ * Serializes |in| and deserializes the result into |out|, as the client and
+ * the service do for each request.
+ */
+template <typename Message>
+static bool RoundTrip(const Message& in, Message* out) {
+    size_t size = in.SerializedSize();
+    keymaster::UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    const uint8_t* end = buf.get() + size;
+    if (in.Serialize(buf.get(), end) != end) {
+        return false;
+    }
+    const uint8_t* p = buf.get();
+    return out->Deserialize(&p, end) && p == end;
+}
+
+static bool BufferEquals(const keymaster::Buffer& a,
+                         const keymaster::Buffer& b) {
+    return a.available_read() == b.available_read() &&
+           memcmp(a.peek_read(), b.peek_read(), a.available_read()) == 0;
+}
+
+TEST(KeymasterMessageTest, TestUpdateOperationBatchRequest) {
+    const uint32_t kChunks = 3;
+    keymaster::UniquePtr<uint8_t[]> data(NewRandBuf(DATA_SIZE));
+    keymaster::UpdateOperationBatchRequest in(MESSAGE_VERSION);
+    keymaster::UpdateOperationBatchRequest out(MESSAGE_VERSION);
+
+    in.op_handle = 0x123456789abcdef0;
+    in.additional_params.push_back(keymaster::TAG_MAC_LENGTH, 128);
+    in.chunk_count = kChunks;
+    in.chunks.reset(new keymaster::Buffer[kChunks]);
+    for (uint32_t i = 0; i < kChunks; ++i) {
+        in.chunks[i].Reinitialize(data.get() + i, DATA_SIZE - i);
+    }
+    in.finish = 1;
+    in.signature.Reinitialize(data.get(), 64);
+    in.finish_params.push_back(keymaster::TAG_MAC_LENGTH, 256);
+
+    ASSERT_EQ(true, RoundTrip(in, &out));
+    ASSERT_EQ(in.op_handle, out.op_handle);
+    ASSERT_EQ(true, in.additional_params == out.additional_params);
+    ASSERT_EQ(kChunks, out.chunk_count);
+    for (uint32_t i = 0; i < kChunks; ++i) {
+        ASSERT_EQ(true, BufferEquals(in.chunks[i], out.chunks[i]));
+    }
+    ASSERT_EQ(1, out.finish);
+    ASSERT_EQ(true, BufferEquals(in.signature, out.signature));
+    ASSERT_EQ(true, in.finish_params == out.finish_params);
+
+test_abort:;
+}
+
+TEST(KeymasterMessageTest, TestUpdateOperationBatchRequestTooManyChunks) {
+    const uint32_t kChunks = keymaster::kMaxUpdateBatchChunks + 1;
+    keymaster::UpdateOperationBatchRequest in(MESSAGE_VERSION);
+    keymaster::UpdateOperationBatchRequest out(MESSAGE_VERSION);
+
+    in.chunk_count = kChunks;
+    in.chunks.reset(new keymaster::Buffer[kChunks]);
+    ASSERT_EQ(false, RoundTrip(in, &out));
+
+test_abort:;
+}
+
+TEST(KeymasterMessageTest, TestUpdateOperationBatchResponse) {
+    keymaster::UniquePtr<uint8_t[]> data(NewRandBuf(DATA_SIZE));
+    keymaster::UpdateOperationBatchResponse in(MESSAGE_VERSION);
+    keymaster::UpdateOperationBatchResponse out(MESSAGE_VERSION);
+
+    in.error = KM_ERROR_OK;
+    in.output.Reinitialize(data.get(), DATA_SIZE);
+    in.output_params.push_back(keymaster::TAG_MAC_LENGTH, 128);
+
+    ASSERT_EQ(true, RoundTrip(in, &out));
+    ASSERT_EQ(KM_ERROR_OK, out.error);
+    ASSERT_EQ(true, BufferEquals(in.output, out.output));
+    ASSERT_EQ(true, in.output_params == out.output_params);
+
+test_abort:;
+}
+
+TEST(KeymasterMessageTest, TestDeleteKeysRequest) {
+    const uint32_t kKeys = 3;
+    keymaster::UniquePtr<uint8_t[]> data(NewRandBuf(DATA_SIZE));
+    keymaster::DeleteKeysRequest in(MESSAGE_VERSION);
+    keymaster::DeleteKeysRequest out(MESSAGE_VERSION);
+
+    in.key_count = kKeys;
+    in.key_blobs.reset(new keymaster::Buffer[kKeys]);
+    for (uint32_t i = 0; i < kKeys; ++i) {
+        in.key_blobs[i].Reinitialize(data.get() + i, DATA_SIZE / kKeys);
+    }
+
+    ASSERT_EQ(true, RoundTrip(in, &out));
+    ASSERT_EQ(kKeys, out.key_count);
+    for (uint32_t i = 0; i < kKeys; ++i) {
+        ASSERT_EQ(true, BufferEquals(in.key_blobs[i], out.key_blobs[i]));
+    }
+
+    /* an empty request is valid */
+    in.key_count = 0;
+    ASSERT_EQ(true, RoundTrip(in, &out));
+    ASSERT_EQ(0, out.key_count);
+
+test_abort:;
+}
+
+TEST(KeymasterMessageTest, TestDeleteKeysRequestTooManyKeys) {
+    const uint32_t kKeys = keymaster::kMaxDeleteKeysBatchKeys + 1;
+    keymaster::DeleteKeysRequest in(MESSAGE_VERSION);
+    keymaster::DeleteKeysRequest out(MESSAGE_VERSION);
+
+    in.key_count = kKeys;
+    in.key_blobs.reset(new keymaster::Buffer[kKeys]);
+    ASSERT_EQ(false, RoundTrip(in, &out));
+
+test_abort:;
+}
+
+TEST(KeymasterMessageTest, TestMultipartRequest) {
+    const uint32_t kCmd = UPDATE_BATCH_CMD;
+    const uint8_t parts[][3] = {{1, 2, 3}, {4, 5, 6}, {7, 8, 9}};
+    MultipartRequest req(64);
+    uint32_t cmd;
+
+    ASSERT_EQ(false, req.in_progress());
+    ASSERT_EQ(false, req.AddPart(kCmd, false, parts[0], sizeof(parts[0])));
+    ASSERT_EQ(true, req.in_progress());
+    ASSERT_EQ(false, req.AddPart(kCmd, false, parts[1], sizeof(parts[1])));
+    ASSERT_EQ(true, req.AddPart(kCmd, true, parts[2], sizeof(parts[2])));
+    ASSERT_EQ(KM_ERROR_OK, req.error());
+
+    /* the command, then the payload of each part in order */
+    ASSERT_EQ(sizeof(cmd) + sizeof(parts), req.size());
+    memcpy(&cmd, req.data(), sizeof(cmd));
+    ASSERT_EQ(kCmd, cmd);
+    ASSERT_EQ(0, memcmp(parts, req.data() + sizeof(cmd), sizeof(parts)));
+
+    req.Reset();
+    ASSERT_EQ(false, req.in_progress());
+    ASSERT_EQ(nullptr, req.data());
+
+    /* a request with a single part */
+    ASSERT_EQ(true, req.AddPart(kCmd, true, parts[0], sizeof(parts[0])));
+    ASSERT_EQ(KM_ERROR_OK, req.error());
+    ASSERT_EQ(sizeof(cmd) + sizeof(parts[0]), req.size());
+
+test_abort:;
+}
+
+TEST(KeymasterMessageTest, TestMultipartRequestTooLarge) {
+    const uint32_t kCmd = UPDATE_BATCH_CMD;
+    uint8_t part[8] = {};
+    MultipartRequest req(sizeof(uint32_t) + sizeof(part) + 1);
+
+    ASSERT_EQ(false, req.AddPart(kCmd, false, part, sizeof(part)));
+    ASSERT_EQ(KM_ERROR_OK, req.error());
+    ASSERT_EQ(false, req.AddPart(kCmd, false, part, sizeof(part)));
+    ASSERT_EQ(KM_ERROR_INVALID_INPUT_LENGTH, req.error());
+    ASSERT_EQ(nullptr, req.data());
+
+    /* the rest of the request is dropped until its last part */
+    ASSERT_EQ(false, req.AddPart(kCmd, false, part, 1));
+    ASSERT_EQ(true, req.AddPart(kCmd, true, part, 1));
+    ASSERT_EQ(KM_ERROR_INVALID_INPUT_LENGTH, req.error());
+
+    /* the next request starts afresh */
+    req.Reset();
+    ASSERT_EQ(true, req.AddPart(kCmd, true, part, sizeof(part)));
+    ASSERT_EQ(KM_ERROR_OK, req.error());
+
+test_abort:;
+}
+
+TEST(KeymasterMessageTest, TestMultipartRequestMissingStopBit) {
+    const uint32_t kCmd = UPDATE_BATCH_CMD;
+    const uint32_t kOtherCmd = DELETE_KEYS_CMD;
+    uint8_t part[8] = {};
+    MultipartRequest req(64);
+
+    /* a new command arrives before the last part of the first one */
+    ASSERT_EQ(false, req.AddPart(kCmd, false, part, sizeof(part)));
+    ASSERT_EQ(false, req.AddPart(kOtherCmd, false, part, sizeof(part)));
+    ASSERT_EQ(KM_ERROR_INVALID_ARGUMENT, req.error());
+    ASSERT_EQ(nullptr, req.data());
+    ASSERT_EQ(true, req.AddPart(kOtherCmd, true, part, sizeof(part)));
+    ASSERT_EQ(KM_ERROR_INVALID_ARGUMENT, req.error());
+
+    req.Reset();
+    ASSERT_EQ(false, req.in_progress());
+    ASSERT_EQ(true, req.AddPart(kOtherCmd, true, part, sizeof(part)));
+    ASSERT_EQ(KM_ERROR_OK, req.error());
+
+test_abort:;
+}
+
 int main(void) {
     bool passed1 = RUN_ALL_SUITE_TESTS("KeymasterFormatChangeTest");
     bool passed2 = RUN_ALL_SUITE_TESTS("KeymasterTest");
-    return (passed1 && passed2) ? 0 : 1;
+    bool passed3 = RUN_ALL_SUITE_TESTS("KeymasterMessageTest");
+    return (passed1 && passed2 && passed3) ? 0 : 1;
 }
@@ -22,7 +22,13 @@ HOST_TEST := keymaster_test
 HOST_SRCS += \
 	$(KEYMASTER_DIR)/secure_storage_manager.cpp \
 	$(KEYMASTER_DIR)/host_unittest/main.cpp \
+	$(KEYMASTER_DIR)/ipc/keymaster_multipart_request.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/android_keymaster_messages.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/android_keymaster_utils.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/authorization_set.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/keymaster_tags.cpp \
 	$(KEYMASTER_ROOT)/android_keymaster/logger.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/serializable.cpp \
 	$(ATAP_DIR)/libatap/atap_util.c \
 	$(ATAP_DIR)/libatap/atap_sysdeps_posix.c \
 	$(KEYMASTER_DIR)/keymaster_attributes.pb.c \
@@ -22,16 +22,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/auxv.h>
+#include <sys/mman.h>
 #include <trusty_ipc.h>
 #include <uapi/err.h>
 
 #include <interface/keymaster/keymaster.h>
 
 #include <keymaster/UniquePtr.h>
+#include <keymaster/android_keymaster_utils.h>
+
+#include <array>
+#include <iterator>
+#include <new>
 
 #include <openssl/crypto.h>
 
+#include "keymaster_multipart_request.h"
 #include "trusty_keymaster.h"
+#include "trusty_keymaster_metrics.h"
 #include "trusty_logger.h"
 
 using namespace keymaster;
@@ -42,20 +51,59 @@ struct tipc_event_handler {
     void* priv;
 };
 
+struct keymaster_srv_ctx;
+
 struct keymaster_chan_ctx {
     struct tipc_event_handler handler;
     uuid_t uuid;
     handle_t chan;
+    keymaster_srv_ctx* srv;
+    bool secure;
+    /* next channel on the secure port, see keymaster_srv_ctx */
+    keymaster_chan_ctx* next_secure;
     long (*dispatch)(keymaster_chan_ctx*,
                      keymaster_message*,
                      uint32_t,
-                     keymaster::UniquePtr<uint8_t[]>*,
-                     uint32_t*);
+                     struct keymaster_response*);
+    /* multi-part request being received on this channel */
+    MultipartRequest req{KEYMASTER_MAX_MULTIPART_LENGTH};
+    /* memref handle attached to the message being handled, if any */
+    handle_t memref;
+};
+
+/*
+ * A serialized response.  |data| points either to keymaster_send_buf or, for
+ * responses too large for it, to |heap_buf|.
+ */
+struct keymaster_response {
+    uint8_t* data = nullptr;
+    uint32_t size = 0;
+    keymaster::UniquePtr<uint8_t[]> heap_buf;
+    /* error carried in the serialized response, for metrics */
+    keymaster_error_t error = KM_ERROR_OK;
 };
 
 struct keymaster_srv_ctx {
     handle_t port_secure;
     handle_t port_non_secure;
+    /*
+     * Incoming messages are read into this buffer, with one extra byte for a
+     * null terminator.  Messages are bounded by the buffer size given to
+     * port_create.  A request is deserialized before it is handled, so the
+     * buffer can be reused by a secure request served at a checkpoint.
+     */
+    alignas(64) uint8_t recv_buf[KEYMASTER_MAX_BUFFER_LENGTH + 1];
+    /*
+     * Open channels on the secure port, checked for waiting requests before
+     * each non-secure request and at checkpoints of long operations.
+     */
+    keymaster_chan_ctx* secure_chans;
+    bool serving_secure;
+    /*
+     * Total time spent serving secure requests at checkpoints, so that the
+     * latency recorded for the interrupted request can leave it out.
+     */
+    uint64_t secure_us;
 };
 
 static void keymaster_port_handler_secure(const uevent_t* ev, void* priv);
@@ -75,6 +123,33 @@ static void keymaster_chan_handler(const uevent_t* ev, void* priv);
 
 TrustyKeymaster* device;
 
+/*
+ * Responses are serialized directly into this buffer when they fit, so the
+ * common small responses don't need a heap allocation.  Keymaster is single
+ * threaded, and a secure request served at a checkpoint of a long operation
+ * sends its response before that operation returns and serializes its own,
+ * so the buffer is never holding two responses at once.
+ */
+static uint8_t keymaster_send_buf[KEYMASTER_MAX_BUFFER_LENGTH]
+        __attribute__((aligned(8)));
+
+/*
+ * Returns a buffer of |size| bytes for |rsp|, or NULL if it cannot be
+ * allocated.
+ */
+static uint8_t* keymaster_response_alloc(keymaster_response* rsp,
+                                         uint32_t size) {
+    if (size <= sizeof(keymaster_send_buf)) {
+        rsp->heap_buf.reset();
+        rsp->data = keymaster_send_buf;
+    } else {
+        rsp->heap_buf.reset(new (std::nothrow) uint8_t[size]);
+        rsp->data = rsp->heap_buf.get();
+    }
+    rsp->size = rsp->data ? size : 0;
+    return rsp->data;
+}
+
 static long handle_port_errors(const uevent_t* ev) {
     if ((ev->event & IPC_HANDLE_POLL_ERROR) ||
         (ev->event & IPC_HANDLE_POLL_HUP) ||
@@ -174,18 +249,16 @@ static long deserialize_request(struct keymaster_message* msg,
 }
 
 template <typename Response>
-static long serialize_response(Response& rsp,
-                               keymaster::UniquePtr<uint8_t[]>* out,
-                               uint32_t* out_size) {
-    *out_size = rsp.SerializedSize();
-
-    out->reset(new uint8_t[*out_size]);
-    if (out->get() == NULL) {
-        *out_size = 0;
+static long serialize_response(Response& rsp, keymaster_response* out) {
+    uint32_t size = rsp.SerializedSize();
+
+    uint8_t* buf = keymaster_response_alloc(out, size);
+    if (buf == NULL) {
         return ERR_NO_MEMORY;
     }
 
-    rsp.Serialize(out->get(), out->get() + *out_size);
+    rsp.Serialize(buf, buf + size);
+    out->error = rsp.error;
 
     return NO_ERROR;
 }
@@ -194,9 +267,10 @@ template <typename Keymaster, typename Request, typename Response>
 static long do_dispatch(void (Keymaster::*operation)(const Request&, Response*),
                         struct keymaster_message* msg,
                         uint32_t payload_size,
-                        keymaster::UniquePtr<uint8_t[]>* out,
-                        uint32_t* out_size) {
+                        keymaster_response* out) {
     long err;
+    /* msg can be overwritten by a secure request served during operation */
+    uint32_t cmd = msg->cmd;
     Request req(device->message_version());
 
     err = deserialize_request(msg, payload_size, req);
@@ -207,12 +281,12 @@ static long do_dispatch(void (Keymaster::*operation)(const Request&, Response*),
     (device->*operation)(req, &rsp);
     LOG_D("do_dispatch #1 err: %d", rsp.error);
 
-    if (msg->cmd == KM_CONFIGURE) {
+    if (cmd == KM_CONFIGURE) {
         device->set_configure_error(rsp.error);
     }
 
-    err = serialize_response(rsp, out, out_size);
-    LOG_D("do_dispatch #1: serialized response, %d bytes", *out_size);
+    err = serialize_response(rsp, out);
+    LOG_D("do_dispatch #1: serialized response, %d bytes", out->size);
     if (err != NO_ERROR) {
         LOG_E("Error serializing response: %d", err);
     }
@@ -229,9 +303,9 @@ template <typename Keymaster, typename Request, typename Response>
 static long do_dispatch(Response (Keymaster::*operation)(const Request&),
                         struct keymaster_message* msg,
                         uint32_t payload_size,
-                        keymaster::UniquePtr<uint8_t[]>* out,
-                        uint32_t* out_size) {
+                        keymaster_response* out) {
     long err;
+    uint32_t cmd = msg->cmd;
     Request req(device->message_version());
 
     err = deserialize_request(msg, payload_size, req);
@@ -241,12 +315,12 @@ static long do_dispatch(Response (Keymaster::*operation)(const Request&),
     Response rsp = ((device->*operation)(req));
     LOG_D("do_dispatch #2 err: %d", rsp.error);
 
-    if (msg->cmd == KM_CONFIGURE) {
+    if (cmd == KM_CONFIGURE) {
         device->set_configure_error(rsp.error);
     }
 
-    err = serialize_response(rsp, out, out_size);
-    LOG_D("do_dispatch #2: serialized response, %d bytes", *out_size);
+    err = serialize_response(rsp, out);
+    LOG_D("do_dispatch #2: serialized response, %d bytes", out->size);
     if (err != NO_ERROR) {
         LOG_E("Error serializing response: %d", err);
     }
@@ -262,18 +336,18 @@ template <typename Keymaster, typename Response>
 static long do_dispatch(Response (Keymaster::*operation)(),
                         struct keymaster_message* msg,
                         uint32_t payload_size,
-                        keymaster::UniquePtr<uint8_t[]>* out,
-                        uint32_t* out_size) {
+                        keymaster_response* out) {
     long err;
+    uint32_t cmd = msg->cmd;
     Response rsp = ((device->*operation)());
     LOG_D("do_dispatch #3 err: %d", rsp.error);
 
-    if (msg->cmd == KM_CONFIGURE) {
+    if (cmd == KM_CONFIGURE) {
         device->set_configure_error(rsp.error);
     }
 
-    err = serialize_response(rsp, out, out_size);
-    LOG_D("do_dispatch #3: serialized response, %d bytes", *out_size);
+    err = serialize_response(rsp, out);
+    LOG_D("do_dispatch #3: serialized response, %d bytes", out->size);
     if (err != NO_ERROR) {
         LOG_E("Error serializing response: %d", err);
     }
@@ -281,8 +355,7 @@ static long do_dispatch(Response (Keymaster::*operation)(),
     return err;
 }
 
-static long get_auth_token_key(keymaster::UniquePtr<uint8_t[]>* key_buf,
-                               uint32_t* key_size) {
+static long get_auth_token_key(keymaster_response* out) {
     keymaster_key_blob_t key;
     long rc = device->GetAuthTokenKey(&key);
 
@@ -294,345 +367,416 @@ static long get_auth_token_key(keymaster::UniquePtr<uint8_t[]>* key_buf,
         return ERR_NOT_ENOUGH_BUFFER;
     }
 
-    key_buf->reset(new uint8_t[key.key_material_size]);
-    if (key_buf->get() == NULL) {
+    uint8_t* key_buf = keymaster_response_alloc(out, key.key_material_size);
+    if (key_buf == NULL) {
         return ERR_NO_MEMORY;
     }
 
-    *key_size = key.key_material_size;
+    memcpy(key_buf, key.key_material, key.key_material_size);
+    return NO_ERROR;
+}
+
+static long get_metrics(keymaster_response* out) {
+    KeymasterMetrics* metrics = KeymasterMetrics::get_instance();
+    size_t size = metrics->SerializedSize();
+    uint8_t* buf = keymaster_response_alloc(out, size);
+    if (buf == NULL) {
+        return ERR_NO_MEMORY;
+    }
 
-    memcpy(key_buf->get(), key.key_material, key.key_material_size);
+    metrics->Serialize(buf);
     return NO_ERROR;
 }
 
 static long keymaster_dispatch_secure(keymaster_chan_ctx* ctx,
                                       keymaster_message* msg,
                                       uint32_t payload_size,
-                                      keymaster::UniquePtr<uint8_t[]>* out,
-                                      uint32_t* out_size) {
+                                      keymaster_response* out) {
     switch (msg->cmd) {
     case KM_GET_AUTH_TOKEN_KEY:
-        return get_auth_token_key(out, out_size);
+        return get_auth_token_key(out);
+    case KM_GET_METRICS:
+        return get_metrics(out);
     default:
         return ERR_NOT_IMPLEMENTED;
     }
 }
 
-static bool system_state_provisioning_allowed_at_boot(void) {
-    uint64_t value = system_state_get_flag_default(
-            SYSTEM_STATE_FLAG_PROVISIONING_ALLOWED,
-            SYSTEM_STATE_FLAG_PROVISIONING_ALLOWED_VALUE_NOT_ALLOWED);
-    return value == SYSTEM_STATE_FLAG_PROVISIONING_ALLOWED_VALUE_ALLOWED ||
+#if WITH_MEMREF_SUPPORT
+/*
+ * Checks the input and output regions of |req| and returns in |map_size| the
+ * page aligned size of the shared memory buffer that covers both.
+ */
+static bool shared_memory_regions_valid(const SharedMemoryOperationRequest& req,
+                                        size_t* map_size) {
+    uint64_t input_end = (uint64_t)req.input_offset + req.input_size;
+    uint64_t output_end = (uint64_t)req.output_offset + req.output_capacity;
+
+    /*
+     * Output never runs ahead of the input consumed so far, so the output may
+     * start at or before the input, but not inside it.
+     */
+    if (req.output_offset > req.input_offset && req.output_offset < input_end) {
+        LOG_E("overlapping shared memory regions", 0);
+        return false;
+    }
+
+    uint64_t page_size = getauxval(AT_PAGESZ);
+    uint64_t size = MAX(input_end, output_end);
+    size = (size + page_size - 1) & ~(page_size - 1);
+    if (size == 0 || size > SIZE_MAX) {
+        return false;
+    }
+
+    *map_size = size;
+    return true;
+}
+
+/*
+ * Runs a KM_SHARED_MEMORY_OPERATION request directly on the shared memory
+ * buffer attached to it.
+ */
+static long dispatch_shared_memory_operation(keymaster_chan_ctx* ctx,
+                                             keymaster_message* msg,
+                                             uint32_t payload_size,
+                                             keymaster_response* out) {
+    SharedMemoryOperationRequest req(device->message_version());
+    long err = deserialize_request(msg, payload_size, req);
+    if (err != NO_ERROR)
+        return err;
+
+    SharedMemoryOperationResponse rsp(device->message_version());
+    size_t map_size;
+    if (!shared_memory_regions_valid(req, &map_size)) {
+        rsp.error = KM_ERROR_INVALID_ARGUMENT;
+        return serialize_response(rsp, out);
+    }
+
+    void* shm = mmap(NULL, map_size, PROT_READ | PROT_WRITE, 0, ctx->memref, 0);
+    if (shm == MAP_FAILED) {
+        LOG_E("failed to map shared memory buffer", 0);
+        rsp.error = KM_ERROR_INVALID_ARGUMENT;
+        return serialize_response(rsp, out);
+    }
+
+    uint8_t* base = reinterpret_cast<uint8_t*>(shm);
+    device->ProcessSharedMemoryOperation(req, base + req.input_offset,
+                                         base + req.output_offset, &rsp);
+    munmap(shm, map_size);
+
+    return serialize_response(rsp, out);
+}
+#endif
+
+/*
+ * The system state flags can't change until the next boot, so the provisioning
+ * flag is read once, on the first provisioning command, instead of with an
+ * IPC to the system state service for each one.  A failed read is treated as
+ * not allowed and retried on the next provisioning command.
+ */
+static uint64_t provisioning_allowed_flag(void) {
+    static bool read = false;
+    static uint64_t value;
+    if (!read) {
+        int rc = system_state_get_flag(SYSTEM_STATE_FLAG_PROVISIONING_ALLOWED,
+                                       &value);
+        if (rc != NO_ERROR) {
+            LOG_E("Failed (%d) to read the provisioning allowed flag", rc);
+            return SYSTEM_STATE_FLAG_PROVISIONING_ALLOWED_VALUE_NOT_ALLOWED;
+        }
+        read = true;
+    }
+    return value;
+}
+
+static bool provisioning_allowed(void) {
+    uint64_t value = provisioning_allowed_flag();
+    if (value == SYSTEM_STATE_FLAG_PROVISIONING_ALLOWED_VALUE_ALLOWED) {
+        return true;
+    }
+    return !device->ConfigureCalled() &&
            value ==
                    SYSTEM_STATE_FLAG_PROVISIONING_ALLOWED_VALUE_ALLOWED_AT_BOOT;
 }
 
-static bool provisioning_allowed(void) {
-    if (device->ConfigureCalled()) {
-        return system_state_provisioning_allowed();
-    } else {
-        return system_state_provisioning_allowed_at_boot();
+/*
+ * Access policy bits of a non-secure command.
+ */
+enum keymaster_cmd_flags : uint32_t {
+    /* allowed in any configuration state */
+    KM_CMD_ALWAYS_ALLOWED = 1 << 0,
+    /* allowed before the configure command */
+    KM_CMD_BEFORE_CONFIGURE = 1 << 1,
+    /* called from the bootloader, only allowed before configure */
+    KM_CMD_BOOTLOADER = 1 << 2,
+    /* only allowed in provisioning mode, allowed before configure */
+    KM_CMD_PROVISIONING = 1 << 3,
+};
+
+typedef long (*keymaster_cmd_handler)(keymaster_chan_ctx* ctx,
+                                      keymaster_message* msg,
+                                      uint32_t payload_size,
+                                      keymaster_response* out);
+
+struct keymaster_cmd_entry {
+    const char* name;
+    keymaster_cmd_handler handler;
+    uint32_t flags;
+};
+
+struct keymaster_cmd_def {
+    uint32_t cmd;
+    keymaster_cmd_entry entry;
+};
+
+template <auto Operation>
+static long dispatch(keymaster_chan_ctx* ctx,
+                     keymaster_message* msg,
+                     uint32_t payload_size,
+                     keymaster_response* out) {
+    return do_dispatch(Operation, msg, payload_size, out);
+}
+
+static long dispatch_destroy_attestation_ids(keymaster_chan_ctx* ctx,
+                                             keymaster_message* msg,
+                                             uint32_t payload_size,
+                                             keymaster_response* out) {
+    // TODO(swillden): Implement this.
+    LOG_E("Destroy attestation IDs is unimplemented.", 0);
+    return ERR_NOT_IMPLEMENTED;
+}
+
+static long dispatch_shared_memory(keymaster_chan_ctx* ctx,
+                                   keymaster_message* msg,
+                                   uint32_t payload_size,
+                                   keymaster_response* out) {
+#if WITH_MEMREF_SUPPORT
+    if (ctx->memref != INVALID_IPC_HANDLE) {
+        return dispatch_shared_memory_operation(ctx, msg, payload_size, out);
     }
+#endif
+    /* no shared memory buffer, the data is carried in the message */
+    return do_dispatch(&TrustyKeymaster::SharedMemoryOperation, msg,
+                       payload_size, out);
 }
 
-// Returns true if |cmd| is only allowed in provisioning mode
-static bool cmd_is_provisioning(uint32_t cmd) {
-    return (cmd == KM_SET_ATTESTATION_KEY || cmd == KM_SET_ATTESTATION_IDS ||
-            cmd == KM_APPEND_ATTESTATION_CERT_CHAIN ||
-            cmd == KM_CLEAR_ATTESTATION_CERT_CHAIN ||
-            cmd == KM_SET_WRAPPED_ATTESTATION_KEY);
+#define KM_CMD(cmd, handler, flags) \
+    { cmd, { #cmd, handler, flags } }
+
+static constexpr keymaster_cmd_def kCommandDefs[] = {
+        KM_CMD(KM_GENERATE_KEY, dispatch<&TrustyKeymaster::GenerateKey>, 0),
+        KM_CMD(KM_BEGIN_OPERATION, dispatch<&TrustyKeymaster::BeginOperation>,
+               0),
+        KM_CMD(KM_UPDATE_OPERATION,
+               dispatch<&TrustyKeymaster::UpdateOperation>, 0),
+        KM_CMD(KM_FINISH_OPERATION,
+               dispatch<&TrustyKeymaster::FinishOperation>, 0),
+        KM_CMD(KM_ABORT_OPERATION, dispatch<&TrustyKeymaster::AbortOperation>,
+               0),
+        KM_CMD(KM_IMPORT_KEY, dispatch<&TrustyKeymaster::ImportKey>, 0),
+        KM_CMD(KM_EXPORT_KEY, dispatch<&TrustyKeymaster::ExportKey>, 0),
+        KM_CMD(KM_GET_VERSION, dispatch<&TrustyKeymaster::GetVersion>,
+               KM_CMD_ALWAYS_ALLOWED | KM_CMD_BEFORE_CONFIGURE),
+        KM_CMD(KM_ADD_RNG_ENTROPY, dispatch<&TrustyKeymaster::AddRngEntropy>,
+               0),
+        KM_CMD(KM_GET_SUPPORTED_ALGORITHMS,
+               dispatch<&TrustyKeymaster::SupportedAlgorithms>, 0),
+        KM_CMD(KM_GET_SUPPORTED_BLOCK_MODES,
+               dispatch<&TrustyKeymaster::SupportedBlockModes>, 0),
+        KM_CMD(KM_GET_SUPPORTED_PADDING_MODES,
+               dispatch<&TrustyKeymaster::SupportedPaddingModes>, 0),
+        KM_CMD(KM_GET_SUPPORTED_DIGESTS,
+               dispatch<&TrustyKeymaster::SupportedDigests>, 0),
+        KM_CMD(KM_GET_SUPPORTED_IMPORT_FORMATS,
+               dispatch<&TrustyKeymaster::SupportedImportFormats>, 0),
+        KM_CMD(KM_GET_SUPPORTED_EXPORT_FORMATS,
+               dispatch<&TrustyKeymaster::SupportedExportFormats>, 0),
+        KM_CMD(KM_GET_KEY_CHARACTERISTICS,
+               dispatch<&TrustyKeymaster::GetKeyCharacteristics>, 0),
+        KM_CMD(KM_ATTEST_KEY, dispatch<&TrustyKeymaster::AttestKey>, 0),
+        KM_CMD(KM_UPGRADE_KEY, dispatch<&TrustyKeymaster::UpgradeKey>, 0),
+        KM_CMD(KM_CONFIGURE, dispatch<&TrustyKeymaster::Configure>,
+               KM_CMD_BEFORE_CONFIGURE),
+        KM_CMD(KM_GET_HMAC_SHARING_PARAMETERS,
+               dispatch<&TrustyKeymaster::GetHmacSharingParameters>, 0),
+        KM_CMD(KM_COMPUTE_SHARED_HMAC,
+               dispatch<&TrustyKeymaster::ComputeSharedHmac>, 0),
+        KM_CMD(KM_VERIFY_AUTHORIZATION,
+               dispatch<&TrustyKeymaster::VerifyAuthorization>, 0),
+        KM_CMD(KM_DELETE_KEY, dispatch<&TrustyKeymaster::DeleteKey>, 0),
+        KM_CMD(KM_DELETE_ALL_KEYS, dispatch<&TrustyKeymaster::DeleteAllKeys>,
+               0),
+        KM_CMD(KM_DESTROY_ATTESTATION_IDS, dispatch_destroy_attestation_ids,
+               0),
+        KM_CMD(KM_IMPORT_WRAPPED_KEY,
+               dispatch<&TrustyKeymaster::ImportWrappedKey>, 0),
+        KM_CMD(KM_GET_VERSION_2, dispatch<&TrustyKeymaster::GetVersion2>,
+               KM_CMD_ALWAYS_ALLOWED),
+        KM_CMD(KM_EARLY_BOOT_ENDED, dispatch<&TrustyKeymaster::EarlyBootEnded>,
+               0),
+        KM_CMD(KM_DEVICE_LOCKED, dispatch<&TrustyKeymaster::DeviceLocked>, 0),
+        KM_CMD(KM_GENERATE_RKP_KEY, dispatch<&TrustyKeymaster::GenerateRkpKey>,
+               0),
+        KM_CMD(KM_GENERATE_CSR, dispatch<&TrustyKeymaster::GenerateCsr>, 0),
+        KM_CMD(KM_CONFIGURE_VENDOR_PATCHLEVEL,
+               dispatch<&TrustyKeymaster::ConfigureVendorPatchlevel>, 0),
+        KM_CMD(KM_UPDATE_OPERATION_BATCH,
+               dispatch<&TrustyKeymaster::UpdateOperationBatch>, 0),
+        KM_CMD(KM_SHARED_MEMORY_OPERATION, dispatch_shared_memory, 0),
+        KM_CMD(KM_GENERATE_RKP_KEY_BATCH,
+               dispatch<&TrustyKeymaster::GenerateRkpKeyBatch>, 0),
+        KM_CMD(KM_DELETE_KEYS, dispatch<&TrustyKeymaster::DeleteKeys>, 0),
+
+        KM_CMD(KM_SET_BOOT_PARAMS, dispatch<&TrustyKeymaster::SetBootParams>,
+               KM_CMD_BOOTLOADER),
+        KM_CMD(KM_SET_ATTESTATION_KEY,
+               dispatch<&TrustyKeymaster::SetAttestationKey>,
+               KM_CMD_PROVISIONING),
+        KM_CMD(KM_APPEND_ATTESTATION_CERT_CHAIN,
+               dispatch<&TrustyKeymaster::AppendAttestationCertChain>,
+               KM_CMD_PROVISIONING),
+        KM_CMD(KM_ATAP_GET_CA_REQUEST,
+               dispatch<&TrustyKeymaster::AtapGetCaRequest>, KM_CMD_BOOTLOADER),
+        KM_CMD(KM_ATAP_SET_CA_RESPONSE_BEGIN,
+               dispatch<&TrustyKeymaster::AtapSetCaResponseBegin>,
+               KM_CMD_BOOTLOADER),
+        KM_CMD(KM_ATAP_SET_CA_RESPONSE_UPDATE,
+               dispatch<&TrustyKeymaster::AtapSetCaResponseUpdate>,
+               KM_CMD_BOOTLOADER),
+        KM_CMD(KM_ATAP_SET_CA_RESPONSE_FINISH,
+               dispatch<&TrustyKeymaster::AtapSetCaResponseFinish>,
+               KM_CMD_BOOTLOADER),
+        KM_CMD(KM_ATAP_READ_UUID, dispatch<&TrustyKeymaster::AtapReadUuid>,
+               KM_CMD_BOOTLOADER),
+        KM_CMD(KM_SET_PRODUCT_ID, dispatch<&TrustyKeymaster::AtapSetProductId>,
+               KM_CMD_BOOTLOADER),
+        KM_CMD(KM_CLEAR_ATTESTATION_CERT_CHAIN,
+               dispatch<&TrustyKeymaster::ClearAttestationCertChain>,
+               KM_CMD_PROVISIONING),
+        KM_CMD(KM_SET_WRAPPED_ATTESTATION_KEY,
+               dispatch<&TrustyKeymaster::SetWrappedAttestationKey>,
+               KM_CMD_PROVISIONING),
+        KM_CMD(KM_SET_ATTESTATION_IDS,
+               dispatch<&TrustyKeymaster::SetAttestationIds>,
+               KM_CMD_PROVISIONING),
+        KM_CMD(KM_PROVISION_ATTESTATION_BATCH,
+               dispatch<&TrustyKeymaster::ProvisionAttestationBatch>,
+               KM_CMD_PROVISIONING),
+        KM_CMD(KM_CONFIGURE_BOOT_PATCHLEVEL,
+               dispatch<&TrustyKeymaster::ConfigureBootPatchlevel>,
+               KM_CMD_BOOTLOADER),
+};
+
+#undef KM_CMD
+
+/*
+ * Regular commands are numbered densely from 0 and are looked up in a table
+ * indexed by command number.  Bootloader and provisioning commands use sparse
+ * numbers and are only sent at boot or in the factory, so they are searched
+ * for in kCommandDefs instead.
+ */
+constexpr size_t kNumIndexedCommands = 64;
+
+static constexpr std::array<keymaster_cmd_entry, kNumIndexedCommands>
+make_command_table(void) {
+    std::array<keymaster_cmd_entry, kNumIndexedCommands> table{};
+    for (const keymaster_cmd_def& def : kCommandDefs) {
+        uint32_t index = def.cmd >> KEYMASTER_REQ_SHIFT;
+        if (index < kNumIndexedCommands) {
+            table[index] = def.entry;
+        }
+    }
+    return table;
 }
 
-// Returns true if |cmd| is called from the bootloader
-static bool cmd_is_from_bootloader(uint32_t cmd) {
-    return (cmd == KM_SET_BOOT_PARAMS || cmd == KM_ATAP_GET_CA_REQUEST ||
-            cmd == KM_ATAP_SET_CA_RESPONSE_BEGIN ||
-            cmd == KM_ATAP_SET_CA_RESPONSE_UPDATE ||
-            cmd == KM_ATAP_SET_CA_RESPONSE_FINISH || cmd == KM_ATAP_READ_UUID ||
-            cmd == KM_SET_PRODUCT_ID || cmd == KM_CONFIGURE_BOOT_PATCHLEVEL);
+static constexpr std::array<keymaster_cmd_entry, kNumIndexedCommands>
+        kCommandTable = make_command_table();
+
+static constexpr bool command_defs_valid(void) {
+    for (size_t i = 0; i < std::size(kCommandDefs); ++i) {
+        const keymaster_cmd_def& def = kCommandDefs[i];
+        if ((def.cmd & ((1 << KEYMASTER_REQ_SHIFT) - 1)) != 0 ||
+            !def.entry.handler) {
+            return false;
+        }
+        for (size_t j = 0; j < i; ++j) {
+            if (kCommandDefs[j].cmd == def.cmd) {
+                return false;
+            }
+        }
+    }
+    return true;
 }
 
-// Returns true if |cmd| can be used before the configure command
-static bool cmd_allowed_before_configure(uint32_t cmd) {
-    return cmd == KM_CONFIGURE || cmd == KM_GET_VERSION ||
-           cmd_is_from_bootloader(cmd) || cmd_is_provisioning(cmd);
+static_assert(command_defs_valid(),
+              "keymaster commands must be unique and have handlers");
+
+static const keymaster_cmd_entry* lookup_command(uint32_t cmd) {
+    if (cmd & ((1 << KEYMASTER_REQ_SHIFT) - 1)) {
+        return NULL;
+    }
+
+    uint32_t index = cmd >> KEYMASTER_REQ_SHIFT;
+    if (index < kNumIndexedCommands) {
+        const keymaster_cmd_entry* entry = &kCommandTable[index];
+        return entry->handler ? entry : NULL;
+    }
+
+    for (const keymaster_cmd_def& def : kCommandDefs) {
+        if (def.cmd == cmd) {
+            return &def.entry;
+        }
+    }
+    return NULL;
 }
 
 static long keymaster_dispatch_non_secure(keymaster_chan_ctx* ctx,
                                           keymaster_message* msg,
                                           uint32_t payload_size,
-                                          keymaster::UniquePtr<uint8_t[]>* out,
-                                          uint32_t* out_size) {
-    if (msg->cmd == KM_GET_VERSION || msg->cmd == KM_GET_VERSION_2) {
+                                          keymaster_response* out) {
+    const keymaster_cmd_entry* entry = lookup_command(msg->cmd);
+    uint32_t flags = entry ? entry->flags : 0;
+
+    if (flags & KM_CMD_ALWAYS_ALLOWED) {
         // KM_GET_VERSION and KM_GET_VERSION_2 commands are always allowed
     } else if (!device->ConfigureCalled()) {
-        if (!cmd_allowed_before_configure(msg->cmd)) {
+        if (!(flags & (KM_CMD_BEFORE_CONFIGURE | KM_CMD_BOOTLOADER |
+                       KM_CMD_PROVISIONING))) {
             LOG_E("Command %d not allowed before configure command\n",
                   msg->cmd);
             return ERR_NOT_CONFIGURED;
         }
-    } else if (device->ConfigureCalled()) {
+    } else {
         if (device->get_configure_error() != KM_ERROR_OK) {
             LOG_E("Previous configure command failed\n", 0);
             return ERR_NOT_CONFIGURED;
-        } else if (cmd_is_from_bootloader(msg->cmd)) {
+        } else if (flags & KM_CMD_BOOTLOADER) {
             LOG_E("Bootloader command %d not allowed after configure command\n",
                   msg->cmd);
             return ERR_NOT_IMPLEMENTED;
         }
     }
 
-    if (cmd_is_provisioning(msg->cmd) && !provisioning_allowed()) {
+    if ((flags & KM_CMD_PROVISIONING) && !provisioning_allowed()) {
         LOG_E("Provisioning command %d not allowed\n", msg->cmd);
         return ERR_NOT_IMPLEMENTED;
     }
 
-    switch (static_cast<keymaster_command>(msg->cmd)) {
-    case KM_GENERATE_KEY:
-        LOG_D("Dispatching GENERATE_KEY, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::GenerateKey, msg, payload_size,
-                           out, out_size);
-
-    case KM_BEGIN_OPERATION:
-        LOG_D("Dispatching BEGIN_OPERATION, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::BeginOperation, msg, payload_size,
-                           out, out_size);
-
-    case KM_UPDATE_OPERATION:
-        LOG_D("Dispatching UPDATE_OPERATION, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::UpdateOperation, msg, payload_size,
-                           out, out_size);
-
-    case KM_FINISH_OPERATION:
-        LOG_D("Dispatching FINISH_OPERATION, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::FinishOperation, msg, payload_size,
-                           out, out_size);
-
-    case KM_IMPORT_KEY:
-        LOG_D("Dispatching IMPORT_KEY, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::ImportKey, msg, payload_size, out,
-                           out_size);
-
-    case KM_EXPORT_KEY:
-        LOG_D("Dispatching EXPORT_KEY, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::ExportKey, msg, payload_size, out,
-                           out_size);
-
-    case KM_GET_VERSION:
-        LOG_I("Dispatching GET_VERSION, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::GetVersion, msg, payload_size, out,
-                           out_size);
-
-    case KM_GET_VERSION_2:
-        LOG_I("Dispatching GET_VERSION_2, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::GetVersion2, msg, payload_size,
-                           out, out_size);
-
-    case KM_ADD_RNG_ENTROPY:
-        LOG_D("Dispatching ADD_RNG_ENTROPY, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::AddRngEntropy, msg, payload_size,
-                           out, out_size);
-
-    case KM_GET_SUPPORTED_ALGORITHMS:
-        LOG_D("Dispatching GET_SUPPORTED_ALGORITHMS, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::SupportedAlgorithms, msg,
-                           payload_size, out, out_size);
-
-    case KM_GET_SUPPORTED_BLOCK_MODES:
-        LOG_D("Dispatching GET_SUPPORTED_BLOCK_MODES, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::SupportedBlockModes, msg,
-                           payload_size, out, out_size);
-
-    case KM_GET_SUPPORTED_PADDING_MODES:
-        LOG_D("Dispatching GET_SUPPORTED_PADDING_MODES, size: %d",
-              payload_size);
-        return do_dispatch(&TrustyKeymaster::SupportedPaddingModes, msg,
-                           payload_size, out, out_size);
-
-    case KM_GET_SUPPORTED_DIGESTS:
-        LOG_D("Dispatching GET_SUPPORTED_DIGESTS, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::SupportedDigests, msg,
-                           payload_size, out, out_size);
-
-    case KM_GET_SUPPORTED_IMPORT_FORMATS:
-        LOG_D("Dispatching GET_SUPPORTED_IMPORT_FORMATS, size: %d",
-              payload_size);
-        return do_dispatch(&TrustyKeymaster::SupportedImportFormats, msg,
-                           payload_size, out, out_size);
-
-    case KM_GET_SUPPORTED_EXPORT_FORMATS:
-        LOG_D("Dispatching GET_SUPPORTED_EXPORT_FORMATS, size: %d",
-              payload_size);
-        return do_dispatch(&TrustyKeymaster::SupportedExportFormats, msg,
-                           payload_size, out, out_size);
-
-    case KM_GET_KEY_CHARACTERISTICS:
-        LOG_D("Dispatching GET_KEY_CHARACTERISTICS, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::GetKeyCharacteristics, msg,
-                           payload_size, out, out_size);
-
-    case KM_ABORT_OPERATION:
-        LOG_D("Dispatching ABORT_OPERATION, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::AbortOperation, msg, payload_size,
-                           out, out_size);
-
-    case KM_ATTEST_KEY:
-        LOG_D("Dispatching ATTEST_KEY, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::AttestKey, msg, payload_size, out,
-                           out_size);
-
-    case KM_UPGRADE_KEY:
-        LOG_D("Dispatching UPGRADE_KEY, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::UpgradeKey, msg, payload_size, out,
-                           out_size);
-
-    case KM_CONFIGURE:
-        LOG_D("Dispatching CONFIGURE, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::Configure, msg, payload_size, out,
-                           out_size);
-
-    case KM_GET_HMAC_SHARING_PARAMETERS:
-        LOG_D("Dispatching GET_HMAC_SHARING_PARAMETERS, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::GetHmacSharingParameters, msg,
-                           payload_size, out, out_size);
-
-    case KM_COMPUTE_SHARED_HMAC:
-        LOG_D("Dispatching COMPUTE_SHARED_HMAC, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::ComputeSharedHmac, msg,
-                           payload_size, out, out_size);
-
-    case KM_VERIFY_AUTHORIZATION:
-        LOG_D("Dispatching VERIFY_AUTHORIZATION, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::VerifyAuthorization, msg,
-                           payload_size, out, out_size);
-
-    case KM_IMPORT_WRAPPED_KEY:
-        LOG_D("Dispatching IMPORT_WRAPPED_KEY, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::ImportWrappedKey, msg,
-                           payload_size, out, out_size);
-
-    case KM_DELETE_KEY:
-        LOG_D("Dispatching DELETE_KEY, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::DeleteKey, msg, payload_size, out,
-                           out_size);
-
-    case KM_DELETE_ALL_KEYS:
-        LOG_D("Dispatching DELETE_ALL_KEYS, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::DeleteAllKeys, msg, payload_size,
-                           out, out_size);
-
-    case KM_SET_BOOT_PARAMS:
-        LOG_D("Dispatching SET_BOOT_PARAMS, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::SetBootParams, msg, payload_size,
-                           out, out_size);
-
-    case KM_SET_ATTESTATION_KEY:
-        LOG_D("Dispatching SET_ATTESTION_KEY, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::SetAttestationKey, msg,
-                           payload_size, out, out_size);
-
-    case KM_SET_ATTESTATION_IDS:
-        LOG_D("Dispatching SET_ATTESTATION_IDS, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::SetAttestationIds, msg,
-                           payload_size, out, out_size);
-
-    case KM_APPEND_ATTESTATION_CERT_CHAIN:
-        LOG_D("Dispatching SET_ATTESTATION_CERT_CHAIN, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::AppendAttestationCertChain, msg,
-                           payload_size, out, out_size);
-
-    case KM_ATAP_GET_CA_REQUEST:
-        LOG_D("Dispatching KM_ATAP_GET_CA_REQUEST, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::AtapGetCaRequest, msg,
-                           payload_size, out, out_size);
-
-    case KM_ATAP_SET_CA_RESPONSE_BEGIN:
-        LOG_D("Dispatching KM_ATAP_SET_CA_RESPONSE_BEGIN, size %d",
-              payload_size);
-        return do_dispatch(&TrustyKeymaster::AtapSetCaResponseBegin, msg,
-                           payload_size, out, out_size);
-
-    case KM_ATAP_SET_CA_RESPONSE_UPDATE:
-        LOG_D("Dispatching KM_ATAP_SET_CA_RESPONSE_UPDATE, size %d",
-              payload_size);
-        return do_dispatch(&TrustyKeymaster::AtapSetCaResponseUpdate, msg,
-                           payload_size, out, out_size);
-
-    case KM_ATAP_SET_CA_RESPONSE_FINISH:
-        LOG_D("Dispatching KM_ATAP_SET_CA_RESPONSE_FINISH, size %d",
-              payload_size);
-        return do_dispatch(&TrustyKeymaster::AtapSetCaResponseFinish, msg,
-                           payload_size, out, out_size);
-
-    case KM_ATAP_READ_UUID:
-        LOG_D("Dispatching KM_ATAP_READ_UUID, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::AtapReadUuid, msg, payload_size,
-                           out, out_size);
-
-    case KM_SET_PRODUCT_ID:
-        LOG_D("Dispatching KM_SET_PRODUCT_ID, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::AtapSetProductId, msg,
-                           payload_size, out, out_size);
-
-    case KM_CLEAR_ATTESTATION_CERT_CHAIN:
-        LOG_D("Dispatching KM_CLEAR_ATTESTATION_CERT_CHAIN, size %d",
-              payload_size);
-        return do_dispatch(&TrustyKeymaster::ClearAttestationCertChain, msg,
-                           payload_size, out, out_size);
-
-    case KM_SET_WRAPPED_ATTESTATION_KEY:
-        LOG_D("Dispatching KM_SET_WRAPPED_ATTESTATION_KEY, size %d",
-              payload_size);
-        return do_dispatch(&TrustyKeymaster::SetWrappedAttestationKey, msg,
-                           payload_size, out, out_size);
-
-    case KM_DESTROY_ATTESTATION_IDS:
-        // TODO(swillden): Implement this.
-        LOG_E("Destroy attestation IDs is unimplemented.", 0);
+    if (!entry) {
+        LOG_E("Cannot dispatch unknown command %d", msg->cmd);
         return ERR_NOT_IMPLEMENTED;
-
-    case KM_EARLY_BOOT_ENDED:
-        LOG_D("Dispatching KM_EARLY_BOOT_ENDED, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::EarlyBootEnded, msg, payload_size,
-                           out, out_size);
-
-    case KM_DEVICE_LOCKED:
-        LOG_D("Dispatching KM_DEVICE_LOCKED, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::DeviceLocked, msg, payload_size,
-                           out, out_size);
-
-    case KM_GENERATE_RKP_KEY:
-        LOG_D("Dispatching KM_GENERATE_RKP_KEY, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::GenerateRkpKey, msg, payload_size,
-                           out, out_size);
-
-    case KM_GENERATE_CSR:
-        LOG_D("Dispatching KM_GENERATE_CSR, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::GenerateCsr, msg, payload_size,
-                           out, out_size);
-
-    case KM_CONFIGURE_VENDOR_PATCHLEVEL:
-        LOG_D("Dispatching KM_CONFIGURE_VENDOR_PATCHLEVEL, size %d",
-              payload_size);
-        return do_dispatch(&TrustyKeymaster::ConfigureVendorPatchlevel, msg,
-                           payload_size, out, out_size);
-
-    case KM_CONFIGURE_BOOT_PATCHLEVEL:
-        LOG_D("Dispatching KM_CONFIGURE_BOOT_PATCHLEVEL, size %d",
-              payload_size);
-        return do_dispatch(&TrustyKeymaster::ConfigureBootPatchlevel, msg,
-                           payload_size, out, out_size);
     }
 
-    LOG_E("Cannot dispatch unknown command %d", msg->cmd);
-    return ERR_NOT_IMPLEMENTED;
+    LOG_D("Dispatching %s, size %d", entry->name, payload_size);
+    return entry->handler(ctx, msg, payload_size, out);
 }
 
 static bool keymaster_port_accessible(uuid_t* uuid, bool secure) {
     return !secure || keymaster_check_target_access_policy(uuid);
 }
 
-static keymaster_chan_ctx* keymaster_ctx_open(handle_t chan,
+static keymaster_chan_ctx* keymaster_ctx_open(keymaster_srv_ctx* srv,
+                                              handle_t chan,
                                               uuid_t* uuid,
                                               bool secure) {
     if (!keymaster_port_accessible(uuid, secure)) {
@@ -649,12 +793,44 @@ static keymaster_chan_ctx* keymaster_ctx_open(handle_t chan,
     ctx->handler.priv = ctx;
     ctx->uuid = *uuid;
     ctx->chan = chan;
+    ctx->srv = srv;
+    ctx->secure = secure;
+    ctx->next_secure = NULL;
+    if (secure) {
+        ctx->next_secure = srv->secure_chans;
+        srv->secure_chans = ctx;
+    }
+    ctx->memref = INVALID_IPC_HANDLE;
     ctx->dispatch = secure ? &keymaster_dispatch_secure
                            : &keymaster_dispatch_non_secure;
     return ctx;
 }
 
+/* Closes a received handle when it goes out of scope. */
+class HandleCloser {
+public:
+    explicit HandleCloser(handle_t handle) : handle_(handle) {}
+    ~HandleCloser() {
+        if (handle_ != INVALID_IPC_HANDLE) {
+            close(handle_);
+        }
+    }
+
+    HandleCloser(const HandleCloser&) = delete;
+    HandleCloser& operator=(const HandleCloser&) = delete;
+
+private:
+    handle_t handle_;
+};
+
 static void keymaster_ctx_close(keymaster_chan_ctx* ctx) {
+    if (ctx->secure) {
+        keymaster_chan_ctx** link = &ctx->srv->secure_chans;
+        while (*link != ctx) {
+            link = &(*link)->next_secure;
+        }
+        *link = ctx->next_secure;
+    }
     close(ctx->chan);
     delete ctx;
 }
@@ -675,19 +851,38 @@ static long handle_msg(keymaster_chan_ctx* ctx) {
         return rc;
     }
 
-    // allocate msg_buf, with one extra byte for null-terminator
-    keymaster::UniquePtr<uint8_t[]> msg_buf(new uint8_t[msg_inf.len + 1]);
+    if (msg_inf.len > KEYMASTER_MAX_BUFFER_LENGTH) {
+        LOG_E("message too large (%d) on chan (%d)", msg_inf.len, chan);
+        put_msg(chan, msg_inf.id);
+        return ERR_NOT_VALID;
+    }
+
+    if (msg_inf.num_handles > 1) {
+        LOG_E("too many handles (%d) on chan (%d)", msg_inf.num_handles, chan);
+        put_msg(chan, msg_inf.id);
+        return ERR_NOT_VALID;
+    }
+
+    uint8_t* msg_buf = ctx->srv->recv_buf;
     msg_buf[msg_inf.len] = 0;
 
     /* read msg content */
-    struct iovec iov = {msg_buf.get(), msg_inf.len};
+    struct iovec iov = {msg_buf, msg_inf.len};
+    handle_t memref = INVALID_IPC_HANDLE;
+#if WITH_MEMREF_SUPPORT
+    ipc_msg_t msg = {1, &iov, msg_inf.num_handles, &memref};
+#else
     ipc_msg_t msg = {1, &iov, 0, NULL};
+#endif
 
     rc = read_msg(chan, msg_inf.id, 0, &msg);
 
     // retire the message (note msg_inf.id becomes invalid after put_msg)
     put_msg(chan, msg_inf.id);
 
+    /* the memref is only used while this message is dispatched */
+    HandleCloser memref_closer(memref);
+
     // fatal error
     if (rc < 0) {
         LOG_E("failed to read msg (%d)", rc, chan);
@@ -700,24 +895,104 @@ static long handle_msg(keymaster_chan_ctx* ctx) {
         return ERR_NOT_VALID;
     }
 
-    keymaster::UniquePtr<uint8_t[]> out_buf;
-    uint32_t out_buf_size = 0;
-    keymaster_message* in_msg =
-            reinterpret_cast<keymaster_message*>(msg_buf.get());
+    keymaster_message* in_msg = reinterpret_cast<keymaster_message*>(msg_buf);
+    uint32_t payload_size = msg_inf.len - sizeof(*in_msg);
+
+    uint32_t cmd = in_msg->cmd & ~KEYMASTER_STOP_BIT;
+    if (keymaster_cmd_is_multipart(cmd)) {
+        bool last = in_msg->cmd & KEYMASTER_STOP_BIT;
+        in_msg->cmd = cmd;
+        if (!last || ctx->req.in_progress()) {
+            if (!ctx->req.AddPart(cmd, last, in_msg->payload, payload_size)) {
+                /* wait for the rest of the request */
+                return NO_ERROR;
+            }
+            if (ctx->req.error() != KM_ERROR_OK) {
+                keymaster_error_t err = ctx->req.error();
+                ctx->req.Reset();
+                return send_error_response(chan, cmd, err);
+            }
+            in_msg = reinterpret_cast<keymaster_message*>(ctx->req.data());
+            payload_size = ctx->req.size() - sizeof(*in_msg);
+        }
+    } else if (ctx->req.in_progress()) {
+        /* the last part of the previous request never came */
+        LOG_E("dropping incomplete multi-part request", 0);
+        ctx->req.Reset();
+    }
 
-    rc = ctx->dispatch(ctx, in_msg, msg_inf.len - sizeof(*in_msg), &out_buf,
-                       &out_buf_size);
+    /* msg_buf may be reused by a request served during dispatch */
+    uint32_t rsp_cmd = in_msg->cmd;
+
+    keymaster_response out;
+    uint64_t start_us = KeymasterMetrics::NowUs();
+    uint64_t secure_us = ctx->srv->secure_us;
+    ctx->memref = memref;
+    rc = ctx->dispatch(ctx, in_msg, payload_size, &out);
+    ctx->memref = INVALID_IPC_HANDLE;
+    ctx->req.Reset();
+    /* leave out secure requests served at checkpoints, they are recorded
+     * on their own */
+    KeymasterMetrics::get_instance()->RecordCommand(
+            rsp_cmd & ~KEYMASTER_STOP_BIT,
+            KeymasterMetrics::NowUs() - start_us -
+                    (ctx->srv->secure_us - secure_us),
+            rc < 0 || out.error != KM_ERROR_OK);
     if (rc == ERR_NOT_CONFIGURED) {
         LOG_E("configure error (%d)", rc);
-        return send_error_response(chan, in_msg->cmd,
+        return send_error_response(chan, rsp_cmd,
                                    device->get_configure_error());
     } else if (rc < 0) {
         LOG_E("error handling message (%d)", rc);
-        return send_error_response(chan, in_msg->cmd, KM_ERROR_UNKNOWN_ERROR);
+        return send_error_response(chan, rsp_cmd, KM_ERROR_UNKNOWN_ERROR);
     }
 
-    LOG_D("Sending %d-byte response", out_buf_size);
-    return send_response(chan, in_msg->cmd, out_buf.get(), out_buf_size);
+    LOG_D("Sending %d-byte response", out.size);
+    rc = send_response(chan, rsp_cmd, out.data, out.size);
+    if (rsp_cmd == KM_GET_AUTH_TOKEN_KEY && ctx->secure) {
+        /* don't leave the key behind in keymaster_send_buf */
+        memset_s(out.data, 0, out.size);
+    }
+    return rc;
+}
+
+/*
+ * Accepts waiting connections on the secure port and serves the requests
+ * already waiting on secure channels, without blocking.  Secure requests are
+ * short and latency critical (gatekeeper needs the auth token key to unlock
+ * the device), so they are served ahead of non-secure requests and at the
+ * checkpoints of long operations.  Only KM_GET_AUTH_TOKEN_KEY is handled on
+ * the secure port, and it doesn't touch state used by the interrupted
+ * operation.
+ *
+ * Only filling the RSA keypair pool takes checkpoints.  A GenerateKey that
+ * isn't served from the pool runs in RsaKeyFactory, which has no hook for
+ * them, so secure requests that arrive during it wait until it completes.
+ */
+static void keymaster_serve_secure(void* priv) {
+    keymaster_srv_ctx* srv = reinterpret_cast<keymaster_srv_ctx*>(priv);
+    if (srv->serving_secure) {
+        return;
+    }
+    srv->serving_secure = true;
+    uint64_t start_us = KeymasterMetrics::NowUs();
+
+    uevent_t ev;
+    if (wait(srv->port_secure, &ev, 0) == NO_ERROR) {
+        keymaster_port_handler_secure(&ev, srv);
+    }
+
+    keymaster_chan_ctx* next;
+    for (keymaster_chan_ctx* ctx = srv->secure_chans; ctx; ctx = next) {
+        /* the handler frees ctx if the channel is closed */
+        next = ctx->next_secure;
+        if (wait(ctx->chan, &ev, 0) == NO_ERROR) {
+            keymaster_chan_handler(&ev, ctx);
+        }
+    }
+
+    srv->secure_us += KeymasterMetrics::NowUs() - start_us;
+    srv->serving_secure = false;
 }
 
 static void keymaster_chan_handler(const uevent_t* ev, void* priv) {
@@ -732,11 +1007,14 @@ static void keymaster_chan_handler(const uevent_t* ev, void* priv) {
         (ev->event & IPC_HANDLE_POLL_READY)) {
         /* close it as it is in an error state */
         LOG_E("error event (0x%x) for chan (%d)", ev->event, ev->handle);
-        close(ev->handle);
+        keymaster_ctx_close(ctx);
         return;
     }
 
     if (ev->event & IPC_HANDLE_POLL_MSG) {
+        if (!ctx->secure) {
+            keymaster_serve_secure(ctx->srv);
+        }
         long rc = handle_msg(ctx);
         if (rc != NO_ERROR) {
             /* report an error and close channel */
@@ -771,7 +1049,9 @@ static void keymaster_port_handler(const uevent_t* ev,
         }
 
         handle_t chan = (handle_t)rc;
-        keymaster_chan_ctx* ctx = keymaster_ctx_open(chan, &peer_uuid, secure);
+        keymaster_chan_ctx* ctx = keymaster_ctx_open(
+                reinterpret_cast<keymaster_srv_ctx*>(priv), chan, &peer_uuid,
+                secure);
         if (ctx == NULL) {
             LOG_E("failed to allocate context on chan %d", chan);
             close(chan);
@@ -835,6 +1115,7 @@ static long keymaster_ipc_init(keymaster_srv_ctx* ctx) {
 
     ctx->port_secure = (handle_t)rc;
 
+    keymaster_port_evt_handler_secure.priv = ctx;
     rc = set_cookie(ctx->port_secure, &keymaster_port_evt_handler_secure);
     if (rc) {
         LOG_E("failed (%d) to set_cookie on port %d", rc, ctx->port_secure);
@@ -843,8 +1124,12 @@ static long keymaster_ipc_init(keymaster_srv_ctx* ctx) {
     }
 
     /* initialize non-secure side service */
-    rc = port_create(KEYMASTER_PORT, 1, KEYMASTER_MAX_BUFFER_LENGTH,
-                     IPC_PORT_ALLOW_NS_CONNECT);
+    uint32_t flags = IPC_PORT_ALLOW_NS_CONNECT;
+#if KEYMASTER_ALLOW_TA_CONNECT
+    /* benchmark builds only: let device_benchmark drive the non-secure port */
+    flags |= IPC_PORT_ALLOW_TA_CONNECT;
+#endif
+    rc = port_create(KEYMASTER_PORT, 1, KEYMASTER_MAX_BUFFER_LENGTH, flags);
     if (rc < 0) {
         LOG_E("Failed (%d) to create port %s", rc, KEYMASTER_PORT);
         return rc;
@@ -852,6 +1137,7 @@ static long keymaster_ipc_init(keymaster_srv_ctx* ctx) {
 
     ctx->port_non_secure = (handle_t)rc;
 
+    keymaster_port_evt_handler_non_secure.priv = ctx;
     rc = set_cookie(ctx->port_non_secure,
                     &keymaster_port_evt_handler_non_secure);
     if (rc) {
@@ -881,20 +1167,32 @@ int main(void) {
         LOG_I("BoringSSL self-test: PASSED", 0);
     }
 
-    keymaster_srv_ctx ctx;
+    static keymaster_srv_ctx ctx;
     rc = keymaster_ipc_init(&ctx);
     if (rc < 0) {
         LOG_E("failed (%d) to initialize keymaster", rc);
         return rc;
     }
 
+    device->SetCheckpointHandler(keymaster_serve_secure, &ctx);
+
+    static IdleScheduler idle_scheduler;
+    device->RegisterIdleTasks(&idle_scheduler);
+
     /* enter main event loop */
     while (true) {
         event.handle = INVALID_IPC_HANDLE;
         event.event = 0;
         event.cookie = NULL;
 
-        rc = wait_any(&event, INFINITE_TIME);
+        /* only poll while there is deferred work to do */
+        uint32_t timeout =
+                idle_scheduler.HasPendingTasks() ? 0 : INFINITE_TIME;
+        rc = wait_any(&event, timeout);
+        if (rc == ERR_TIMED_OUT) {
+            idle_scheduler.RunNext();
+            continue;
+        }
         if (rc < 0) {
             LOG_E("wait_any failed (%d)", rc);
             break;
@@ -905,5 +1203,6 @@ int main(void) {
         }
     }
 
+    device->InvalidateDerivedKeys();
     return 0;
 }
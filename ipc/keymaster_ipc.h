@@ -18,6 +18,11 @@
 
 #define KEYMASTER_PORT "com.android.trusty.keymaster"
 #define KEYMASTER_MAX_BUFFER_LENGTH 4096
+/*
+ * Maximum total size of a request sent as several messages, see
+ * keymaster_cmd_is_multipart().
+ */
+#define KEYMASTER_MAX_MULTIPART_LENGTH (5 * KEYMASTER_MAX_BUFFER_LENGTH)
 
 #include <uapi/trusty_uuid.h>
 
@@ -59,6 +64,10 @@ enum keymaster_command : uint32_t {
     KM_GENERATE_RKP_KEY = (31 << KEYMASTER_REQ_SHIFT),
     KM_GENERATE_CSR = (32 << KEYMASTER_REQ_SHIFT),
     KM_CONFIGURE_VENDOR_PATCHLEVEL = (33 << KEYMASTER_REQ_SHIFT),
+    KM_UPDATE_OPERATION_BATCH = (34 << KEYMASTER_REQ_SHIFT),
+    KM_SHARED_MEMORY_OPERATION = (35 << KEYMASTER_REQ_SHIFT),
+    KM_GENERATE_RKP_KEY_BATCH = (36 << KEYMASTER_REQ_SHIFT),
+    KM_DELETE_KEYS = (37 << KEYMASTER_REQ_SHIFT),
 
     // Bootloader calls.
     KM_SET_BOOT_PARAMS = (0x1000 << KEYMASTER_REQ_SHIFT),
@@ -73,9 +82,34 @@ enum keymaster_command : uint32_t {
     KM_CLEAR_ATTESTATION_CERT_CHAIN = (0xa000 << KEYMASTER_REQ_SHIFT),
     KM_SET_WRAPPED_ATTESTATION_KEY = (0xb000 << KEYMASTER_REQ_SHIFT),
     KM_SET_ATTESTATION_IDS = (0xc000 << KEYMASTER_REQ_SHIFT),
+    KM_PROVISION_ATTESTATION_BATCH = (0xe000 << KEYMASTER_REQ_SHIFT),
     KM_CONFIGURE_BOOT_PATCHLEVEL = (0xd0000 << KEYMASTER_REQ_SHIFT),
 };
 
+/*
+ * Secure port commands handled by this app in addition to those declared in
+ * interface/keymaster/keymaster.h.
+ */
+enum keymaster_secure_command : uint32_t {
+    /* returns the metrics described in trusty_keymaster_metrics.h */
+    KM_GET_METRICS = (0x100 << KEYMASTER_REQ_SHIFT),
+};
+
+/**
+ * keymaster_cmd_is_multipart() - check whether a command may be split
+ * @cmd: the command, one of keymaster_command.
+ *
+ * Requests for these commands may be larger than a single message.  The
+ * serialized request is split across several messages carrying the same
+ * command, and the last one has KEYMASTER_STOP_BIT set, mirroring the framing
+ * of responses.  A request that fits in one message is sent with
+ * KEYMASTER_STOP_BIT set.  Only the last message is answered.
+ */
+static inline bool keymaster_cmd_is_multipart(uint32_t cmd) {
+    return cmd == KM_UPDATE_OPERATION_BATCH || cmd == KM_DELETE_KEYS ||
+           cmd == KM_PROVISION_ATTESTATION_BATCH;
+}
+
 /**
  * check uuid against the target-specific acesss policy
  *
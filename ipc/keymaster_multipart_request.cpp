@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "keymaster_multipart_request.h"
+
+#include <string.h>
+
+#include <new>
+
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+bool MultipartRequest::AddPart(uint32_t cmd,
+                               bool last,
+                               const uint8_t* payload,
+                               uint32_t payload_size) {
+    if (error_ == KM_ERROR_OK) {
+        error_ = Append(cmd, payload, payload_size);
+        if (error_ != KM_ERROR_OK) {
+            FreeBuffer();
+        }
+    }
+    return last;
+}
+
+void MultipartRequest::Reset() {
+    FreeBuffer();
+    error_ = KM_ERROR_OK;
+}
+
+keymaster_error_t MultipartRequest::Append(uint32_t cmd,
+                                           const uint8_t* payload,
+                                           uint32_t payload_size) {
+    if (!buf_) {
+        buf_.reset(new (std::nothrow) uint8_t[max_size_]);
+        if (!buf_) {
+            LOG_E("failed to allocate multi-part request buffer", 0);
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        }
+        memcpy(buf_.get(), &cmd, sizeof(cmd));
+        size_ = sizeof(cmd);
+    }
+
+    uint32_t request_cmd;
+    memcpy(&request_cmd, buf_.get(), sizeof(request_cmd));
+    if (request_cmd != cmd) {
+        LOG_E("unexpected command %d in multi-part request", cmd);
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+
+    if (payload_size > max_size_ - size_) {
+        LOG_E("multi-part request too large", 0);
+        return KM_ERROR_INVALID_INPUT_LENGTH;
+    }
+
+    memcpy(buf_.get() + size_, payload, payload_size);
+    size_ += payload_size;
+    return KM_ERROR_OK;
+}
+
+void MultipartRequest::FreeBuffer() {
+    if (buf_) {
+        memset_s(buf_.get(), 0, size_);
+        buf_.reset();
+    }
+    size_ = 0;
+}
+
+}  // namespace keymaster
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <hardware/keymaster_defs.h>
+#include <keymaster/UniquePtr.h>
+
+namespace keymaster {
+
+/**
+ * MultipartRequest reassembles a request that is sent as several messages,
+ * see keymaster_cmd_is_multipart().  The reassembled request is the command,
+ * as a uint32_t, followed by the payload of every part, so it has the layout
+ * of a keymaster_message.
+ *
+ * If a part is rejected, the parts received so far are dropped, the
+ * remaining parts are ignored and the request completes with the error when
+ * its last part arrives.  The buffer is allocated when the first part
+ * arrives and wiped and freed by Reset().
+ */
+class MultipartRequest {
+public:
+    /**
+     * |max_size| bounds the reassembled request, command included.
+     */
+    explicit MultipartRequest(uint32_t max_size) : max_size_(max_size) {}
+    ~MultipartRequest() { Reset(); }
+
+    MultipartRequest(const MultipartRequest&) = delete;
+    MultipartRequest& operator=(const MultipartRequest&) = delete;
+
+    /**
+     * Returns true from the first part of a request until Reset().
+     */
+    bool in_progress() const { return buf_ || error_ != KM_ERROR_OK; }
+
+    /**
+     * Adds the |payload_size| bytes of |payload| of a part of a request for
+     * |cmd|.  |last| is set for the part that carried KEYMASTER_STOP_BIT.
+     * Returns false while more parts are expected.  Once the last part has
+     * been added, returns true, and error() says whether the request can be
+     * handled.
+     */
+    bool AddPart(uint32_t cmd,
+                 bool last,
+                 const uint8_t* payload,
+                 uint32_t payload_size);
+
+    keymaster_error_t error() const { return error_; }
+    uint8_t* data() const { return buf_.get(); }
+    uint32_t size() const { return size_; }
+
+    /**
+     * Wipes and drops the request, so that the next part starts a new one.
+     */
+    void Reset();
+
+private:
+    keymaster_error_t Append(uint32_t cmd,
+                             const uint8_t* payload,
+                             uint32_t payload_size);
+    void FreeBuffer();
+
+    const uint32_t max_size_;
+    UniquePtr<uint8_t[]> buf_;
+    uint32_t size_ = 0;
+    keymaster_error_t error_ = KM_ERROR_OK;
+};
+
+}  // namespace keymaster
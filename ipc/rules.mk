@@ -15,7 +15,9 @@
 
 CUR_DIR := $(GET_LOCAL_DIR)
 
-MODULE_SRCS += $(CUR_DIR)/keymaster_ipc.cpp
+MODULE_SRCS += \
+	$(CUR_DIR)/keymaster_ipc.cpp \
+	$(CUR_DIR)/keymaster_multipart_request.cpp \
 
 MODULE_LIBRARY_DEPS += trusty/user/base/interface/keymaster
 
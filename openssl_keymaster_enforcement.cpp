@@ -90,9 +90,9 @@ keymaster_error_t OpenSSLKeymasterEnforcement::GetHmacSharingParameters(
 
 namespace {
 
-DEFINE_OPENSSL_OBJECT_POINTER(HMAC_CTX);
-
-keymaster_error_t hmacSha256(const keymaster_key_blob_t& key,
+// |ctx| must already be keyed. Passing a null key and digest to HMAC_Init_ex
+// resets it to the saved inner key state instead of recomputing the pads.
+keymaster_error_t hmacSha256(HMAC_CTX* ctx,
                              const keymaster_blob_t data_chunks[],
                              size_t data_chunk_count,
                              KeymasterBlob* output) {
@@ -103,20 +103,18 @@ keymaster_error_t hmacSha256(const keymaster_key_blob_t& key,
     if (!output->Reset(digest_len))
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 
-    HMAC_CTX_Ptr ctx(HMAC_CTX_new());
-    if (!HMAC_Init_ex(ctx.get(), key.key_material, key.key_material_size,
-                      EVP_sha256(), nullptr /* engine*/)) {
+    if (!HMAC_Init_ex(ctx, nullptr, 0, nullptr, nullptr /* engine*/)) {
         return TranslateLastOpenSslError();
     }
 
     for (size_t i = 0; i < data_chunk_count; i++) {
         auto& chunk = data_chunks[i];
-        if (!HMAC_Update(ctx.get(), chunk.data, chunk.data_length)) {
+        if (!HMAC_Update(ctx, chunk.data, chunk.data_length)) {
             return TranslateLastOpenSslError();
         }
     }
 
-    if (!HMAC_Final(ctx.get(), output->writable_data(), &digest_len)) {
+    if (!HMAC_Final(ctx, output->writable_data(), &digest_len)) {
         return TranslateLastOpenSslError();
     }
 
@@ -190,6 +188,10 @@ keymaster_error_t OpenSSLKeymasterEnforcement::ComputeSharedHmac(
                           strlen(kSharedHmacLabel)),
             context_chunks.get(), num_chunks,  //
             &hmac_key_);
+    hmac_ctx_keyed_ = false;
+    if (error != KM_ERROR_OK)
+        return error;
+    error = KeyHmacCtx();
     if (error != KM_ERROR_OK)
         return error;
 
@@ -197,7 +199,7 @@ keymaster_error_t OpenSSLKeymasterEnforcement::ComputeSharedHmac(
             reinterpret_cast<const uint8_t*>(kMacVerificationString),
             strlen(kMacVerificationString)};
     keymaster_blob_t data_chunks[] = {data};
-    return hmacSha256(hmac_key_, data_chunks, 1, sharingCheck);
+    return hmacSha256(&hmac_ctx_, data_chunks, 1, sharingCheck);
 }
 
 VerifyAuthorizationResponse OpenSSLKeymasterEnforcement::VerifyAuthorization(
@@ -218,11 +220,27 @@ VerifyAuthorizationResponse OpenSSLKeymasterEnforcement::VerifyAuthorization(
             toBlob(response.token.security_level),
             {},  // parametersVerified
     };
-    response.error = hmacSha256(hmac_key_, data_chunks, 5, &response.token.mac);
+    response.error = KeyHmacCtx();
+    if (response.error != KM_ERROR_OK)
+        return response;
+    response.error =
+            hmacSha256(&hmac_ctx_, data_chunks, 5, &response.token.mac);
 
     return response;
 }
 
+keymaster_error_t OpenSSLKeymasterEnforcement::KeyHmacCtx() {
+    if (hmac_ctx_keyed_)
+        return KM_ERROR_OK;
+    if (!HMAC_Init_ex(&hmac_ctx_, hmac_key_.key_material,
+                      hmac_key_.key_material_size, EVP_sha256(),
+                      nullptr /* engine*/)) {
+        return TranslateLastOpenSslError();
+    }
+    hmac_ctx_keyed_ = true;
+    return KM_ERROR_OK;
+}
+
 keymaster_error_t OpenSSLKeymasterEnforcement::GetKeyAgreementKey(
         KeymasterKeyBlob* kak) const {
     uint32_t keySize = kKeyAgreementKeySize;
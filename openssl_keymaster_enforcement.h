@@ -20,6 +20,7 @@
 
 #include <keymaster/android_keymaster_messages.h>
 #include <keymaster/keymaster_enforcement.h>
+#include <openssl/hmac.h>
 
 /*
  * Controls size of KAK used for Strongbox agreement.
@@ -38,8 +39,10 @@ public:
     OpenSSLKeymasterEnforcement(uint32_t max_access_time_map_size,
                                 uint32_t max_access_count_map_size)
             : KeymasterEnforcement(max_access_time_map_size,
-                                   max_access_count_map_size) {}
-    virtual ~OpenSSLKeymasterEnforcement() {}
+                                   max_access_count_map_size) {
+        HMAC_CTX_init(&hmac_ctx_);
+    }
+    virtual ~OpenSSLKeymasterEnforcement() { HMAC_CTX_cleanup(&hmac_ctx_); }
 
     bool CreateKeyId(const keymaster_key_blob_t& key_blob,
                      km_id_t* keyid) const override;
@@ -56,9 +59,14 @@ public:
 private:
     static const size_t kKeyAgreementKeySize = TRUSTY_KM_KAK_SIZE;
     keymaster_error_t GetKeyAgreementKey(KeymasterKeyBlob* kak) const;
+    keymaster_error_t KeyHmacCtx();
     bool have_saved_params_ = false;
     HmacSharingParameters saved_params_;
     KeymasterKeyBlob hmac_key_;
+    // HMAC context keyed with |hmac_key_|, so that each MAC computed with the
+    // shared key starts from the precomputed key schedule.
+    HMAC_CTX hmac_ctx_;
+    bool hmac_ctx_keyed_ = false;
 };
 
 }  // namespace keymaster
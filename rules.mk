@@ -78,10 +78,16 @@ MODULE_SRCS += \
 	$(KEYMASTER_ROOT)/km_openssl/wrapped_key.cpp \
 	$(LOCAL_DIR)/openssl_keymaster_enforcement.cpp \
 	$(LOCAL_DIR)/trusty_aes_key.cpp \
+	$(LOCAL_DIR)/trusty_entropy_pool.cpp \
+	$(LOCAL_DIR)/trusty_hwkey_derived_key.cpp \
+	$(LOCAL_DIR)/trusty_idle_scheduler.cpp \
+	$(LOCAL_DIR)/trusty_key_blob_cache.cpp \
 	$(LOCAL_DIR)/trusty_keymaster.cpp \
 	$(LOCAL_DIR)/trusty_keymaster_context.cpp \
 	$(LOCAL_DIR)/trusty_keymaster_enforcement.cpp \
+	$(LOCAL_DIR)/trusty_keymaster_metrics.cpp \
 	$(LOCAL_DIR)/trusty_remote_provisioning_context.cpp \
+	$(LOCAL_DIR)/trusty_rsa_key.cpp \
 	$(LOCAL_DIR)/trusty_secure_deletion_secret_storage.cpp \
 	$(LOCAL_DIR)/secure_storage_manager.cpp \
 	$(LOCAL_DIR)/keymaster_attributes.pb.c \
@@ -135,6 +141,18 @@ ifdef TRUSTY_KM_KAK_SIZE
     MODULE_COMPILEFLAGS += -DTRUSTY_KM_KAK_SIZE=$(TRUSTY_KM_KAK_SIZE)
 endif
 
+# Number of RSA-2048 keypairs to pre-generate while idle, 0 to disable.
+ifdef TRUSTY_KM_RSA_KEY_POOL_SIZE
+    MODULE_COMPILEFLAGS += -DTRUSTY_KM_RSA_KEY_POOL_SIZE=$(TRUSTY_KM_RSA_KEY_POOL_SIZE)
+endif
+
+# If KEYMASTER_ALLOW_TA_CONNECT is set, apps can connect to the non-secure
+# port, so that device_benchmark can drive it.  For benchmarking only: it
+# lets every app make HAL requests.
+ifeq (true,$(call TOBOOL,$(KEYMASTER_ALLOW_TA_CONNECT)))
+    MODULE_COMPILEFLAGS += -DKEYMASTER_ALLOW_TA_CONNECT=1
+endif
+
 MODULE_LIBRARY_DEPS += \
 	trusty/user/base/lib/libc-trusty \
 	trusty/user/base/lib/libstdc++-trusty \
@@ -157,6 +175,14 @@ MODULE_DEFINES += \
 
 endif
 
+# If KEYMASTER_WITH_MEMREF_SUPPORT is set Keymaster will accept shared memory
+#  buffers (memrefs) attached to KM_SHARED_MEMORY_OPERATION requests.
+ifeq (true,$(call TOBOOL,$(KEYMASTER_WITH_MEMREF_SUPPORT)))
+MODULE_DEFINES += \
+     WITH_MEMREF_SUPPORT=1 \
+
+endif
+
 # If KEYMASTER_WITH_FINGERPRINT_SUPPORT is set Keymaster will be
 #  compiled with fingerprint authenticator support.
 ifeq (true,$(call TOBOOL,$(KEYMASTER_WITH_FINGERPRINT_SUPPORT)))
@@ -173,4 +199,5 @@ include make/trusted_app.mk
 # Include unit tests
 ifeq (true,$(call TOBOOL,$(TEST_BUILD)))
 include trusty/user/app/keymaster/host_unittest/rules.mk
+include trusty/user/app/keymaster/host_benchmark/rules.mk
 endif
@@ -21,6 +21,9 @@
 #include <stdio.h>
 #include <uapi/err.h>
 
+#include <algorithm>
+#include <new>
+
 #include <lib/storage/storage.h>
 
 #include <keymaster/UniquePtr.h>
@@ -31,8 +34,13 @@
 
 namespace keymaster {
 
-// Name of the attestation key file is kAttestKeyCertPrefix.%algorithm. This key
-// file stores key and certificate chain in a protobuf format.
+// Name of the attestation key file is kAttestKeyCertFilePrefix.%algorithm.
+// The file starts with an AttestationKeyFileHeader, followed by the key and
+// each certificate at fixed offsets, so that one of them can be replaced
+// without rewriting the others.
+const char* kAttestKeyCertFilePrefix = "AttestKeyCert2";
+// Name of the previous attestation key file prefix. These files store the key
+// and certificate chain in a protobuf format.
 const char* kAttestKeyCertPrefix = "AttestKeyCert";
 // Name of the legacy attestation key file prefix.
 const char* kLegacyAttestKeyPrefix = "AttestKey.";
@@ -58,6 +66,49 @@ static const int kAttestationIdLengthMax = 64;
 static const int kKeySizeMax = 2048;
 static const int kCertSizeMax = 2048;
 
+// Largest encoded file accepted by DecodeFromFile, an AttestationKey with a
+// full key and certificate chain plus some room for tags and lengths.
+static const uint64_t kEncodedFileSizeMax =
+        kKeySizeMax + kMaxCertChainLength * kCertSizeMax + 256;
+
+// Files are read and written in chunks of this size, which fits in a single
+// storage service message.
+static const size_t kStorageIoChunkSize = 2048;
+
+struct AttestationKeyFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t key_size;
+    uint32_t certs_count;
+    uint32_t cert_sizes[kMaxCertChainLength];
+};
+
+static const uint32_t kAttestationKeyFileMagic = 0x324b4341; /* "ACK2" */
+static const uint32_t kAttestationKeyFileVersion = 2;
+static const uint32_t kAttestationKeyFileHasKey = 1;
+
+// The header region is larger than the header to leave room for new fields.
+static const uint64_t kAttestationKeyFileHeaderSize = 64;
+static_assert(sizeof(AttestationKeyFileHeader) <= kAttestationKeyFileHeaderSize,
+              "attestation key file header too large");
+
+static uint64_t key_region_offset() {
+    return kAttestationKeyFileHeaderSize;
+}
+
+static uint64_t cert_region_offset(uint32_t index) {
+    return kAttestationKeyFileHeaderSize + kKeySizeMax +
+           static_cast<uint64_t>(index) * kCertSizeMax;
+}
+
+static const AttestationKeySlot kAttestationKeySlots[] = {
+        AttestationKeySlot::kRsa,        AttestationKeySlot::kEcdsa,
+        AttestationKeySlot::kEddsa,      AttestationKeySlot::kEpid,
+        AttestationKeySlot::kClaimable0, AttestationKeySlot::kSomRsa,
+        AttestationKeySlot::kSomEcdsa,   AttestationKeySlot::kSomEddsa,
+        AttestationKeySlot::kSomEpid};
+
 const char* GetKeySlotStr(AttestationKeySlot key_slot) {
     switch (key_slot) {
     case AttestationKeySlot::kRsa:
@@ -83,6 +134,83 @@ const char* GetKeySlotStr(AttestationKeySlot key_slot) {
     }
 }
 
+#ifdef KEYMASTER_STORAGE_STATS
+
+static SecureStorageManager::StorageStats storage_stats;
+
+namespace {
+
+// Unqualified storage calls in this file resolve to these wrappers, which
+// count each call in |storage_stats| before forwarding it to the storage
+// library.
+
+int storage_open_file(storage_session_t session,
+                      file_handle_t* handle_p,
+                      const char* name,
+                      uint32_t flags,
+                      uint32_t opflags) {
+    storage_stats.open_file++;
+    return ::storage_open_file(session, handle_p, name, flags, opflags);
+}
+
+int storage_delete_file(storage_session_t session,
+                        const char* name,
+                        uint32_t opflags) {
+    storage_stats.delete_file++;
+    return ::storage_delete_file(session, name, opflags);
+}
+
+ssize_t storage_read(file_handle_t handle,
+                     storage_off_t off,
+                     void* buf,
+                     size_t size) {
+    storage_stats.read++;
+    return ::storage_read(handle, off, buf, size);
+}
+
+ssize_t storage_write(file_handle_t handle,
+                      storage_off_t off,
+                      const void* buf,
+                      size_t size,
+                      uint32_t opflags) {
+    storage_stats.write++;
+    return ::storage_write(handle, off, buf, size, opflags);
+}
+
+int storage_get_file_size(file_handle_t handle, storage_off_t* size_p) {
+    storage_stats.get_file_size++;
+    return ::storage_get_file_size(handle, size_p);
+}
+
+int storage_set_file_size(file_handle_t handle,
+                          storage_off_t file_size,
+                          uint32_t opflags) {
+    storage_stats.set_file_size++;
+    return ::storage_set_file_size(handle, file_size, opflags);
+}
+
+int storage_end_transaction(storage_session_t session, bool complete) {
+    storage_stats.end_transaction++;
+    return ::storage_end_transaction(session, complete);
+}
+
+}  // namespace
+
+SecureStorageManager::StorageStats SecureStorageManager::GetStorageStats() {
+    return storage_stats;
+}
+
+void SecureStorageManager::ResetStorageStats() {
+    storage_stats = StorageStats();
+}
+
+#endif  // #ifdef KEYMASTER_STORAGE_STATS
+
+template <typename T>
+static UniquePtr<T> CopyOf(const T& value) {
+    return UniquePtr<T>(new (std::nothrow) T(value));
+}
+
 class FileCloser {
 public:
     file_handle_t get_file_handle() { return file_handle; }
@@ -102,11 +230,32 @@ private:
     file_handle_t file_handle = 0;
 };
 
+// A heap buffer that is wiped before it is freed, for encoded files that may
+// hold key material.
+class WipedBuffer {
+public:
+    explicit WipedBuffer(size_t size)
+            : data_(new (std::nothrow) uint8_t[size]), size_(size) {}
+    ~WipedBuffer() {
+        if (data_) {
+            memset_s(data_.get(), 0, size_);
+        }
+    }
+    uint8_t* get() { return data_.get(); }
+
+    WipedBuffer(const WipedBuffer&) = delete;
+    WipedBuffer& operator=(const WipedBuffer&) = delete;
+
+private:
+    UniquePtr<uint8_t[]> data_;
+    size_t size_;
+};
+
 SecureStorageManager* SecureStorageManager::get_instance(
         bool translate_format) {
     static SecureStorageManager instance;
     if (instance.session_handle_ != STORAGE_INVALID_SESSION) {
-        int rc = storage_end_transaction(instance.session_handle_, false);
+        int rc = instance.StorageEndTransaction(false);
         if (rc < 0) {
             LOG_E("Error: existing session is stale.", 0);
             storage_close_session(instance.session_handle_);
@@ -131,13 +280,23 @@ SecureStorageManager* SecureStorageManager::get_instance(
         }
     }
 #endif  // #ifdef KEYMASTER_LEGACY_FORMAT
+    if (translate_format && instance.protobuf_format_) {
+        keymaster_error_t err = instance.TranslateProtobufFormat();
+        if (err != KM_ERROR_OK) {
+            LOG_E("Failed to translate attestation key file format!", 0);
+            instance.CloseSession();
+            return nullptr;
+        }
+        instance.protobuf_format_ = false;
+    }
     return &instance;
 }
 
 keymaster_error_t SecureStorageManager::WriteKeyToStorage(
         AttestationKeySlot key_slot,
         const uint8_t* key,
-        uint32_t key_size) {
+        uint32_t key_size,
+        bool commit) {
     if (key_size > kKeySizeMax) {
         return KM_ERROR_INVALID_ARGUMENT;
     }
@@ -152,7 +311,8 @@ keymaster_error_t SecureStorageManager::WriteKeyToStorage(
     memcpy(attestation_key->key.bytes, key, key_size);
     attestation_key->key.size = key_size;
 
-    err = WriteAttestationKey(key_slot, attestation_key.get(), true);
+    err = WriteAttestationKey(key_slot, attestation_key.get(), commit,
+                              kKeyRegion);
     if (err != KM_ERROR_OK) {
         CloseSession();
     }
@@ -208,7 +368,8 @@ keymaster_error_t SecureStorageManager::WriteCertToStorage(
         AttestationKeySlot key_slot,
         const uint8_t* cert,
         uint32_t cert_size,
-        uint32_t index) {
+        uint32_t index,
+        bool commit) {
     if (cert_size > kCertSizeMax || index >= kMaxCertChainLength) {
         return KM_ERROR_INVALID_ARGUMENT;
     }
@@ -228,7 +389,8 @@ keymaster_error_t SecureStorageManager::WriteCertToStorage(
     attestation_key->certs[index].content.size = cert_size;
     memcpy(attestation_key->certs[index].content.bytes, cert, cert_size);
 
-    err = WriteAttestationKey(key_slot, attestation_key.get(), true);
+    err = WriteAttestationKey(key_slot, attestation_key.get(), commit,
+                              CertRegion(index));
     if (err != KM_ERROR_OK) {
         CloseSession();
     }
@@ -276,7 +438,8 @@ keymaster_error_t SecureStorageManager::ReadCertChainFromStorage(
 }
 
 keymaster_error_t SecureStorageManager::DeleteCertChainFromStorage(
-        AttestationKeySlot key_slot) {
+        AttestationKeySlot key_slot,
+        bool commit) {
     AttestationKey* attestation_key_p;
     keymaster_error_t err = ReadAttestationKey(key_slot, &attestation_key_p);
     if (err != KM_ERROR_OK) {
@@ -286,7 +449,8 @@ keymaster_error_t SecureStorageManager::DeleteCertChainFromStorage(
     UniquePtr<AttestationKey> attestation_key(attestation_key_p);
     attestation_key->certs_count = 0;
 
-    err = WriteAttestationKey(key_slot, attestation_key.get(), true);
+    // Only the header changes.
+    err = WriteAttestationKey(key_slot, attestation_key.get(), commit, 0);
     if (err != KM_ERROR_OK) {
         CloseSession();
     }
@@ -368,10 +532,15 @@ keymaster_error_t SecureStorageManager::WriteAtapKeyAndCertsToStorage(
 keymaster_error_t SecureStorageManager::DeleteKey(AttestationKeySlot key_slot,
                                                   bool commit) {
     char key_file[kStorageIdLengthMax];
-    snprintf(key_file, kStorageIdLengthMax, "%s.%s", kAttestKeyCertPrefix,
+    snprintf(key_file, kStorageIdLengthMax, "%s.%s", kAttestKeyCertFilePrefix,
              GetKeySlotStr(key_slot));
+    InvalidateAttestationKey(key_slot);
     int rc = storage_delete_file(session_handle_, key_file,
                                  commit ? STORAGE_OP_COMPLETE : 0);
+    if (rc >= 0) {
+        // The delete is either staged or commits the whole transaction.
+        writes_staged_ = !commit;
+    }
     if (rc < 0 && rc != ERR_NOT_FOUND) {
         LOG_E("Error: [%d] deleting storage object '%s'", rc, key_file);
         if (commit) {
@@ -386,6 +555,16 @@ keymaster_error_t SecureStorageManager::DeleteKey(AttestationKeySlot key_slot,
 
 keymaster_error_t SecureStorageManager::ReadKeymasterAttributes(
         KeymasterAttributes** km_attributes_p) {
+    if (cached_km_attributes_) {
+        UniquePtr<KeymasterAttributes> km_attributes =
+                CopyOf(*cached_km_attributes_);
+        if (!km_attributes.get()) {
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        }
+        *km_attributes_p = km_attributes.release();
+        return KM_ERROR_OK;
+    }
+
     UniquePtr<KeymasterAttributes> km_attributes(
             new KeymasterAttributes(KeymasterAttributes_init_zero));
     if (!km_attributes.get()) {
@@ -398,6 +577,9 @@ keymaster_error_t SecureStorageManager::ReadKeymasterAttributes(
         LOG_E("Error: [%d] decoding from file '%s'", err, kAttributeFileName);
         return err;
     }
+    if (!writes_staged_) {
+        cached_km_attributes_ = CopyOf(*km_attributes);
+    }
     *km_attributes_p = km_attributes.release();
     return KM_ERROR_OK;
 }
@@ -405,15 +587,27 @@ keymaster_error_t SecureStorageManager::ReadKeymasterAttributes(
 keymaster_error_t SecureStorageManager::WriteKeymasterAttributes(
         const KeymasterAttributes* km_attributes,
         bool commit) {
-    return EncodeToFile(KeymasterAttributes_fields, km_attributes,
-                        kAttributeFileName, commit);
+    cached_km_attributes_.reset();
+    keymaster_error_t err = EncodeToFile(KeymasterAttributes_fields,
+                                         km_attributes, kAttributeFileName,
+                                         commit);
+    if (err == KM_ERROR_OK && commit) {
+        cached_km_attributes_ = CopyOf(*km_attributes);
+    }
+    return err;
 }
 
 keymaster_error_t SecureStorageManager::WriteAttestationIds(
         const AttestationIds* attestation_ids,
         bool commit) {
-    return EncodeToFile(AttestationIds_fields, attestation_ids,
-                        kAttestationIdsFileName, commit);
+    attestation_ids_generation_++;
+    cached_attestation_ids_.reset();
+    keymaster_error_t err = EncodeToFile(AttestationIds_fields, attestation_ids,
+                                         kAttestationIdsFileName, commit);
+    if (err == KM_ERROR_OK && commit) {
+        cached_attestation_ids_ = CopyOf(*attestation_ids);
+    }
+    return err;
 }
 
 keymaster_error_t SecureStorageManager::ReadAttestationUuid(
@@ -471,7 +665,8 @@ keymaster_error_t SecureStorageManager::DeleteAttestationUuid() {
 }
 
 keymaster_error_t SecureStorageManager::SetProductId(
-        const uint8_t product_id[kProductIdSize]) {
+        const uint8_t product_id[kProductIdSize],
+        bool commit) {
     KeymasterAttributes* km_attributes_p;
     keymaster_error_t err = ReadKeymasterAttributes(&km_attributes_p);
     if (err != KM_ERROR_OK) {
@@ -488,7 +683,7 @@ keymaster_error_t SecureStorageManager::SetProductId(
     km_attributes->has_product_id = true;
     km_attributes->product_id.size = kProductIdSize;
     memcpy(km_attributes->product_id.bytes, product_id, kProductIdSize);
-    err = WriteKeymasterAttributes(km_attributes.get(), true);
+    err = WriteKeymasterAttributes(km_attributes.get(), commit);
     if (err != KM_ERROR_OK) {
         CloseSession();
     }
@@ -515,7 +710,8 @@ keymaster_error_t SecureStorageManager::ReadProductId(
 }
 
 keymaster_error_t SecureStorageManager::SetAttestationIds(
-        const SetAttestationIdsRequest& request) {
+        const SetAttestationIdsRequest& request,
+        bool commit) {
     AttestationIds* attestation_ids_p =
             new AttestationIds(AttestationIds_init_zero);
     UniquePtr<AttestationIds> attestation_ids(attestation_ids_p);
@@ -602,7 +798,7 @@ keymaster_error_t SecureStorageManager::SetAttestationIds(
                request.model.buffer_size());
     }
 
-    keymaster_error_t err = WriteAttestationIds(attestation_ids.get(), true);
+    keymaster_error_t err = WriteAttestationIds(attestation_ids.get(), commit);
     if (err != KM_ERROR_OK) {
         CloseSession();
     }
@@ -611,6 +807,11 @@ keymaster_error_t SecureStorageManager::SetAttestationIds(
 
 keymaster_error_t SecureStorageManager::ReadAttestationIds(
         AttestationIds* attestation_ids_p) {
+    if (cached_attestation_ids_) {
+        *attestation_ids_p = *cached_attestation_ids_;
+        return KM_ERROR_OK;
+    }
+
     *attestation_ids_p = AttestationIds_init_zero;
     keymaster_error_t err = DecodeFromFile(
             AttestationIds_fields, attestation_ids_p, kAttestationIdsFileName);
@@ -620,6 +821,9 @@ keymaster_error_t SecureStorageManager::ReadAttestationIds(
         CloseSession();
         return err;
     }
+    if (!writes_staged_) {
+        cached_attestation_ids_ = CopyOf(*attestation_ids_p);
+    }
     return KM_ERROR_OK;
 }
 
@@ -650,11 +854,11 @@ keymaster_error_t SecureStorageManager::DeleteAllAttestationData() {
         DeleteKey(AttestationKeySlot::kSomEddsa, false) != KM_ERROR_OK ||
         DeleteKey(AttestationKeySlot::kSomEpid, false) != KM_ERROR_OK) {
         // Something wrong, abort the transaction.
-        storage_end_transaction(session_handle_, false);
+        StorageEndTransaction(false);
         CloseSession();
         return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
     }
-    int rc = storage_end_transaction(session_handle_, true);
+    int rc = StorageEndTransaction(true);
     if (rc < 0) {
         LOG_E("Error: failed to commit transaction while deleting keys.", 0);
         CloseSession();
@@ -666,21 +870,34 @@ keymaster_error_t SecureStorageManager::DeleteAllAttestationData() {
 keymaster_error_t SecureStorageManager::ReadAttestationKey(
         AttestationKeySlot key_slot,
         AttestationKey** attestation_key_p) {
-    char key_file[kStorageIdLengthMax];
-    snprintf(key_file, kStorageIdLengthMax, "%s.%s", kAttestKeyCertPrefix,
-             GetKeySlotStr(key_slot));
+    for (CachedAttestationKey& entry : cached_attestation_keys_) {
+        if (entry.attestation_key && entry.key_slot == key_slot) {
+            UniquePtr<AttestationKey> attestation_key =
+                    CopyOf(*entry.attestation_key);
+            if (!attestation_key.get()) {
+                return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+            }
+            entry.last_used = ++cache_use_counter_;
+            *attestation_key_p = attestation_key.release();
+            return KM_ERROR_OK;
+        }
+    }
 
     UniquePtr<AttestationKey> attestation_key(
             new AttestationKey(AttestationKey_init_zero));
     if (!attestation_key.get()) {
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
     }
-    keymaster_error_t err = DecodeFromFile(AttestationKey_fields,
-                                           attestation_key.get(), key_file);
+    keymaster_error_t err =
+            ReadAttestationKeyFile(key_slot, attestation_key.get());
     if (err < 0) {
-        LOG_E("Error: [%d] decoding from file '%s'", err, key_file);
+        LOG_E("Error: [%d] reading attestation key for slot %d", err,
+              key_slot);
         return err;
     }
+    if (!writes_staged_) {
+        CacheAttestationKey(key_slot, *attestation_key);
+    }
     *attestation_key_p = attestation_key.release();
     return KM_ERROR_OK;
 }
@@ -688,63 +905,351 @@ keymaster_error_t SecureStorageManager::ReadAttestationKey(
 keymaster_error_t SecureStorageManager::WriteAttestationKey(
         AttestationKeySlot key_slot,
         const AttestationKey* attestation_key,
-        bool commit) {
+        bool commit,
+        uint32_t regions) {
+    InvalidateAttestationKey(key_slot);
+    writes_staged_ = true;
+    keymaster_error_t err =
+            WriteAttestationKeyFile(key_slot, *attestation_key, regions);
+    if (err != KM_ERROR_OK) {
+        /* Abort the transaction. */
+        StorageEndTransaction(false);
+        return err;
+    }
+    if (commit) {
+        /* Commit the write. */
+        int rc = StorageEndTransaction(true);
+        if (rc < 0) {
+            LOG_E("Error: failed to commit attestation key for slot %d: %d\n",
+                  key_slot, rc);
+            return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+        }
+        CacheAttestationKey(key_slot, *attestation_key);
+    }
+    return KM_ERROR_OK;
+}
+
+static bool read_region(file_handle_t file_handle,
+                        uint64_t offset,
+                        void* buf,
+                        size_t size) {
+    int rc = storage_read(file_handle, offset, buf, size);
+    if (rc < 0 || static_cast<size_t>(rc) < size) {
+        LOG_E("Error: failed to read from attestation key file: %d\n", rc);
+        return false;
+    }
+    return true;
+}
+
+static bool write_region(file_handle_t file_handle,
+                         uint64_t offset,
+                         const void* buf,
+                         size_t size) {
+    /* Do not commit the write. */
+    int rc = storage_write(file_handle, offset, buf, size, 0);
+    if (rc < 0 || static_cast<size_t>(rc) < size) {
+        LOG_E("Error: failed to write to attestation key file: %d\n", rc);
+        return false;
+    }
+    return true;
+}
+
+keymaster_error_t SecureStorageManager::ReadAttestationKeyFile(
+        AttestationKeySlot key_slot,
+        AttestationKey* attestation_key) {
     char key_file[kStorageIdLengthMax];
-    snprintf(key_file, kStorageIdLengthMax, "%s.%s", kAttestKeyCertPrefix,
+    snprintf(key_file, kStorageIdLengthMax, "%s.%s", kAttestKeyCertFilePrefix,
              GetKeySlotStr(key_slot));
 
-    return EncodeToFile(AttestationKey_fields, attestation_key, key_file,
-                        commit);
+    FileCloser file;
+    int rc = file.open_file(session_handle_, key_file, 0, 0);
+    if (rc == ERR_NOT_FOUND) {
+        // No key or certificates in this slot.
+        return KM_ERROR_OK;
+    }
+    if (rc < 0) {
+        LOG_E("Error: failed to open file '%s': %d\n", key_file, rc);
+        return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+    }
+
+    AttestationKeyFileHeader header;
+    if (!read_region(file.get_file_handle(), 0, &header, sizeof(header))) {
+        return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+    }
+    if (header.magic != kAttestationKeyFileMagic ||
+        header.version != kAttestationKeyFileVersion ||
+        header.key_size > kKeySizeMax ||
+        header.certs_count > kMaxCertChainLength) {
+        LOG_E("Error: invalid attestation key file '%s'", key_file);
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
+
+    if (header.flags & kAttestationKeyFileHasKey) {
+        if (!read_region(file.get_file_handle(), key_region_offset(),
+                         attestation_key->key.bytes, header.key_size)) {
+            return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+        }
+        attestation_key->has_key = true;
+        attestation_key->key.size = header.key_size;
+    }
+
+    for (uint32_t i = 0; i < header.certs_count; i++) {
+        if (header.cert_sizes[i] > kCertSizeMax) {
+            LOG_E("Error: invalid attestation key file '%s'", key_file);
+            return KM_ERROR_UNKNOWN_ERROR;
+        }
+        if (!read_region(file.get_file_handle(), cert_region_offset(i),
+                         attestation_key->certs[i].content.bytes,
+                         header.cert_sizes[i])) {
+            return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+        }
+        attestation_key->certs[i].content.size = header.cert_sizes[i];
+    }
+    attestation_key->certs_count = header.certs_count;
+    return KM_ERROR_OK;
 }
 
-void SecureStorageManager::CloseSession() {
-    if (session_handle_ != STORAGE_INVALID_SESSION) {
-        storage_close_session(session_handle_);
-        session_handle_ = STORAGE_INVALID_SESSION;
+keymaster_error_t SecureStorageManager::WriteAttestationKeyFile(
+        AttestationKeySlot key_slot,
+        const AttestationKey& attestation_key,
+        uint32_t regions) {
+    if (attestation_key.certs_count > kMaxCertChainLength) {
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+
+    AttestationKeyFileHeader header = {};
+    header.magic = kAttestationKeyFileMagic;
+    header.version = kAttestationKeyFileVersion;
+    header.flags = attestation_key.has_key ? kAttestationKeyFileHasKey : 0;
+    header.key_size = attestation_key.has_key ? attestation_key.key.size : 0;
+    header.certs_count = attestation_key.certs_count;
+    uint64_t file_size = kAttestationKeyFileHeaderSize;
+    if (attestation_key.has_key) {
+        file_size = key_region_offset() + header.key_size;
+    }
+    for (uint32_t i = 0; i < header.certs_count; i++) {
+        header.cert_sizes[i] = attestation_key.certs[i].content.size;
+        file_size = cert_region_offset(i) + header.cert_sizes[i];
+    }
+
+    char key_file[kStorageIdLengthMax];
+    snprintf(key_file, kStorageIdLengthMax, "%s.%s", kAttestKeyCertFilePrefix,
+             GetKeySlotStr(key_slot));
+
+    FileCloser file;
+    int rc = file.open_file(session_handle_, key_file,
+                            STORAGE_FILE_OPEN_CREATE, 0);
+    if (rc < 0) {
+        LOG_E("Error: failed to open file '%s': %d\n", key_file, rc);
+        return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
     }
+    file_handle_t file_handle = file.get_file_handle();
+
+    // A full rewrite sets the exact size, dropping anything stale past the
+    // end. A partial write only grows the file to fit the changed regions.
+    uint64_t current_size = 0;
+    if (regions != kAllRegions) {
+        rc = storage_get_file_size(file_handle, &current_size);
+        if (rc < 0) {
+            LOG_E("Error: failed to get size of file '%s': %d\n", key_file,
+                  rc);
+            return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+        }
+    }
+    if (regions == kAllRegions || current_size < file_size) {
+        rc = storage_set_file_size(file_handle, file_size, 0);
+        if (rc < 0) {
+            LOG_E("Error: failed to set size of file '%s': %d\n", key_file,
+                  rc);
+            return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+        }
+    }
+
+    if ((regions & kKeyRegion) && header.key_size &&
+        !write_region(file_handle, key_region_offset(),
+                      attestation_key.key.bytes, header.key_size)) {
+        return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+    }
+    for (uint32_t i = 0; i < header.certs_count; i++) {
+        if ((regions & CertRegion(i)) && header.cert_sizes[i] &&
+            !write_region(file_handle, cert_region_offset(i),
+                          attestation_key.certs[i].content.bytes,
+                          header.cert_sizes[i])) {
+            return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+        }
+    }
+    if (!write_region(file_handle, 0, &header, sizeof(header))) {
+        return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+    }
+    return KM_ERROR_OK;
 }
 
-struct FileStatus {
-    /* How many bytes handled in the file. */
-    uint64_t bytes_handled;
-    file_handle_t file_handle;
-    FileStatus() : bytes_handled(0), file_handle(0) {}
-};
+keymaster_error_t SecureStorageManager::TranslateProtobufFormat() {
+    bool translated = false;
+    char proto_file[kStorageIdLengthMax];
+    for (AttestationKeySlot key_slot : kAttestationKeySlots) {
+        snprintf(proto_file, kStorageIdLengthMax, "%s.%s",
+                 kAttestKeyCertPrefix, GetKeySlotStr(key_slot));
+        UniquePtr<AttestationKey> attestation_key(
+                new (std::nothrow) AttestationKey(AttestationKey_init_zero));
+        if (!attestation_key.get()) {
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        }
+        keymaster_error_t err = DecodeFromFile(
+                AttestationKey_fields, attestation_key.get(), proto_file);
+        if (err != KM_ERROR_OK) {
+            LOG_E("Error: [%d] decoding from file '%s'", err, proto_file);
+            return err;
+        }
+        // Do not commit the delete.
+        writes_staged_ = true;
+        int rc = storage_delete_file(session_handle_, proto_file, 0);
+        if (rc == ERR_NOT_FOUND) {
+            continue;
+        }
+        if (rc < 0) {
+            return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+        }
+        // Do not commit the write.
+        err = WriteAttestationKey(key_slot, attestation_key.get(), false);
+        if (err != KM_ERROR_OK) {
+            LOG_E("Failed to write attestation key for slot: %d: %d\n",
+                  key_slot, err);
+            return err;
+        }
+        translated = true;
+    }
 
-bool write_to_file_callback(pb_ostream_t* stream,
-                            const uint8_t* buf,
-                            size_t count) {
-    FileStatus* file_status = reinterpret_cast<FileStatus*>(stream->state);
-    /* Do not commit the write. */
-    int rc = storage_write(file_status->file_handle, file_status->bytes_handled,
-                           buf, count, 0);
-    if (rc < 0 || static_cast<size_t>(rc) < count) {
-        LOG_E("Error: failed to write to file: %d\n", rc);
-        return false;
+    if (translated) {
+        // Commit the pending transactions.
+        int rc = StorageEndTransaction(true);
+        if (rc < 0) {
+            LOG_E("Error: failed to commit write transaction to translate"
+                  " attestation key files.\n",
+                  0);
+            return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+        }
     }
-    file_status->bytes_handled += rc;
-    return true;
+    return KM_ERROR_OK;
 }
 
-bool read_from_file_callback(pb_istream_t* stream, uint8_t* buf, size_t count) {
-    if (buf == NULL) {
-        return false;
+void SecureStorageManager::WipeAttestationKey(
+        UniquePtr<AttestationKey>* attestation_key) {
+    if (*attestation_key) {
+        memset_s(attestation_key->get(), 0, sizeof(AttestationKey));
+        attestation_key->reset();
     }
-    FileStatus* file_status = reinterpret_cast<FileStatus*>(stream->state);
-    int rc = storage_read(file_status->file_handle, file_status->bytes_handled,
-                          buf, count);
-    if (rc < 0 || static_cast<size_t>(rc) < count) {
-        LOG_E("Error: failed to read from file: %d\n", rc);
-        return false;
+}
+
+void SecureStorageManager::CacheAttestationKey(
+        AttestationKeySlot key_slot,
+        const AttestationKey& attestation_key) {
+    CachedAttestationKey* victim = &cached_attestation_keys_[0];
+    for (CachedAttestationKey& entry : cached_attestation_keys_) {
+        if (!entry.attestation_key) {
+            victim = &entry;
+            break;
+        }
+        if (entry.last_used < victim->last_used) {
+            victim = &entry;
+        }
+    }
+    WipeAttestationKey(&victim->attestation_key);
+    victim->attestation_key = CopyOf(attestation_key);
+    victim->key_slot = key_slot;
+    victim->last_used = ++cache_use_counter_;
+}
+
+void SecureStorageManager::InvalidateAttestationKey(
+        AttestationKeySlot key_slot) {
+    // Every write and delete of a slot passes through here.
+    attestation_key_generation_++;
+    for (CachedAttestationKey& entry : cached_attestation_keys_) {
+        if (entry.key_slot == key_slot) {
+            WipeAttestationKey(&entry.attestation_key);
+            entry.key_slot = AttestationKeySlot::kInvalid;
+        }
+    }
+}
+
+void SecureStorageManager::ClearCaches() {
+    attestation_key_generation_++;
+    attestation_ids_generation_++;
+    for (CachedAttestationKey& entry : cached_attestation_keys_) {
+        WipeAttestationKey(&entry.attestation_key);
+        entry.key_slot = AttestationKeySlot::kInvalid;
+    }
+    cached_km_attributes_.reset();
+    cached_attestation_ids_.reset();
+}
+
+int SecureStorageManager::StorageEndTransaction(bool complete) {
+    int rc = storage_end_transaction(session_handle_, complete);
+    if (writes_staged_ && (!complete || rc < 0)) {
+        // The staged writes were discarded.
+        ClearCaches();
+    }
+    writes_staged_ = false;
+    return rc;
+}
+
+keymaster_error_t SecureStorageManager::EndTransaction(bool commit) {
+    if (!commit) {
+        ClearCaches();
+    }
+    if (session_handle_ == STORAGE_INVALID_SESSION) {
+        // The session was closed after an error, which discarded any pending
+        // writes.
+        return commit ? KM_ERROR_SECURE_HW_COMMUNICATION_FAILED : KM_ERROR_OK;
+    }
+    int rc = StorageEndTransaction(commit);
+    if (rc < 0) {
+        LOG_E("Error: failed to end transaction: %d\n", rc);
+        CloseSession();
+        return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+    }
+    return KM_ERROR_OK;
+}
+
+void SecureStorageManager::CloseSession() {
+    if (writes_staged_) {
+        // Closing the session discards the staged writes.
+        ClearCaches();
+        writes_staged_ = false;
+    }
+    if (session_handle_ != STORAGE_INVALID_SESSION) {
+        storage_close_session(session_handle_);
+        session_handle_ = STORAGE_INVALID_SESSION;
     }
-    file_status->bytes_handled += rc;
-    return true;
 }
 
 keymaster_error_t SecureStorageManager::EncodeToFile(const pb_field_t fields[],
                                                      const void* dest_struct,
                                                      const char filename[],
                                                      bool commit) {
+    // Encode into memory first, so that the file is written with a few
+    // large writes instead of one write per field.
+    size_t encoded_size;
+    if (!pb_get_encoded_size(&encoded_size, fields, dest_struct)) {
+        LOG_E("Error: computing encoded size for file '%s'", filename);
+        StorageEndTransaction(false);
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
+    WipedBuffer encoded(encoded_size);
+    if (!encoded.get() && encoded_size) {
+        /* Abort the transaction. */
+        StorageEndTransaction(false);
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    pb_ostream_t stream = pb_ostream_from_buffer(encoded.get(), encoded_size);
+    if (!pb_encode(&stream, fields, dest_struct)) {
+        LOG_E("Error: encoding fields to file '%s'", filename);
+        /* Abort the transaction. */
+        StorageEndTransaction(false);
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+
+    writes_staged_ = true;
     FileCloser file;
     int rc = file.open_file(
             session_handle_, filename,
@@ -753,19 +1258,23 @@ keymaster_error_t SecureStorageManager::EncodeToFile(const pb_field_t fields[],
         LOG_E("Error: failed to open file '%s': %d\n", filename, rc);
         return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
     }
-    FileStatus new_file_status;
-    new_file_status.file_handle = file.get_file_handle();
-    pb_ostream_t stream = {&write_to_file_callback, &new_file_status, SIZE_MAX,
-                           0, 0};
-    if (!pb_encode(&stream, fields, dest_struct)) {
-        LOG_E("Error: encoding fields to file '%s'", filename);
-        /* Abort the transaction. */
-        storage_end_transaction(session_handle_, false);
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    for (size_t offset = 0; offset < stream.bytes_written;
+         offset += kStorageIoChunkSize) {
+        size_t len =
+                std::min(kStorageIoChunkSize, stream.bytes_written - offset);
+        /* Do not commit the write. */
+        rc = storage_write(file.get_file_handle(), offset,
+                           encoded.get() + offset, len, 0);
+        if (rc < 0 || static_cast<size_t>(rc) < len) {
+            LOG_E("Error: failed to write to file '%s': %d\n", filename, rc);
+            /* Abort the transaction. */
+            StorageEndTransaction(false);
+            return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+        }
     }
     if (commit) {
         /* Commit the write. */
-        rc = storage_end_transaction(session_handle_, true);
+        rc = StorageEndTransaction(true);
         if (rc < 0) {
             LOG_E("Error: failed to commit write transaction for file '%s': %d"
                   "\n",
@@ -793,13 +1302,33 @@ keymaster_error_t SecureStorageManager::DecodeFromFile(
     }
     rc = storage_get_file_size(file.get_file_handle(), &file_size);
     if (rc < 0) {
-        LOG_E("Error: failed to get size of attributes file '%s': %d\n", rc);
+        LOG_E("Error: failed to get size of attributes file '%s': %d\n",
+              filename, rc);
         return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
     }
-    FileStatus new_file_status;
-    new_file_status.file_handle = file.get_file_handle();
-    pb_istream_t stream = {&read_from_file_callback, &new_file_status,
-                           static_cast<size_t>(file_size), 0};
+    if (file_size > kEncodedFileSizeMax) {
+        LOG_E("Error: file '%s' too large\n", filename);
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
+
+    // Read the whole file up front rather than letting nanopb issue a read
+    // for every field.
+    size_t size = static_cast<size_t>(file_size);
+    WipedBuffer encoded(size);
+    if (!encoded.get() && size) {
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    for (size_t offset = 0; offset < size; offset += kStorageIoChunkSize) {
+        size_t len = std::min(kStorageIoChunkSize, size - offset);
+        rc = storage_read(file.get_file_handle(), offset,
+                          encoded.get() + offset, len);
+        if (rc < 0 || static_cast<size_t>(rc) < len) {
+            LOG_E("Error: failed to read from file '%s': %d\n", filename, rc);
+            return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+        }
+    }
+
+    pb_istream_t stream = pb_istream_from_buffer(encoded.get(), size);
     if (!pb_decode(&stream, fields, dest_struct)) {
         LOG_E("Error: decoding fields from file '%s'", filename);
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
@@ -816,19 +1345,14 @@ keymaster_error_t SecureStorageManager::TranslateLegacyFormat() {
         // New attribute file exists, nothing to do.
         return KM_ERROR_OK;
     }
-    AttestationKeySlot key_slots[] = {
-            AttestationKeySlot::kRsa,        AttestationKeySlot::kEcdsa,
-            AttestationKeySlot::kEddsa,      AttestationKeySlot::kEpid,
-            AttestationKeySlot::kClaimable0, AttestationKeySlot::kSomRsa,
-            AttestationKeySlot::kSomEcdsa,   AttestationKeySlot::kSomEddsa,
-            AttestationKeySlot::kSomEpid};
+    // The deletes and writes below are committed together at the end.
+    writes_staged_ = true;
     char key_file[kStorageIdLengthMax];
     char cert_file[kStorageIdLengthMax];
     uint32_t key_size;
     uint32_t cert_size;
     keymaster_error_t err;
-    for (size_t i = 0; i < sizeof(key_slots) / sizeof(int); i++) {
-        AttestationKeySlot key_slot = key_slots[i];
+    for (AttestationKeySlot key_slot : kAttestationKeySlots) {
         UniquePtr<AttestationKey> attestation_key(
                 new AttestationKey(AttestationKey_init_zero));
         snprintf(key_file, kStorageIdLengthMax, "%s.%s", kLegacyAttestKeyPrefix,
@@ -918,7 +1442,7 @@ keymaster_error_t SecureStorageManager::TranslateLegacyFormat() {
     }
 
     // Commit the pending transactions.
-    rc = storage_end_transaction(session_handle_, STORAGE_OP_COMPLETE);
+    rc = StorageEndTransaction(true);
     if (rc < 0) {
         LOG_E("Error: failed to commit write transaction to translate file"
               " format.\n",
@@ -1021,6 +1545,27 @@ keymaster_error_t SecureStorageManager::LegacySetProductId(
     return LegacySecureStorageWrite(kLegacyProductIdFileName, product_id,
                                     kProductIdSize);
 }
+
+// Deprecated, for unit tests only.
+keymaster_error_t SecureStorageManager::LegacyWriteProtobufKeyToStorage(
+        AttestationKeySlot key_slot,
+        const uint8_t* key,
+        uint32_t key_size) {
+    if (key_size > kKeySizeMax) {
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+    UniquePtr<AttestationKey> attestation_key(
+            new AttestationKey(AttestationKey_init_zero));
+    attestation_key->has_key = true;
+    attestation_key->key.size = key_size;
+    memcpy(attestation_key->key.bytes, key, key_size);
+
+    char proto_file[kStorageIdLengthMax];
+    snprintf(proto_file, kStorageIdLengthMax, "%s.%s", kAttestKeyCertPrefix,
+             GetKeySlotStr(key_slot));
+    return EncodeToFile(AttestationKey_fields, attestation_key.get(),
+                        proto_file, true);
+}
 #endif  // #ifdef KEYMASTER_LEGACY_FORMAT
 
 SecureStorageManager::SecureStorageManager() {
@@ -1029,6 +1574,9 @@ SecureStorageManager::SecureStorageManager() {
 
 SecureStorageManager::~SecureStorageManager() {
     CloseSession();
+    for (CachedAttestationKey& entry : cached_attestation_keys_) {
+        WipeAttestationKey(&entry.attestation_key);
+    }
 }
 
 }  // namespace keymaster
@@ -77,13 +77,21 @@ public:
      * filesystem.
      */
 
+    /**
+     * The functions below that take a |commit| argument can stage several
+     * writes in one transaction by passing false. The caller must then
+     * finish the transaction with EndTransaction() before handing the
+     * instance to anyone else.
+     */
+
     /**
      * Writes |key_size| bytes at |key| to key/cert file associated with
      * |key_slot|.
      */
     keymaster_error_t WriteKeyToStorage(AttestationKeySlot key_slot,
                                         const uint8_t* key,
-                                        uint32_t key_size);
+                                        uint32_t key_size,
+                                        bool commit = true);
 
     /**
      * Reads key associated with |key_slot|.
@@ -107,7 +115,8 @@ public:
     keymaster_error_t WriteCertToStorage(AttestationKeySlot key_slot,
                                          const uint8_t* cert,
                                          uint32_t cert_size,
-                                         uint32_t index);
+                                         uint32_t index,
+                                         bool commit = true);
 
     /**
      * Reads cert chain associated with |key_slot|. Stores certificate chain in
@@ -120,7 +129,8 @@ public:
     /**
      * Delete cert chain associated with |key_slot|.
      */
-    keymaster_error_t DeleteCertChainFromStorage(AttestationKeySlot key_slot);
+    keymaster_error_t DeleteCertChainFromStorage(AttestationKeySlot key_slot,
+                                                 bool commit = true);
 
     /**
      * Reads cert chain associated with |key_slot| in ATAP format. Stores
@@ -183,14 +193,15 @@ public:
     /**
      * Set the |product_id|.
      */
-    keymaster_error_t SetProductId(const uint8_t product_id[kProductIdSize]);
+    keymaster_error_t SetProductId(const uint8_t product_id[kProductIdSize],
+                                   bool commit = true);
 
     /**
      * Set the attestation IDs for the device. This function can only be used
      * once unless Keymaster is in debug mode.
      */
-    keymaster_error_t SetAttestationIds(
-            const SetAttestationIdsRequest& request);
+    keymaster_error_t SetAttestationIds(const SetAttestationIdsRequest& request,
+                                        bool commit = true);
 
     /**
      * Reads the attestations IDs for the device.
@@ -212,6 +223,51 @@ public:
      */
     keymaster_error_t DeleteAllAttestationData();
 
+    /**
+     * Commits, or discards if |commit| is false, the writes staged with
+     * commit = false since the last transaction ended. Discarding also
+     * clears the in-memory caches.
+     */
+    keymaster_error_t EndTransaction(bool commit);
+
+    /**
+     * Returns a counter that changes whenever an attestation key slot is
+     * written or deleted. Callers that keep state derived from a stored key,
+     * such as a parsed private key, compare it to tell if the state is stale.
+     */
+    uint32_t AttestationKeyGeneration() const {
+        return attestation_key_generation_;
+    }
+
+    /**
+     * Returns a counter that changes whenever the attestation IDs are
+     * written, for callers that keep state derived from them.
+     */
+    uint32_t AttestationIdsGeneration() const {
+        return attestation_ids_generation_;
+    }
+
+#ifdef KEYMASTER_STORAGE_STATS
+
+    /**
+     * Number of calls made to the storage service, by call.  Each one is a
+     * round trip, so benchmarks report these next to the time taken.  Only
+     * counted in benchmark builds.
+     */
+    struct StorageStats {
+        uint32_t open_file = 0;
+        uint32_t read = 0;
+        uint32_t write = 0;
+        uint32_t get_file_size = 0;
+        uint32_t set_file_size = 0;
+        uint32_t delete_file = 0;
+        uint32_t end_transaction = 0;
+    };
+    static StorageStats GetStorageStats();
+    static void ResetStorageStats();
+
+#endif  // #ifdef KEYMASTER_STORAGE_STATS
+
 #ifdef KEYMASTER_LEGACY_FORMAT
 
     /**
@@ -237,9 +293,25 @@ public:
      */
     keymaster_error_t LegacySetProductId(
             const uint8_t product_id[kProductIdSize]);
+    /**
+     * Deprecated, for unit tests only. Writes a key in the protobuf
+     * attestation key file format used before TranslateProtobufFormat.
+     */
+    keymaster_error_t LegacyWriteProtobufKeyToStorage(
+            AttestationKeySlot key_slot,
+            const uint8_t* key,
+            uint32_t key_size);
 #endif  // #define KEYMASTER_LEGACY_FORMAT
 
 private:
+    /**
+     * Regions of an attestation key file, used to tell WriteAttestationKey
+     * which parts of the record changed.
+     */
+    static const uint32_t kKeyRegion = 1;
+    static const uint32_t kAllRegions = 0xffffffff;
+    static uint32_t CertRegion(uint32_t index) { return 2u << index; }
+
     bool SecureStorageGetFileSize(const char* filename, uint64_t* size);
     bool SecureStorageDeleteFile(const char* filename);
     keymaster_error_t ReadKeymasterAttributes(
@@ -251,9 +323,21 @@ private:
                                           bool commit);
     keymaster_error_t ReadAttestationKey(AttestationKeySlot key_slot,
                                          AttestationKey** attestation_key_p);
+    /**
+     * Writes |attestation_key| to the file for |key_slot|. Only the regions
+     * in |regions| and the file header are written, the rest of the file must
+     * already match |attestation_key|.
+     */
     keymaster_error_t WriteAttestationKey(AttestationKeySlot key_slot,
                                           const AttestationKey* attestation_key,
-                                          bool commit);
+                                          bool commit,
+                                          uint32_t regions = kAllRegions);
+    keymaster_error_t ReadAttestationKeyFile(AttestationKeySlot key_slot,
+                                             AttestationKey* attestation_key);
+    keymaster_error_t WriteAttestationKeyFile(
+            AttestationKeySlot key_slot,
+            const AttestationKey& attestation_key,
+            uint32_t regions);
     keymaster_error_t EncodeToFile(const pb_field_t fields[],
                                    const void* dest_struct,
                                    const char filename[],
@@ -266,9 +350,55 @@ private:
      */
     keymaster_error_t TranslateLegacyFormat();
 
+    /**
+     * Translate attestation key files from the protobuf format to the
+     * current format with fixed key and certificate regions.
+     */
+    keymaster_error_t TranslateProtobufFormat();
+    bool protobuf_format_ = true;
+
     int StorageOpenSession(const char* type);
     void CloseSession();
 
+    /**
+     * Ends the transaction on the session, committing the staged writes if
+     * |complete| is set and discarding them otherwise. The caches are
+     * cleared if staged writes are discarded.
+     */
+    int StorageEndTransaction(bool complete);
+
+    /**
+     * In-memory copies of the storage contents, so that repeated reads don't
+     * decode the same files again. Entries are filled in by reads and by
+     * committed writes only. Uncommitted writes and deletes drop the entry,
+     * since the transaction may still be rolled back, and reads made while
+     * writes are staged are not cached, since they may see staged data.
+     * Cached attestation keys are wiped when they are dropped.
+     */
+    void CacheAttestationKey(AttestationKeySlot key_slot,
+                             const AttestationKey& attestation_key);
+    void InvalidateAttestationKey(AttestationKeySlot key_slot);
+    static void WipeAttestationKey(UniquePtr<AttestationKey>* attestation_key);
+    /**
+     * Drops every cached entry, for when a transaction is aborted.
+     */
+    void ClearCaches();
+
+    struct CachedAttestationKey {
+        AttestationKeySlot key_slot = AttestationKeySlot::kInvalid;
+        uint64_t last_used = 0;
+        UniquePtr<AttestationKey> attestation_key;
+    };
+    static const size_t kAttestationKeyCacheSize = 2;
+    CachedAttestationKey cached_attestation_keys_[kAttestationKeyCacheSize];
+    uint64_t cache_use_counter_ = 0;
+    uint32_t attestation_key_generation_ = 0;
+    uint32_t attestation_ids_generation_ = 0;
+    UniquePtr<KeymasterAttributes> cached_km_attributes_;
+    UniquePtr<AttestationIds> cached_attestation_ids_;
+    // Set while the open transaction holds uncommitted writes or deletes.
+    bool writes_staged_ = false;
+
     SecureStorageManager();
     ~SecureStorageManager();
     storage_session_t session_handle_;
@@ -26,9 +26,31 @@
 
 namespace keymaster {
 
+/*
+ * Returns false if the peer has closed |chan|, for instance because the HWWSK
+ * service restarted, without blocking.
+ */
+static bool hwwsk_chan_is_healthy(handle_t chan) {
+    uevent_t ev;
+    int rc = wait(chan, &ev, 0);
+    if (rc == ERR_TIMED_OUT) {
+        return true;
+    }
+    if (rc < 0) {
+        return false;
+    }
+    return !(ev.event & (IPC_HANDLE_POLL_HUP | IPC_HANDLE_POLL_ERROR));
+}
+
 handle_t TrustyAesKeyFactory::get_hwwsk_chan(void) const {
     handle_t hchan;
 
+    if (hwwsk_chan_ != INVALID_IPC_HANDLE &&
+        !hwwsk_chan_is_healthy(hwwsk_chan_)) {
+        LOG_I("HWWSK: connection closed by peer, reconnecting", 0);
+        reset_hwwsk_chan();
+    }
+
     if (hwwsk_chan_ == INVALID_IPC_HANDLE) {
         // open new connection
         int rc = tipc_connect(&hchan, HWWSK_PORT);
@@ -87,9 +109,11 @@ keymaster_error_t TrustyAesKeyFactory::CreateHwStorageKeyBlob(
         return KM_ERROR_UNKNOWN_ERROR;
     }
 
-    // Build key flags
+    // Build key flags.  Rollback resistance is best effort, so don't ask for
+    // it once the service is known not to support it.
     key_flags = 0;
-    if (key_description.GetTagValue(TAG_ROLLBACK_RESISTANCE)) {
+    if (key_description.GetTagValue(TAG_ROLLBACK_RESISTANCE) &&
+        hwwsk_rollback_resistance_ != Support::kUnsupported) {
         key_flags |= HWWSK_FLAGS_ROLLBACK_RESISTANCE;
     }
 
@@ -97,6 +121,9 @@ keymaster_error_t TrustyAesKeyFactory::CreateHwStorageKeyBlob(
     rc = hwwsk_generate_key(hchan, sk_blob, sizeof(sk_blob), key_size,
                             key_flags, input_key_material.key_material,
                             input_key_material.key_material_size);
+    if (rc >= 0 && (key_flags & HWWSK_FLAGS_ROLLBACK_RESISTANCE)) {
+        hwwsk_rollback_resistance_ = Support::kSupported;
+    }
     if (rc < 0) {
         if (rc == ERR_NOT_SUPPORTED &&
             (key_flags & HWWSK_FLAGS_ROLLBACK_RESISTANCE)) {
@@ -104,6 +131,10 @@ keymaster_error_t TrustyAesKeyFactory::CreateHwStorageKeyBlob(
             rc = hwwsk_generate_key(hchan, sk_blob, sizeof(sk_blob), key_size,
                                     key_flags, input_key_material.key_material,
                                     input_key_material.key_material_size);
+            if (rc >= 0) {
+                LOG_I("HWWSK: rollback resistance not supported", 0);
+                hwwsk_rollback_resistance_ = Support::kUnsupported;
+            }
         }
         if (rc < 0) {
             if (rc != ERR_NOT_SUPPORTED) {
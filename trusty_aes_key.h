@@ -55,10 +55,23 @@ public:
                               AuthorizationSet&& sw_enforced,
                               UniquePtr<Key>* key) const override;
 
+    /**
+     * Returns the connection to the HWWSK service, connecting first if there
+     * is none or if the service has closed the current one.  Returns a
+     * negative error on failure.
+     */
     handle_t get_hwwsk_chan(void) const;
     void reset_hwwsk_chan(void) const;
 
 private:
+    // Whether the HWWSK service supports HWWSK_FLAGS_ROLLBACK_RESISTANCE.  It
+    // doesn't change at runtime, so it's only probed until first known.
+    enum class Support {
+        kUnknown,
+        kSupported,
+        kUnsupported,
+    };
+
     keymaster_error_t CreateHwStorageKeyBlob(
             const AuthorizationSet& key_description,
             const KeymasterKeyBlob& input_key_material,
@@ -67,6 +80,7 @@ private:
             AuthorizationSet* sw_enforced) const;
 
     mutable handle_t hwwsk_chan_;
+    mutable Support hwwsk_rollback_resistance_ = Support::kUnknown;
 };
 
 class HwStorageKey : public AesKey {
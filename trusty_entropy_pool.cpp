@@ -0,0 +1,54 @@
+/*
+ * Copyright 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "trusty_entropy_pool.h"
+
+#include <string.h>
+
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/logger.h>
+#include <lib/rng/trusty_rng.h>
+
+namespace keymaster {
+
+EntropyPool::~EntropyPool() {
+    memset_s(pool_, 0, sizeof(pool_));
+}
+
+bool EntropyPool::Refill() {
+    if (!NeedsRefill()) {
+        return true;
+    }
+    size_t size = kCapacity - available_;
+    if (trusty_rng_hw_rand(pool_ + available_, size) != 0) {
+        LOG_E("Failed to get bytes from HW RNG", 0);
+        return false;
+    }
+    available_ = kCapacity;
+    return true;
+}
+
+bool EntropyPool::Take(uint8_t* buf, size_t size) {
+    if (size > available_) {
+        return false;
+    }
+    available_ -= size;
+    memcpy(buf, pool_ + available_, size);
+    memset_s(pool_ + available_, 0, size);
+    return true;
+}
+
+}  // namespace keymaster
@@ -0,0 +1,60 @@
+/*
+ * Copyright 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace keymaster {
+
+/**
+ * EntropyPool holds bytes read ahead of time from the hardware RNG, so that
+ * periodic reseeds on the request path don't have to wait for it.  The pool
+ * is topped up between requests.  Bytes are wiped as they are taken out.
+ */
+class EntropyPool {
+public:
+    static constexpr size_t kCapacity = 256;
+
+    EntropyPool() = default;
+    EntropyPool(const EntropyPool&) = delete;
+    EntropyPool& operator=(const EntropyPool&) = delete;
+    ~EntropyPool();
+
+    /**
+     * Returns true if the pool has room for more entropy.
+     */
+    bool NeedsRefill() const { return available_ < kCapacity; }
+
+    /**
+     * Fills the pool from the hardware RNG.  Returns false if the RNG failed,
+     * in which case the pool is left as it was.
+     */
+    bool Refill();
+
+    /**
+     * Moves |size| bytes from the pool to |buf|.  Returns false, and takes
+     * nothing, if fewer than |size| bytes are available.
+     */
+    bool Take(uint8_t* buf, size_t size);
+
+private:
+    uint8_t pool_[kCapacity];
+    size_t available_ = 0;
+};
+
+}  // namespace keymaster
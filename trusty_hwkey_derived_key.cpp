@@ -0,0 +1,73 @@
+/*
+ * Copyright 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "trusty_hwkey_derived_key.h"
+
+#include <keymaster/logger.h>
+#include <lib/hwkey/hwkey.h>
+
+namespace keymaster {
+
+keymaster_error_t HwkeyDerivedKey::Derive() const {
+    LOG_D("Deriving key from HBK", 0);
+
+    long rc = hwkey_open();
+    if (rc < 0) {
+        LOG_S("Couldn't open hwkey session: %d", rc);
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
+
+    hwkey_session_t session = static_cast<hwkey_session_t>(rc);
+
+    KeymasterKeyBlob derived_key(key_size_);
+    if (!derived_key.key_material) {
+        LOG_S("Could not allocate memory for derived key buffer", 0);
+        hwkey_close(session);
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+
+    uint32_t kdf_version = HWKEY_KDF_VERSION_1;
+    rc = hwkey_derive(session, &kdf_version, derivation_data_,
+                      derived_key.writable_data(), key_size_);
+    hwkey_close(session);
+
+    if (rc < 0) {
+        LOG_S("Error deriving key: %d", rc);
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
+
+    key_ = std::move(derived_key);
+    LOG_D("Key derivation complete", 0);
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t HwkeyDerivedKey::GetKey(KeymasterKeyBlob* key) const {
+    if (!key_.key_material) {
+        keymaster_error_t error = Derive();
+        if (error != KM_ERROR_OK) {
+            return error;
+        }
+    }
+
+    if (!key->Reset(key_.key_material_size)) {
+        LOG_S("Could not allocate memory for key buffer", 0);
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    memcpy(key->writable_data(), key_.key_material, key_.key_material_size);
+    return KM_ERROR_OK;
+}
+
+}  // namespace keymaster
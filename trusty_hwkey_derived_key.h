@@ -0,0 +1,66 @@
+/*
+ * Copyright 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <keymaster/android_keymaster_utils.h>
+
+namespace keymaster {
+
+/**
+ * HwkeyDerivedKey is a key derived from the hardware-bound key (HBK) by the
+ * hwkey service.  The key is derived on first use and then kept in memory, so
+ * only the first caller pays for the hwkey session and derivation round trip.
+ *
+ * The cached key material is wiped by Invalidate() and when the object is
+ * destroyed.
+ */
+class HwkeyDerivedKey {
+public:
+    /**
+     * Creates a key derived with |derivation_data|.  |derivation_data| must be
+     * |key_size| bytes long and must outlive this object.
+     */
+    HwkeyDerivedKey(const uint8_t* derivation_data, size_t key_size)
+            : derivation_data_(derivation_data), key_size_(key_size) {}
+    ~HwkeyDerivedKey() { Invalidate(); }
+
+    HwkeyDerivedKey(const HwkeyDerivedKey&) = delete;
+    HwkeyDerivedKey& operator=(const HwkeyDerivedKey&) = delete;
+
+    /**
+     * Copies the derived key to |key|, deriving it first if it is not cached
+     * yet.
+     */
+    keymaster_error_t GetKey(KeymasterKeyBlob* key) const;
+
+    /**
+     * Wipes the cached key.  The next call to GetKey() derives it again.
+     */
+    void Invalidate() const { key_.Clear(); }
+
+private:
+    keymaster_error_t Derive() const;
+
+    const uint8_t* derivation_data_;
+    size_t key_size_;
+    mutable KeymasterKeyBlob key_;
+};
+
+}  // namespace keymaster
@@ -0,0 +1,60 @@
+/*
+ * Copyright 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "trusty_idle_scheduler.h"
+
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+int IdleScheduler::Register(const char* name, Task task, void* arg) {
+    if (task_count_ == kMaxTasks) {
+        LOG_E("Too many idle tasks, dropping %s", name);
+        return kInvalidTask;
+    }
+    tasks_[task_count_] = {name, task, arg, true};
+    return static_cast<int>(task_count_++);
+}
+
+void IdleScheduler::Schedule(int id) {
+    if (id < 0 || static_cast<size_t>(id) >= task_count_) {
+        return;
+    }
+    tasks_[id].pending = true;
+}
+
+bool IdleScheduler::HasPendingTasks() const {
+    for (size_t i = 0; i < task_count_; i++) {
+        if (tasks_[i].pending) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void IdleScheduler::RunNext() {
+    for (size_t i = 0; i < task_count_; i++) {
+        Entry& entry = tasks_[next_task_];
+        next_task_ = (next_task_ + 1) % task_count_;
+        if (entry.pending) {
+            LOG_D("Running idle task %s", entry.name);
+            entry.pending = entry.task(entry.arg);
+            return;
+        }
+    }
+}
+
+}  // namespace keymaster
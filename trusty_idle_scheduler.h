@@ -0,0 +1,84 @@
+/*
+ * Copyright 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+namespace keymaster {
+
+/**
+ * IdleScheduler runs deferred work while the keymaster has no requests to
+ * serve.  The main loop polls for events without blocking while any task is
+ * pending, and runs one pending task each time the poll finds nothing.  A
+ * step is not interrupted, so a request that arrives during one waits for it
+ * to finish.  The longest step is a refill of the RSA keypair pool, which
+ * generates a whole RSA-2048 keypair and can take seconds; secure requests
+ * are still served at the checkpoints of its prime search, but other
+ * requests wait.  Tasks run on the main thread and should keep each step
+ * short.
+ */
+class IdleScheduler {
+public:
+    /**
+     * Runs one step of a task.  Returns true if the task has more work to do,
+     * in which case it stays pending.
+     */
+    typedef bool (*Task)(void* arg);
+
+    static constexpr size_t kMaxTasks = 8;
+    static constexpr int kInvalidTask = -1;
+
+    IdleScheduler() = default;
+    IdleScheduler(const IdleScheduler&) = delete;
+    IdleScheduler& operator=(const IdleScheduler&) = delete;
+
+    /**
+     * Adds |task|, called with |arg|.  New tasks start out pending.  Returns
+     * the id to pass to Schedule(), or kInvalidTask if the registry is full.
+     */
+    int Register(const char* name, Task task, void* arg);
+
+    /**
+     * Marks task |id| pending, so that it runs the next time the keymaster
+     * is idle.
+     */
+    void Schedule(int id);
+
+    /**
+     * Returns true if any task is pending.
+     */
+    bool HasPendingTasks() const;
+
+    /**
+     * Runs one step of the next pending task, in round-robin order.
+     */
+    void RunNext();
+
+private:
+    struct Entry {
+        const char* name;
+        Task task;
+        void* arg;
+        bool pending;
+    };
+
+    Entry tasks_[kMaxTasks];
+    size_t task_count_ = 0;
+    size_t next_task_ = 0;
+};
+
+}  // namespace keymaster
@@ -0,0 +1,129 @@
+/*
+ * Copyright 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "trusty_key_blob_cache.h"
+
+#include <string.h>
+
+#include <new>
+
+#include <keymaster/UniquePtr.h>
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+bool KeyBlobCache::ComputeDigests(const KeymasterKeyBlob& blob,
+                                  const AuthorizationSet& hidden,
+                                  Digest* digest,
+                                  Digest* blob_digest) {
+    size_t hidden_size = hidden.SerializedSize();
+    UniquePtr<uint8_t[]> hidden_buf(new (std::nothrow) uint8_t[hidden_size]);
+    if (!hidden_buf) {
+        return false;
+    }
+    hidden.Serialize(hidden_buf.get(), hidden_buf.get() + hidden_size);
+
+    SHA256(blob.key_material, blob.key_material_size, blob_digest->data());
+
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, blob_digest->data(), blob_digest->size());
+    SHA256_Update(&ctx, hidden_buf.get(), hidden_size);
+    SHA256_Final(digest->data(), &ctx);
+    return true;
+}
+
+bool KeyBlobCache::IsCacheable(const DeserializedKey& key) {
+    return key.key_slot == 0 &&
+           key.encrypted_key.format != AES_GCM_WITH_SECURE_DELETION;
+}
+
+const KeyBlobCache::Entry* KeyBlobCache::Find(const Digest& digest) {
+    for (Entry& entry : entries_) {
+        if (entry.valid && entry.digest == digest) {
+            entry.last_used = ++use_counter_;
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+void KeyBlobCache::Insert(const Digest& digest,
+                          const Digest& blob_digest,
+                          const KeymasterKeyBlob& key_material,
+                          const AuthorizationSet& hw_enforced,
+                          const AuthorizationSet& sw_enforced) {
+    Entry* victim = &entries_[0];
+    for (Entry& entry : entries_) {
+        if (entry.valid && entry.digest == digest) {
+            victim = &entry;
+            break;
+        }
+        if (!entry.valid ||
+            (victim->valid && entry.last_used < victim->last_used)) {
+            victim = &entry;
+        }
+    }
+    Evict(victim);
+
+    if (!victim->key_material.Reset(key_material.key_material_size) ||
+        !victim->hw_enforced.Reinitialize(hw_enforced) ||
+        !victim->sw_enforced.Reinitialize(sw_enforced)) {
+        LOG_E("Could not allocate memory for key blob cache entry", 0);
+        Evict(victim);
+        return;
+    }
+    memcpy(victim->key_material.writable_data(), key_material.key_material,
+           key_material.key_material_size);
+
+    victim->digest = digest;
+    victim->blob_digest = blob_digest;
+    victim->last_used = ++use_counter_;
+    victim->valid = true;
+}
+
+void KeyBlobCache::Remove(const Digest& digest) {
+    for (Entry& entry : entries_) {
+        if (entry.valid && entry.digest == digest) {
+            Evict(&entry);
+        }
+    }
+}
+
+void KeyBlobCache::Invalidate(const KeymasterKeyBlob& blob) {
+    Digest blob_digest;
+    SHA256(blob.key_material, blob.key_material_size, blob_digest.data());
+    for (Entry& entry : entries_) {
+        if (entry.valid && entry.blob_digest == blob_digest) {
+            Evict(&entry);
+        }
+    }
+}
+
+void KeyBlobCache::Clear() {
+    for (Entry& entry : entries_) {
+        Evict(&entry);
+    }
+}
+
+void KeyBlobCache::Evict(Entry* entry) {
+    entry->valid = false;
+    entry->key_material.Clear();
+    entry->hw_enforced.Clear();
+    entry->sw_enforced.Clear();
+}
+
+}  // namespace keymaster
@@ -0,0 +1,120 @@
+/*
+ * Copyright 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/key_blob_utils/auth_encrypted_key_blob.h>
+#include <openssl/sha.h>
+
+namespace keymaster {
+
+/**
+ * KeyBlobCache holds the decrypted contents of recently parsed key blobs, so
+ * that using the same key again doesn't have to derive the master key, look
+ * up secure deletion data and decrypt the blob.
+ *
+ * Entries are looked up by a digest of the blob and the hidden authorizations
+ * it was decrypted with, so a blob presented with the wrong application ID or
+ * data, or under a different root of trust, never hits.  The least recently
+ * used entry is evicted when the cache is full.  Key material is wiped when an
+ * entry is evicted or invalidated.
+ */
+class KeyBlobCache {
+public:
+    static constexpr size_t kCapacity = 8;
+
+    using Digest = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
+
+    struct Entry {
+        Digest digest;
+        Digest blob_digest;
+        uint64_t last_used = 0;
+        bool valid = false;
+
+        KeymasterKeyBlob key_material;
+        AuthorizationSet hw_enforced;
+        AuthorizationSet sw_enforced;
+    };
+
+    KeyBlobCache() = default;
+    KeyBlobCache(const KeyBlobCache&) = delete;
+    KeyBlobCache& operator=(const KeyBlobCache&) = delete;
+
+    /**
+     * Computes the digest of |blob| alone, used to invalidate entries, and
+     * the digest of |blob| and |hidden|, used to look entries up.
+     */
+    static bool ComputeDigests(const KeymasterKeyBlob& blob,
+                               const AuthorizationSet& hidden,
+                               Digest* digest,
+                               Digest* blob_digest);
+
+    /**
+     * Returns true if |key| may be cached.  Keys with a secure deletion slot,
+     * or in the secure deletion format, may not: their slot can be erased
+     * through secure_deletion_secret_storage() (e.g. when a single-use key is
+     * used up) without going through DeleteKey, and a hit skips reading the
+     * slot, so such a key would stay usable.
+     */
+    static bool IsCacheable(const DeserializedKey& key);
+
+    /**
+     * Returns the entry for |digest| and marks it most recently used, or
+     * returns NULL if there is none.
+     */
+    const Entry* Find(const Digest& digest);
+
+    /**
+     * Adds a copy of the decrypted key to the cache, evicting the least
+     * recently used entry if needed.
+     */
+    void Insert(const Digest& digest,
+                const Digest& blob_digest,
+                const KeymasterKeyBlob& key_material,
+                const AuthorizationSet& hw_enforced,
+                const AuthorizationSet& sw_enforced);
+
+    /**
+     * Drops the entry for |digest|, if any.
+     */
+    void Remove(const Digest& digest);
+
+    /**
+     * Drops all entries for |blob|, whichever hidden authorizations they were
+     * decrypted with.
+     */
+    void Invalidate(const KeymasterKeyBlob& blob);
+
+    /**
+     * Drops all entries.
+     */
+    void Clear();
+
+private:
+    static void Evict(Entry* entry);
+
+    Entry entries_[kCapacity];
+    uint64_t use_counter_ = 0;
+};
+
+}  // namespace keymaster
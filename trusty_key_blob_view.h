@@ -0,0 +1,62 @@
+/*
+ * Copyright 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <keymaster/android_keymaster_utils.h>
+
+namespace keymaster {
+
+/**
+ * KeymasterKeyBlobView presents a range of an existing buffer as a
+ * KeymasterKeyBlob without copying it, so a prefix can be skipped before
+ * handing a blob to parsers that only read it.
+ *
+ * The view doesn't own the data and must not outlive it.  The blob returned by
+ * blob() must not be reset or moved from.
+ */
+class KeymasterKeyBlobView {
+public:
+    KeymasterKeyBlobView(const uint8_t* data, size_t size) {
+        blob_.key_material = data;
+        blob_.key_material_size = size;
+    }
+    explicit KeymasterKeyBlobView(const KeymasterKeyBlob& blob)
+            : KeymasterKeyBlobView(blob.key_material, blob.key_material_size) {}
+
+    ~KeymasterKeyBlobView() {
+        // Detach the data so that ~KeymasterKeyBlob doesn't wipe and free it.
+        blob_.key_material = nullptr;
+        blob_.key_material_size = 0;
+    }
+
+    KeymasterKeyBlobView(const KeymasterKeyBlobView&) = delete;
+    KeymasterKeyBlobView& operator=(const KeymasterKeyBlobView&) = delete;
+
+    const uint8_t* begin() const { return blob_.begin(); }
+    const uint8_t* end() const { return blob_.end(); }
+    size_t size() const { return blob_.key_material_size; }
+
+    const KeymasterKeyBlob& blob() const { return blob_; }
+
+private:
+    KeymasterKeyBlob blob_;
+};
+
+}  // namespace keymaster
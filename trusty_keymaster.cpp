@@ -20,6 +20,7 @@
 #include <lib/keybox/client/keybox.h>
 #include <uapi/err.h>
 
+#include <algorithm>
 #include <memory>
 
 #ifndef DISABLE_ATAP_SUPPORT
@@ -31,6 +32,9 @@ const size_t kMaxCaResponseSize = 20000;
 
 namespace keymaster {
 
+// Input in shared memory is passed to the operation in chunks of this size.
+static const size_t kSharedMemoryChunkSize = 4096;
+
 GetVersion2Response TrustyKeymaster::GetVersion2(
         const GetVersion2Request& req) {
     switch (req.max_message_version) {
@@ -51,6 +55,258 @@ GetVersion2Response TrustyKeymaster::GetVersion2(
     return AndroidKeymaster::GetVersion2(req);
 }
 
+static bool append_output(const Buffer& src, Buffer* dst) {
+    if (!src.available_read()) {
+        return true;
+    }
+    return dst->reserve(src.available_read()) &&
+           dst->write(src.peek_read(), src.available_read());
+}
+
+keymaster_error_t TrustyKeymaster::UpdateWithInput(
+        uint64_t op_handle,
+        const AuthorizationSet* params,
+        const uint8_t* input,
+        size_t input_size,
+        Buffer* output,
+        AuthorizationSet* output_params) {
+    size_t consumed = 0;
+    // UpdateOperation may not consume all of its input, so keep feeding it
+    // the remainder.
+    do {
+        UpdateOperationRequest update_request(message_version());
+        update_request.op_handle = op_handle;
+        if (params && consumed == 0) {
+            update_request.additional_params.Reinitialize(*params);
+        }
+        if (!update_request.input.Reinitialize(input + consumed,
+                                               input_size - consumed)) {
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        }
+
+        UpdateOperationResponse update_response(message_version());
+        UpdateOperation(update_request, &update_response);
+        if (update_response.error != KM_ERROR_OK) {
+            return update_response.error;
+        }
+        if (!append_output(update_response.output, output)) {
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        }
+        output_params->Reinitialize(update_response.output_params);
+
+        if (update_response.input_consumed == 0 && consumed < input_size) {
+            LOG_E("Update consumed no input", 0);
+            return KM_ERROR_INVALID_INPUT_LENGTH;
+        }
+        consumed += update_response.input_consumed;
+    } while (consumed < input_size);
+
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t TrustyKeymaster::FinishWithInput(
+        uint64_t op_handle,
+        const AuthorizationSet& params,
+        const uint8_t* input,
+        size_t input_size,
+        const Buffer& signature,
+        Buffer* output,
+        AuthorizationSet* output_params) {
+    FinishOperationRequest finish_request(message_version());
+    finish_request.op_handle = op_handle;
+    finish_request.additional_params.Reinitialize(params);
+    if (!finish_request.input.Reinitialize(input, input_size) ||
+        !finish_request.signature.Reinitialize(signature)) {
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+
+    FinishOperationResponse finish_response(message_version());
+    FinishOperation(finish_request, &finish_response);
+    if (finish_response.error != KM_ERROR_OK) {
+        return finish_response.error;
+    }
+    if (!append_output(finish_response.output, output)) {
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    output_params->Reinitialize(finish_response.output_params);
+    return KM_ERROR_OK;
+}
+
+void TrustyKeymaster::AbortAfterError(uint64_t op_handle) {
+    // Failed updates and finishes have already released the operation, in
+    // which case this is a no-op.
+    AbortOperationRequest abort_request(message_version());
+    abort_request.op_handle = op_handle;
+    AbortOperationResponse abort_response(message_version());
+    AbortOperation(abort_request, &abort_response);
+}
+
+void TrustyKeymaster::UpdateOperationBatch(
+        const UpdateOperationBatchRequest& request,
+        UpdateOperationBatchResponse* response) {
+    if (response == nullptr)
+        return;
+
+    response->error = KM_ERROR_OK;
+    for (uint32_t i = 0; i < request.chunk_count; ++i) {
+        const Buffer& chunk = request.chunks[i];
+        const AuthorizationSet* params =
+                i == 0 ? &request.additional_params : nullptr;
+        response->error = UpdateWithInput(
+                request.op_handle, params, chunk.peek_read(),
+                chunk.available_read(), &response->output,
+                &response->output_params);
+        if (response->error != KM_ERROR_OK) {
+            AbortAfterError(request.op_handle);
+            return;
+        }
+    }
+
+    if (request.finish) {
+        response->error = FinishWithInput(
+                request.op_handle, request.finish_params, nullptr, 0,
+                request.signature, &response->output, &response->output_params);
+        if (response->error != KM_ERROR_OK) {
+            AbortAfterError(request.op_handle);
+        }
+    }
+}
+
+void TrustyKeymaster::GenerateRkpKeyBatch(
+        const GenerateRkpKeyBatchRequest& request,
+        GenerateRkpKeyBatchResponse* response) {
+    if (response == nullptr)
+        return;
+
+    if (!response->Allocate(request.key_count)) {
+        response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return;
+    }
+
+    GenerateRkpKeyRequest key_request(message_version());
+    key_request.test_mode = request.test_mode;
+    response->error = KM_ERROR_OK;
+    for (uint32_t i = 0; i < request.key_count; ++i) {
+        GenerateRkpKeyResponse key_response(message_version());
+        GenerateRkpKey(key_request, &key_response);
+        if (key_response.error != KM_ERROR_OK) {
+            response->error = key_response.error;
+            response->Allocate(0);
+            return;
+        }
+        if (!response->key_blobs[i].Reinitialize(
+                    key_response.key_blob.key_material,
+                    key_response.key_blob.key_material_size) ||
+            !response->maced_public_keys[i].Reinitialize(
+                    key_response.maced_public_key.data,
+                    key_response.maced_public_key.data_length)) {
+            response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+            response->Allocate(0);
+            return;
+        }
+    }
+}
+
+void TrustyKeymaster::DeleteKeys(const DeleteKeysRequest& request,
+                                 DeleteKeysResponse* response) {
+    if (response == nullptr)
+        return;
+
+    response->error =
+            context_->DeleteKeys(request.key_blobs.get(), request.key_count);
+}
+
+void TrustyKeymaster::SharedMemoryOperation(
+        const SharedMemoryOperationRequest& request,
+        SharedMemoryOperationResponse* response) {
+    if (response == nullptr)
+        return;
+
+    if (request.finish) {
+        response->error = FinishWithInput(
+                request.op_handle, request.additional_params,
+                request.input.peek_read(), request.input.available_read(),
+                request.signature, &response->output, &response->output_params);
+    } else {
+        response->error = UpdateWithInput(
+                request.op_handle, &request.additional_params,
+                request.input.peek_read(), request.input.available_read(),
+                &response->output, &response->output_params);
+    }
+    if (response->error != KM_ERROR_OK) {
+        AbortAfterError(request.op_handle);
+    }
+}
+
+static bool copy_shared_output(const Buffer& src,
+                               uint8_t* dst,
+                               uint32_t capacity,
+                               uint32_t* size) {
+    size_t len = src.available_read();
+    if (len > capacity - *size) {
+        LOG_E("Shared memory output buffer too small", 0);
+        return false;
+    }
+    memcpy(dst + *size, src.peek_read(), len);
+    *size += len;
+    return true;
+}
+
+void TrustyKeymaster::ProcessSharedMemoryOperation(
+        const SharedMemoryOperationRequest& request,
+        const uint8_t* input,
+        uint8_t* output,
+        SharedMemoryOperationResponse* response) {
+    response->error = KM_ERROR_OK;
+    response->shared_output_size = 0;
+
+    // The input is fed to the operation in chunks and each chunk's output is
+    // copied out right away, so memory use doesn't grow with the buffer size.
+    // |additional_params| go with the first call only.
+    size_t offset = 0;
+    while (offset < request.input_size || (offset == 0 && !request.finish)) {
+        size_t chunk_size = std::min(kSharedMemoryChunkSize,
+                                     request.input_size - offset);
+        Buffer chunk_output;
+        response->error = UpdateWithInput(
+                request.op_handle,
+                offset == 0 ? &request.additional_params : nullptr,
+                input + offset, chunk_size, &chunk_output,
+                &response->output_params);
+        if (response->error == KM_ERROR_OK &&
+            !copy_shared_output(chunk_output, output, request.output_capacity,
+                                &response->shared_output_size)) {
+            response->error = KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+        }
+        if (response->error != KM_ERROR_OK) {
+            AbortAfterError(request.op_handle);
+            return;
+        }
+        offset += chunk_size;
+        if (chunk_size == 0) {
+            break;
+        }
+    }
+
+    if (request.finish) {
+        AuthorizationSet no_params;
+        Buffer finish_output;
+        response->error = FinishWithInput(
+                request.op_handle,
+                request.input_size ? no_params : request.additional_params,
+                nullptr, 0, request.signature, &finish_output,
+                &response->output_params);
+        if (response->error == KM_ERROR_OK &&
+            !copy_shared_output(finish_output, output, request.output_capacity,
+                                &response->shared_output_size)) {
+            response->error = KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+        }
+        if (response->error != KM_ERROR_OK) {
+            AbortAfterError(request.op_handle);
+        }
+    }
+}
+
 long TrustyKeymaster::GetAuthTokenKey(keymaster_key_blob_t* key) {
     keymaster_error_t error = context_->GetAuthTokenKey(key);
     if (error != KM_ERROR_OK)
@@ -392,4 +648,95 @@ void TrustyKeymaster::AtapSetProductId(const AtapSetProductIdRequest& request,
     response->error = ss_manager->SetProductId(product_id.begin());
 #endif
 }
+
+static keymaster_error_t stage_provisioned_key(
+        SecureStorageManager* ss_manager,
+        const ProvisionedAttestationKey& key) {
+    AttestationKeySlot key_slot =
+            keymaster_algorithm_to_key_slot(key.algorithm);
+    keymaster_error_t err = ss_manager->WriteKeyToStorage(
+            key_slot, key.key_data.begin(), key.key_data.buffer_size(), false);
+    if (err != KM_ERROR_OK) {
+        LOG_E("Failed to write attestation key: %d\n", err);
+        return err;
+    }
+    err = ss_manager->DeleteCertChainFromStorage(key_slot, false);
+    if (err != KM_ERROR_OK) {
+        LOG_E("Failed to delete cert chain: %d\n", err);
+        return err;
+    }
+    for (uint32_t i = 0; i < key.cert_count; i++) {
+        err = ss_manager->WriteCertToStorage(key_slot, key.certs[i].begin(),
+                                             key.certs[i].buffer_size(), i,
+                                             false);
+        if (err != KM_ERROR_OK) {
+            LOG_E("Failed to write cert %d: %d\n", i, err);
+            return err;
+        }
+    }
+    return KM_ERROR_OK;
+}
+
+void TrustyKeymaster::ProvisionAttestationBatch(
+        const ProvisionAttestationBatchRequest& request,
+        ProvisionAttestationBatchResponse* response) {
+    if (response == nullptr)
+        return;
+
+    // Check the whole request before staging anything.
+    for (uint32_t i = 0; i < request.key_count; i++) {
+        const ProvisionedAttestationKey& key = request.keys[i];
+        if (keymaster_algorithm_to_key_slot(key.algorithm) ==
+            AttestationKeySlot::kInvalid) {
+            response->error = KM_ERROR_UNSUPPORTED_ALGORITHM;
+            return;
+        }
+        if (key.key_data.buffer_size() == 0) {
+            response->error = KM_ERROR_INVALID_INPUT_LENGTH;
+            return;
+        }
+        for (uint32_t j = 0; j < key.cert_count; j++) {
+            if (key.certs[j].buffer_size() == 0) {
+                response->error = KM_ERROR_INVALID_INPUT_LENGTH;
+                return;
+            }
+        }
+    }
+    const Buffer& product_id = request.product_id;
+    if (product_id.available_read()) {
+#ifdef DISABLE_ATAP_SUPPORT
+        // Not implemented.
+        response->error = KM_ERROR_UNKNOWN_ERROR;
+        return;
+#else
+        if (product_id.available_read() != kProductIdSize) {
+            response->error = KM_ERROR_INVALID_INPUT_LENGTH;
+            return;
+        }
+#endif
+    }
+
+    SecureStorageManager* ss_manager = SecureStorageManager::get_instance();
+    if (ss_manager == nullptr) {
+        response->error = KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+        return;
+    }
+
+    keymaster_error_t err = KM_ERROR_OK;
+    for (uint32_t i = 0; i < request.key_count && err == KM_ERROR_OK; i++) {
+        err = stage_provisioned_key(ss_manager, request.keys[i]);
+    }
+    if (err == KM_ERROR_OK && request.set_attestation_ids) {
+        err = ss_manager->SetAttestationIds(request.attestation_ids, false);
+    }
+    if (err == KM_ERROR_OK && product_id.available_read()) {
+        err = ss_manager->SetProductId(product_id.begin(), false);
+    }
+    if (err != KM_ERROR_OK) {
+        ss_manager->EndTransaction(false);
+        response->error = err;
+        return;
+    }
+    response->error = ss_manager->EndTransaction(true);
+}
 }  // namespace keymaster
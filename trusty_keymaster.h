@@ -45,6 +45,39 @@ public:
     // that's okay because it's only called non-polymorphically.
     GetVersion2Response GetVersion2(const GetVersion2Request& req);
 
+    // UpdateOperationBatch feeds each chunk of |request| to UpdateOperation
+    // and then, if requested, calls FinishOperation, returning all the output
+    // in one response. The operation is aborted if any step fails.
+    void UpdateOperationBatch(const UpdateOperationBatchRequest& request,
+                              UpdateOperationBatchResponse* response);
+
+    // GenerateRkpKeyBatch generates |request.key_count| remote provisioning
+    // keys, as GenerateRkpKey does, and returns them all in one response.
+    // The public keys are all MACed with the same cached key.
+    void GenerateRkpKeyBatch(const GenerateRkpKeyBatchRequest& request,
+                             GenerateRkpKeyBatchResponse* response);
+
+    // DeleteKeys deletes all the keys in |request|, as DeleteKey does for one
+    // key, committing the deletion of their secrets to storage only once.
+    void DeleteKeys(const DeleteKeysRequest& request,
+                    DeleteKeysResponse* response);
+
+    // SharedMemoryOperation runs an update, or a finish if requested, on the
+    // input carried inline in |request|. It is the fallback used when no
+    // shared memory buffer is attached to the request.
+    void SharedMemoryOperation(const SharedMemoryOperationRequest& request,
+                               SharedMemoryOperationResponse* response);
+
+    // ProcessSharedMemoryOperation is SharedMemoryOperation for a request
+    // with a shared memory buffer attached. |input| and |output| point at the
+    // input and output regions of the mapped buffer, whose bounds the IPC
+    // layer has already checked.
+    void ProcessSharedMemoryOperation(
+            const SharedMemoryOperationRequest& request,
+            const uint8_t* input,
+            uint8_t* output,
+            SharedMemoryOperationResponse* response);
+
     // The GetAuthTokenKey IPC call is accepted only from Gatekeeper.
     long GetAuthTokenKey(keymaster_key_blob_t* key);
 
@@ -114,6 +147,33 @@ public:
     void AtapSetProductId(const AtapSetProductIdRequest& request,
                           AtapSetProductIdResponse* response);
 
+    // ProvisionAttestationBatch stores attestation keys, their certificate
+    // chains, the attestation IDs and the product id in a single secure
+    // storage transaction. It replaces the separate provisioning calls above
+    // with one commit, and either everything in the request is stored or
+    // nothing is.
+    void ProvisionAttestationBatch(
+            const ProvisionAttestationBatchRequest& request,
+            ProvisionAttestationBatchResponse* response);
+
+    // Registers the work to run between requests, off the request path.
+    void RegisterIdleTasks(IdleScheduler* scheduler) {
+        context_->RegisterIdleTasks(scheduler);
+    }
+
+    // Wipes the cached keys derived from the hardware-bound key, e.g. before
+    // the keymaster exits.
+    void InvalidateDerivedKeys() { context_->InvalidateDerivedKeys(); }
+
+    // Sets the function that filling the RSA keypair pool calls at
+    // checkpoints.
+    // The handler may only serve requests that don't reenter the operation,
+    // such as KM_GET_AUTH_TOKEN_KEY.
+    void SetCheckpointHandler(TrustyRsaKeyFactory::CheckpointHandler handler,
+                              void* arg) {
+        context_->SetCheckpointHandler(handler, arg);
+    }
+
     bool ConfigureCalled() {
         return configure_error_ != KM_ERROR_KEYMASTER_NOT_CONFIGURED;
     }
@@ -121,6 +181,28 @@ public:
     void set_configure_error(keymaster_error_t err) { configure_error_ = err; }
 
 private:
+    // Feeds |input| to the operation, calling UpdateOperation until all of it
+    // has been consumed, and appends the output to |output|. |params| are
+    // passed with the first update only.
+    keymaster_error_t UpdateWithInput(uint64_t op_handle,
+                                      const AuthorizationSet* params,
+                                      const uint8_t* input,
+                                      size_t input_size,
+                                      Buffer* output,
+                                      AuthorizationSet* output_params);
+
+    // Finishes the operation with |input| and appends the output to |output|.
+    keymaster_error_t FinishWithInput(uint64_t op_handle,
+                                      const AuthorizationSet& params,
+                                      const uint8_t* input,
+                                      size_t input_size,
+                                      const Buffer& signature,
+                                      Buffer* output,
+                                      AuthorizationSet* output_params);
+
+    // Makes sure the operation is released after a failed multi-step call.
+    void AbortAfterError(uint64_t op_handle);
+
     TrustyKeymasterContext* context_;
     keymaster_error_t configure_error_ = KM_ERROR_KEYMASTER_NOT_CONFIGURED;
     Buffer ca_response_;
@@ -17,6 +17,7 @@
 #include "trusty_keymaster_context.h"
 
 #include <array>
+#include <new>
 
 #include <keymaster/android_keymaster_utils.h>
 #include <keymaster/contexts/soft_attestation_cert.h>
@@ -41,6 +42,7 @@
 
 #include "secure_storage_manager.h"
 #include "trusty_aes_key.h"
+#include "trusty_keymaster_metrics.h"
 
 constexpr bool kUseSecureDeletion = true;
 uint8_t allZerosOrHashOfVerifiedBootKey[32] = {};
@@ -100,10 +102,11 @@ TrustyKeymasterContext::TrustyKeymasterContext()
           enforcement_policy_(this),
           secure_deletion_secret_storage_(*this /* random_source */),
           rng_initialized_(false),
-          calls_since_reseed_(0) {
+          calls_since_reseed_(0),
+          master_key_(kMasterKeyDerivationData, kAesKeySize) {
     LOG_D("Creating TrustyKeymaster", 0);
-    rsa_factory_.reset(
-            new RsaKeyFactory(*this /* blob_maker */, *this /* context */));
+    rsa_factory_.reset(new TrustyRsaKeyFactory(*this /* blob_maker */,
+                                               *this /* context */));
     tdes_factory_.reset(new TripleDesKeyFactory(*this /* blob_maker */,
                                                 *this /* random_source */));
     ec_factory_.reset(
@@ -435,6 +438,10 @@ keymaster_error_t TrustyKeymasterContext::CreateKeyBlob(
         KeymasterKeyBlob* blob,
         AuthorizationSet* hw_enforced,
         AuthorizationSet* sw_enforced) const {
+    // Every new key blob draws a nonce and possibly a secure deletion secret
+    // from the RNG, so this is where the periodic reseed happens.
+    SeedRngIfNeeded();
+
     bool request_rollback_resistance =
             key_description.Contains(TAG_ROLLBACK_RESISTANCE);
     bool request_usage_limit =
@@ -445,6 +452,7 @@ keymaster_error_t TrustyKeymasterContext::CreateKeyBlob(
     LOG_D("Getting secure deletion data", 0);
     std::optional<SecureDeletionData> sdd;
     if (kUseSecureDeletion) {
+        ScopedPhaseTimer timer(MetricsPhase::kSecureStorage);
         sdd = secure_deletion_secret_storage_.CreateDataForNewKey(
                 request_secure_deletion,
                 /* is_upgrade */ false);
@@ -549,6 +557,7 @@ keymaster_error_t TrustyKeymasterContext::UpgradeKeyBlob(
 
     std::optional<SecureDeletionData> sdd;
     if (kUseSecureDeletion) {
+        ScopedPhaseTimer timer(MetricsPhase::kSecureStorage);
         sdd = secure_deletion_secret_storage_.CreateDataForNewKey(
                 has_secure_deletion, true /* is_upgrade */);
     }
@@ -566,6 +575,8 @@ keymaster_error_t TrustyKeymasterContext::UpgradeKeyBlob(
         return error;
     }
 
+    // Keystore replaces the old blob with the upgraded one, so stop caching it.
+    key_blob_cache_.Invalidate(key_to_upgrade);
     key_slot_cleanup.release();
     return KM_ERROR_OK;
 }
@@ -576,7 +587,7 @@ constexpr size_t kKeystoreKeyTypeOffset = kKeystoreKeyBlobMagic.size();
 constexpr size_t kKeystoreKeyBlobPrefixSize = kKeystoreKeyTypeOffset + 1;
 
 KmErrorOr<DeserializedKey> TrustyKeymasterContext::DeserializeKmCompatKeyBlob(
-        const KeymasterKeyBlob& blob) const {
+        const KeymasterKeyBlobView& blob) const {
     // This blob has a keystore km_compat prefix.  This means that it was
     // created by keystore calling TrustyKeymaster through the km_compat layer.
     // The km_compat layer adds this prefix to determine whether it's actually a
@@ -594,11 +605,12 @@ KmErrorOr<DeserializedKey> TrustyKeymasterContext::DeserializeKmCompatKeyBlob(
     // intact.
     auto keyType = *(blob.begin() + kKeystoreKeyTypeOffset);
     switch (keyType) {
-    case 0:
-        // This is a hardware blob. Strip the prefix and use the blob.
-        return DeserializeAuthEncryptedBlob(
-                KeymasterKeyBlob(blob.begin() + kKeystoreKeyBlobPrefixSize,
-                                 blob.size() - kKeystoreKeyBlobPrefixSize));
+    case 0: {
+        // This is a hardware blob. Strip the prefix and use the blob in place.
+        KeymasterKeyBlobView stripped(blob.begin() + kKeystoreKeyBlobPrefixSize,
+                                      blob.size() - kKeystoreKeyBlobPrefixSize);
+        return DeserializeAuthEncryptedBlob(stripped.blob());
+    }
 
     case 1:
         LOG_E("Software key blobs are not supported.", 0);
@@ -610,18 +622,18 @@ KmErrorOr<DeserializedKey> TrustyKeymasterContext::DeserializeKmCompatKeyBlob(
     }
 }
 
-bool is_km_compat_blob(const KeymasterKeyBlob& blob) {
+bool is_km_compat_blob(const KeymasterKeyBlobView& blob) {
     return blob.size() >= kKeystoreKeyBlobPrefixSize &&
            std::equal(kKeystoreKeyBlobMagic.begin(),
                       kKeystoreKeyBlobMagic.end(), blob.begin());
 }
 
 KmErrorOr<DeserializedKey> TrustyKeymasterContext::DeserializeKeyBlob(
-        const KeymasterKeyBlob& blob) const {
+        const KeymasterKeyBlobView& blob) const {
     if (is_km_compat_blob(blob)) {
         return DeserializeKmCompatKeyBlob(blob);
     } else {
-        return DeserializeAuthEncryptedBlob(blob);
+        return DeserializeAuthEncryptedBlob(blob.blob());
     }
 }
 
@@ -635,7 +647,26 @@ keymaster_error_t TrustyKeymasterContext::ParseKeyBlob(
         return KM_ERROR_UNEXPECTED_NULL_POINTER;
     }
 
-    KmErrorOr<DeserializedKey> deserialized_key = DeserializeKeyBlob(blob);
+    AuthorizationSet hidden;
+    error = BuildHiddenAuthorizations(additional_params, &hidden);
+    if (error != KM_ERROR_OK) {
+        return error;
+    }
+
+    KeyBlobCache::Digest cache_digest;
+    KeyBlobCache::Digest blob_digest;
+    bool cacheable = KeyBlobCache::ComputeDigests(blob, hidden, &cache_digest,
+                                                  &blob_digest);
+    if (cacheable) {
+        const KeyBlobCache::Entry* entry = key_blob_cache_.Find(cache_digest);
+        if (entry) {
+            LOG_D("Key blob cache hit", 0);
+            return LoadCachedKey(*entry, additional_params, key);
+        }
+    }
+
+    KmErrorOr<DeserializedKey> deserialized_key =
+            DeserializeKeyBlob(KeymasterKeyBlobView(blob));
     if (!deserialized_key) {
         return deserialized_key.error();
     }
@@ -648,24 +679,23 @@ keymaster_error_t TrustyKeymasterContext::ParseKeyBlob(
         return error;
     }
 
-    AuthorizationSet hidden;
-    error = BuildHiddenAuthorizations(additional_params, &hidden);
-    if (error != KM_ERROR_OK) {
-        return error;
-    }
-
     SecureDeletionData sdd;
     if (deserialized_key->encrypted_key.format ==
         AES_GCM_WITH_SECURE_DELETION) {
         // This key requires secure deletion data.
+        ScopedPhaseTimer timer(MetricsPhase::kSecureStorage);
         sdd = secure_deletion_secret_storage_.GetDataForKey(
                 deserialized_key->key_slot);
     }
 
     LOG_D("Decrypting blob with format: %d",
           deserialized_key->encrypted_key.format);
+    uint64_t decrypt_start_us = KeymasterMetrics::NowUs();
     KmErrorOr<KeymasterKeyBlob> key_material =
             DecryptKey(*deserialized_key, hidden, sdd, master_key);
+    KeymasterMetrics::get_instance()->RecordPhase(
+            MetricsPhase::kDecryptKey,
+            KeymasterMetrics::NowUs() - decrypt_start_us);
     if (!key_material) {
         return key_material.error();
     }
@@ -675,31 +705,100 @@ keymaster_error_t TrustyKeymasterContext::ParseKeyBlob(
         return KM_ERROR_INVALID_KEY_BLOB;
     }
 
+    cacheable = cacheable && KeyBlobCache::IsCacheable(*deserialized_key);
+    if (cacheable) {
+        key_blob_cache_.Insert(cache_digest, blob_digest, *key_material,
+                               deserialized_key->hw_enforced,
+                               deserialized_key->sw_enforced);
+    }
+
     auto factory = GetKeyFactory(algorithm);
-    error = factory->LoadKey(std::move(*key_material), additional_params,
-                             std::move(deserialized_key->hw_enforced),
-                             std::move(deserialized_key->sw_enforced), key);
+    {
+        ScopedPhaseTimer timer(MetricsPhase::kLoadKey);
+        error = factory->LoadKey(std::move(*key_material), additional_params,
+                                 std::move(deserialized_key->hw_enforced),
+                                 std::move(deserialized_key->sw_enforced),
+                                 key);
+    }
     if (key && key->get()) {
         (*key)->set_secure_deletion_slot(deserialized_key->key_slot);
     }
+    if (error != KM_ERROR_OK && cacheable) {
+        key_blob_cache_.Remove(cache_digest);
+    }
 
     return error;
 }
 
+keymaster_error_t TrustyKeymasterContext::LoadCachedKey(
+        const KeyBlobCache::Entry& entry,
+        const AuthorizationSet& additional_params,
+        UniquePtr<Key>* key) const {
+    keymaster_algorithm_t algorithm;
+    if (!entry.hw_enforced.GetTagValue(TAG_ALGORITHM, &algorithm)) {
+        return KM_ERROR_INVALID_KEY_BLOB;
+    }
+
+    KeymasterKeyBlob key_material(entry.key_material.key_material,
+                                  entry.key_material.key_material_size);
+    AuthorizationSet hw_enforced(entry.hw_enforced);
+    AuthorizationSet sw_enforced(entry.sw_enforced);
+    if (!key_material.key_material ||
+        hw_enforced.is_valid() != AuthorizationSet::OK ||
+        sw_enforced.is_valid() != AuthorizationSet::OK) {
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+
+    auto factory = GetKeyFactory(algorithm);
+    ScopedPhaseTimer timer(MetricsPhase::kLoadKey);
+    return factory->LoadKey(std::move(key_material), additional_params,
+                            std::move(hw_enforced), std::move(sw_enforced),
+                            key);
+}
+
 keymaster_error_t TrustyKeymasterContext::DeleteKey(
         const KeymasterKeyBlob& blob) const {
-    KmErrorOr<DeserializedKey> deserialized_key = DeserializeKeyBlob(blob);
+    KmErrorOr<DeserializedKey> deserialized_key =
+            DeserializeKeyBlob(KeymasterKeyBlobView(blob));
     if (deserialized_key) {
         LOG_D("Deserialized blob with format: %d",
               deserialized_key->encrypted_key.format);
         secure_deletion_secret_storage_.DeleteKey(deserialized_key->key_slot);
+        ScheduleShrinkSecretsFile();
+    }
+    key_blob_cache_.Invalidate(blob);
+
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t TrustyKeymasterContext::DeleteKeys(const Buffer* key_blobs,
+                                                     size_t count) const {
+    UniquePtr<uint32_t[]> key_slots(new (std::nothrow) uint32_t[count]);
+    if (count && !key_slots) {
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+
+    size_t slot_count = 0;
+    for (size_t i = 0; i < count; ++i) {
+        KeymasterKeyBlobView blob(key_blobs[i].begin(),
+                                  key_blobs[i].available_read());
+        KmErrorOr<DeserializedKey> deserialized_key = DeserializeKeyBlob(blob);
+        if (deserialized_key) {
+            key_slots[slot_count++] = deserialized_key->key_slot;
+        }
+        key_blob_cache_.Invalidate(blob.blob());
     }
+    secure_deletion_secret_storage_.DeleteKeys(key_slots.get(), slot_count);
+    ScheduleShrinkSecretsFile();
 
     return KM_ERROR_OK;
 }
 
 keymaster_error_t TrustyKeymasterContext::DeleteAllKeys() const {
+    key_blob_cache_.Clear();
+    rsa_factory_->ClearPool();
     secure_deletion_secret_storage_.DeleteAllKeys();
+    InvalidateDerivedKeys();
     return KM_ERROR_OK;
 }
 
@@ -730,19 +829,65 @@ bool TrustyKeymasterContext::ShouldReseedRng() const {
 }
 
 bool TrustyKeymasterContext::ReseedRng() {
-    UniquePtr<uint8_t[]> rand_seed(new uint8_t[kRngReseedSize]);
-    memset(rand_seed.get(), 0, kRngReseedSize);
-    if (trusty_rng_hw_rand(rand_seed.get(), kRngReseedSize) != 0) {
+    uint8_t rand_seed[kRngReseedSize];
+    // Fall back to reading the HW RNG directly if the pool ran dry.
+    if (!entropy_pool_.Take(rand_seed, kRngReseedSize) &&
+        trusty_rng_hw_rand(rand_seed, kRngReseedSize) != 0) {
         LOG_E("Failed to get bytes from HW RNG", 0);
         return false;
     }
     LOG_I("Reseeding with %d bytes from HW RNG", kRngReseedSize);
-    trusty_rng_add_entropy(rand_seed.get(), kRngReseedSize);
+    trusty_rng_add_entropy(rand_seed, kRngReseedSize);
+    memset_s(rand_seed, 0, kRngReseedSize);
+    if (idle_scheduler_) {
+        idle_scheduler_->Schedule(entropy_pool_task_);
+    }
 
     rng_initialized_ = true;
     return true;
 }
 
+void TrustyKeymasterContext::RegisterIdleTasks(IdleScheduler* scheduler) {
+    idle_scheduler_ = scheduler;
+    entropy_pool_task_ = scheduler->Register("refill entropy pool",
+                                             RefillEntropyPoolTask, this);
+    master_key_task_ =
+            scheduler->Register("derive master key", WarmMasterKeyTask, this);
+    shrink_secrets_task_ = scheduler->Register("shrink secrets file",
+                                               ShrinkSecretsFileTask, this);
+    rsa_factory_->RegisterIdleTasks(scheduler);
+}
+
+bool TrustyKeymasterContext::RefillEntropyPoolTask(void* arg) {
+    auto context = static_cast<TrustyKeymasterContext*>(arg);
+    // On failure, wait for the next reseed to try again rather than retrying
+    // in a loop.
+    context->entropy_pool_.Refill();
+    return false;
+}
+
+bool TrustyKeymasterContext::WarmMasterKeyTask(void* arg) {
+    auto context = static_cast<TrustyKeymasterContext*>(arg);
+    KeymasterKeyBlob master_key;
+    context->master_key_.GetKey(&master_key);
+    return false;
+}
+
+bool TrustyKeymasterContext::ShrinkSecretsFileTask(void* arg) {
+    auto context = static_cast<TrustyKeymasterContext*>(arg);
+    // On failure, wait for the next deletion to try again.
+    if (context->secure_deletion_secret_storage_.ShrinkPending()) {
+        context->secure_deletion_secret_storage_.ShrinkSecretsFile();
+    }
+    return false;
+}
+
+void TrustyKeymasterContext::ScheduleShrinkSecretsFile() const {
+    if (idle_scheduler_ && secure_deletion_secret_storage_.ShrinkPending()) {
+        idle_scheduler_->Schedule(shrink_secrets_task_);
+    }
+}
+
 // Gee wouldn't it be nice if the crypto service headers defined this.
 enum DerivationParams {
     DERIVATION_DATA_PARAM = 0,
@@ -751,32 +896,16 @@ enum DerivationParams {
 
 keymaster_error_t TrustyKeymasterContext::DeriveMasterKey(
         KeymasterKeyBlob* master_key) const {
-    LOG_D("Deriving master key", 0);
-
-    long rc = hwkey_open();
-    if (rc < 0) {
-        return KM_ERROR_UNKNOWN_ERROR;
-    }
-
-    hwkey_session_t session = (hwkey_session_t)rc;
-
-    if (!master_key->Reset(kAesKeySize)) {
-        LOG_S("Could not allocate memory for master key buffer", 0);
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    }
-
-    uint32_t kdf_version = HWKEY_KDF_VERSION_1;
-    rc = hwkey_derive(session, &kdf_version, kMasterKeyDerivationData,
-                      master_key->writable_data(), kAesKeySize);
+    ScopedPhaseTimer timer(MetricsPhase::kDeriveMasterKey);
+    return master_key_.GetKey(master_key);
+}
 
-    if (rc < 0) {
-        LOG_S("Error deriving master key: %d", rc);
-        return KM_ERROR_UNKNOWN_ERROR;
+void TrustyKeymasterContext::InvalidateDerivedKeys() const {
+    master_key_.Invalidate();
+    trusty_remote_provisioning_context_->InvalidateHbk();
+    if (idle_scheduler_) {
+        idle_scheduler_->Schedule(master_key_task_);
     }
-
-    hwkey_close(session);
-    LOG_D("Key derivation complete", 0);
-    return KM_ERROR_OK;
 }
 
 bool TrustyKeymasterContext::InitializeAuthTokenKey() {
@@ -816,6 +945,8 @@ keymaster_error_t TrustyKeymasterContext::SetSystemVersion(
         boot_params_.boot_os_version = os_version;
         boot_params_.boot_os_patchlevel = os_patchlevel;
         version_info_set_ = true;
+        key_blob_cache_.Clear();
+        trusty_remote_provisioning_context_->InvalidateDeviceInfo();
     }
 
 #ifdef KEYMASTER_DEBUG
@@ -883,16 +1014,19 @@ TrustyKeymasterContext::GetVerifiedBootParams(keymaster_error_t* error) const {
 keymaster_error_t TrustyKeymasterContext::VerifyAndCopyDeviceIds(
         const AuthorizationSet& attestation_params,
         AuthorizationSet* values_to_attest) const {
-    SecureStorageManager* ss_manager = SecureStorageManager::get_instance();
-    if (ss_manager == nullptr) {
-        LOG_E("Failed to open secure storage session.", 0);
-        return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
-    }
-
     AttestationIds ids;
-    auto err = ss_manager->ReadAttestationIds(&ids);
-    if (err != KM_ERROR_OK) {
-        return err;
+    {
+        ScopedPhaseTimer timer(MetricsPhase::kSecureStorage);
+        SecureStorageManager* ss_manager = SecureStorageManager::get_instance();
+        if (ss_manager == nullptr) {
+            LOG_E("Failed to open secure storage session.", 0);
+            return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+        }
+
+        auto err = ss_manager->ReadAttestationIds(&ids);
+        if (err != KM_ERROR_OK) {
+            return err;
+        }
     }
 
     bool found_mismatch = false;
@@ -1001,13 +1135,17 @@ KeymasterKeyBlob TrustyKeymasterContext::GetAttestationKey(
         return {};
     }
 
-    SecureStorageManager* ss_manager = SecureStorageManager::get_instance();
-    if (ss_manager == nullptr) {
-        LOG_E("Failed to open secure storage session.", 0);
-        *error = KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
-        return {};
+    KeymasterKeyBlob result;
+    {
+        ScopedPhaseTimer timer(MetricsPhase::kSecureStorage);
+        SecureStorageManager* ss_manager = SecureStorageManager::get_instance();
+        if (ss_manager == nullptr) {
+            LOG_E("Failed to open secure storage session.", 0);
+            *error = KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+            return {};
+        }
+        result = ss_manager->ReadKeyFromStorage(key_slot, error);
     }
-    auto result = ss_manager->ReadKeyFromStorage(key_slot, error);
 #if KEYMASTER_SOFT_ATTESTATION_FALLBACK
     if (*error != KM_ERROR_OK) {
         LOG_I("Failed to read attestation key from RPMB, falling back to test key",
@@ -1042,12 +1180,15 @@ CertificateChain TrustyKeymasterContext::GetAttestationChain(
     }
 
     CertificateChain chain;
-    SecureStorageManager* ss_manager = SecureStorageManager::get_instance();
-    if (ss_manager == nullptr) {
-        LOG_E("Failed to open secure storage session.", 0);
-        *error = KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
-    } else {
-        *error = ss_manager->ReadCertChainFromStorage(key_slot, &chain);
+    {
+        ScopedPhaseTimer timer(MetricsPhase::kSecureStorage);
+        SecureStorageManager* ss_manager = SecureStorageManager::get_instance();
+        if (ss_manager == nullptr) {
+            LOG_E("Failed to open secure storage session.", 0);
+            *error = KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+        } else {
+            *error = ss_manager->ReadCertChainFromStorage(key_slot, &chain);
+        }
     }
 #if KEYMASTER_SOFT_ATTESTATION_FALLBACK
     if ((*error != KM_ERROR_OK) || (chain.entry_count == 0)) {
@@ -1148,6 +1289,10 @@ keymaster_error_t TrustyKeymasterContext::SetBootParams(
 
     trusty_remote_provisioning_context_->SetBootParams(&boot_params_);
 
+    // The root of trust is part of the hidden authorizations, so entries
+    // cached before it was set can never be hit again.
+    key_blob_cache_.Clear();
+
     return KM_ERROR_OK;
 }
 
@@ -26,8 +26,14 @@
 
 #include <keymaster/km_openssl/software_random_source.h>
 
+#include "trusty_entropy_pool.h"
+#include "trusty_hwkey_derived_key.h"
+#include "trusty_idle_scheduler.h"
+#include "trusty_key_blob_cache.h"
+#include "trusty_key_blob_view.h"
 #include "trusty_keymaster_enforcement.h"
 #include "trusty_remote_provisioning_context.h"
+#include "trusty_rsa_key.h"
 #include "trusty_secure_deletion_secret_storage.h"
 
 namespace keymaster {
@@ -89,6 +95,13 @@ public:
                                    UniquePtr<Key>* key) const override;
 
     keymaster_error_t DeleteKey(const KeymasterKeyBlob& blob) const override;
+
+    /**
+     * Deletes the |count| keys in |key_blobs|, as DeleteKey does for one, but
+     * erases all their secure deletion secrets in a single storage
+     * transaction.  Blobs that can't be parsed are skipped.
+     */
+    keymaster_error_t DeleteKeys(const Buffer* key_blobs, size_t count) const;
     keymaster_error_t DeleteAllKeys() const override;
 
     keymaster_error_t AddRngEntropy(const uint8_t* buf,
@@ -96,6 +109,30 @@ public:
 
     keymaster_error_t GetAuthTokenKey(keymaster_key_blob_t* key) const;
 
+    /**
+     * Wipes the cached keys derived from the hardware-bound key.  They are
+     * derived again on next use.  Called by DeleteAllKeys and when the
+     * keymaster shuts down.
+     */
+    void InvalidateDerivedKeys() const;
+
+    /**
+     * Registers the work the context defers until the keymaster is idle:
+     * topping up the pool of hardware RNG output used for reseeds, deriving
+     * the master key ahead of the first request that needs it, and filling
+     * the RSA keypair pool if it is enabled.
+     */
+    void RegisterIdleTasks(IdleScheduler* scheduler);
+
+    /**
+     * Sets the function that filling the RSA keypair pool calls at
+     * checkpoints, so that short requests can be served before it completes.
+     */
+    void SetCheckpointHandler(TrustyRsaKeyFactory::CheckpointHandler handler,
+                              void* arg) {
+        rsa_factory_->SetCheckpointHandler(handler, arg);
+    }
+
     KeymasterEnforcement* enforcement_policy() override {
         return &enforcement_policy_;
     }
@@ -195,6 +232,15 @@ private:
     bool SeedRngIfNeeded() const;
     bool ShouldReseedRng() const;
     bool ReseedRng();
+    static bool RefillEntropyPoolTask(void* arg);
+    static bool WarmMasterKeyTask(void* arg);
+    static bool ShrinkSecretsFileTask(void* arg);
+
+    /**
+     * Schedules a shrink of the secure deletion secrets file if deletions
+     * have emptied its last block.
+     */
+    void ScheduleShrinkSecretsFile() const;
     bool InitializeAuthTokenKey();
     keymaster_error_t SetAuthorizations(const AuthorizationSet& key_description,
                                         keymaster_key_origin_t origin,
@@ -206,10 +252,14 @@ private:
             AuthorizationSet* hidden) const;
     keymaster_error_t DeriveMasterKey(KeymasterKeyBlob* master_key) const;
 
+    keymaster_error_t LoadCachedKey(const KeyBlobCache::Entry& entry,
+                                    const AuthorizationSet& additional_params,
+                                    UniquePtr<Key>* key) const;
+
     KmErrorOr<DeserializedKey> DeserializeKmCompatKeyBlob(
-            const KeymasterKeyBlob& blob) const;
+            const KeymasterKeyBlobView& blob) const;
     KmErrorOr<DeserializedKey> DeserializeKeyBlob(
-            const KeymasterKeyBlob& blob) const;
+            const KeymasterKeyBlobView& blob) const;
 
     /*
      * CreateAuthEncryptedKeyBlob takes a key description authorization set, key
@@ -232,11 +282,18 @@ private:
     UniquePtr<KeyFactory> aes_factory_;
     UniquePtr<KeyFactory> ec_factory_;
     UniquePtr<KeyFactory> hmac_factory_;
-    UniquePtr<KeyFactory> rsa_factory_;
+    UniquePtr<TrustyRsaKeyFactory> rsa_factory_;
     UniquePtr<KeyFactory> tdes_factory_;
 
     bool rng_initialized_;
     mutable int calls_since_reseed_;
+    EntropyPool entropy_pool_;
+    IdleScheduler* idle_scheduler_ = nullptr;
+    int entropy_pool_task_ = IdleScheduler::kInvalidTask;
+    int master_key_task_ = IdleScheduler::kInvalidTask;
+    int shrink_secrets_task_ = IdleScheduler::kInvalidTask;
+    HwkeyDerivedKey master_key_;
+    mutable KeyBlobCache key_blob_cache_;
     uint8_t auth_token_key_[kAuthTokenKeySize];
     bool auth_token_key_initialized_;
 
@@ -49,30 +49,87 @@ inline size_t min(size_t a, size_t b) {
     return a < b ? a : b;
 }
 
-bool TrustyKeymasterEnforcement::ValidateTokenSignature(
-        const hw_auth_token_t& token) const {
+bool TrustyKeymasterEnforcement::KeyTokenHmacCtx() const {
+    if (token_hmac_ctx_keyed_)
+        return true;
+
     keymaster_key_blob_t auth_token_key;
     keymaster_error_t error = context_->GetAuthTokenKey(&auth_token_key);
     if (error != KM_ERROR_OK)
         return false;
 
+    if (!HMAC_Init_ex(&token_hmac_ctx_, auth_token_key.key_material,
+                      auth_token_key.key_material_size, EVP_sha256(),
+                      nullptr /* engine */)) {
+        LOG_S("Error %d keying token HMAC", TranslateLastOpenSslError());
+        return false;
+    }
+    token_hmac_ctx_keyed_ = true;
+    // Tokens verified with another key must be checked again.
+    for (VerifiedToken& entry : verified_tokens_) {
+        entry.valid = false;
+    }
+    return true;
+}
+
+bool TrustyKeymasterEnforcement::FindVerifiedToken(
+        const hw_auth_token_t& token) const {
+    uint64_t now_ms = milliseconds_since_boot();
+    for (VerifiedToken& entry : verified_tokens_) {
+        if (!entry.valid) {
+            continue;
+        }
+        if (now_ms < entry.verified_ms ||
+            now_ms - entry.verified_ms > kVerifiedTokenLifetimeMs) {
+            entry.valid = false;
+            continue;
+        }
+        if (0 == memcmp_s(&entry.token, &token, sizeof(token))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void TrustyKeymasterEnforcement::AddVerifiedToken(
+        const hw_auth_token_t& token) const {
+    VerifiedToken& entry = verified_tokens_[next_verified_token_];
+    next_verified_token_ = (next_verified_token_ + 1) % kVerifiedTokenCacheSize;
+    entry.token = token;
+    entry.verified_ms = milliseconds_since_boot();
+    entry.valid = true;
+}
+
+bool TrustyKeymasterEnforcement::ValidateTokenSignature(
+        const hw_auth_token_t& token) const {
+    if (!KeyTokenHmacCtx())
+        return false;
+
+    if (FindVerifiedToken(token))
+        return true;
+
     // Signature covers entire token except HMAC field.
     const uint8_t* hash_data = reinterpret_cast<const uint8_t*>(&token);
     size_t hash_data_length =
             reinterpret_cast<const uint8_t*>(&token.hmac) - hash_data;
 
+    // A null key and digest reset the context to the saved key schedule.
     uint8_t computed_hash[EVP_MAX_MD_SIZE];
     unsigned int computed_hash_length;
-    if (!HMAC(EVP_sha256(), auth_token_key.key_material,
-              auth_token_key.key_material_size, hash_data, hash_data_length,
-              computed_hash, &computed_hash_length)) {
+    if (!HMAC_Init_ex(&token_hmac_ctx_, nullptr, 0, nullptr, nullptr) ||
+        !HMAC_Update(&token_hmac_ctx_, hash_data, hash_data_length) ||
+        !HMAC_Final(&token_hmac_ctx_, computed_hash, &computed_hash_length)) {
         LOG_S("Error %d computing token signature",
               TranslateLastOpenSslError());
         return false;
     }
 
-    return 0 == memcmp_s(computed_hash, token.hmac,
-                         min(sizeof(token.hmac), computed_hash_length));
+    if (0 != memcmp_s(computed_hash, token.hmac,
+                      min(sizeof(token.hmac), computed_hash_length)))
+        return false;
+
+    AddVerifiedToken(token);
+    return true;
 }
 
 uint64_t TrustyKeymasterEnforcement::milliseconds_since_boot() const {
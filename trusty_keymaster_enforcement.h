@@ -19,6 +19,8 @@
 
 #include "openssl_keymaster_enforcement.h"
 
+#include <openssl/hmac.h>
+
 namespace keymaster {
 
 class TrustyKeymasterContext;
@@ -31,8 +33,10 @@ public:
     TrustyKeymasterEnforcement(TrustyKeymasterContext* context)
             : OpenSSLKeymasterEnforcement(kAccessMapTableSize,
                                           kAccessCountTableSize),
-              context_(context) {}
-    ~TrustyKeymasterEnforcement() {}
+              context_(context) {
+        HMAC_CTX_init(&token_hmac_ctx_);
+    }
+    ~TrustyKeymasterEnforcement() { HMAC_CTX_cleanup(&token_hmac_ctx_); }
 
     bool activation_date_valid(uint64_t activation_date) const override {
         // Have no wall clock, can't check activations.
@@ -52,8 +56,30 @@ public:
 
 private:
     uint64_t milliseconds_since_boot() const;
+    bool KeyTokenHmacCtx() const;
+    bool FindVerifiedToken(const hw_auth_token_t& token) const;
+    void AddVerifiedToken(const hw_auth_token_t& token) const;
 
     TrustyKeymasterContext* context_;
+
+    // HMAC context keyed with the auth token key, which never changes once
+    // initialized. Each token check resets it to the precomputed key schedule.
+    mutable HMAC_CTX token_hmac_ctx_;
+    mutable bool token_hmac_ctx_keyed_ = false;
+
+    // Tokens whose signature was recently verified. The same token is usually
+    // presented for every step of an operation, so repeat checks only compare
+    // it against the cached copy. Entries expire after
+    // kVerifiedTokenLifetimeMs, whatever the timeout of the key using them.
+    static const size_t kVerifiedTokenCacheSize = 4;
+    static const uint64_t kVerifiedTokenLifetimeMs = 60 * 1000;
+    struct VerifiedToken {
+        hw_auth_token_t token;
+        uint64_t verified_ms;
+        bool valid = false;
+    };
+    mutable VerifiedToken verified_tokens_[kVerifiedTokenCacheSize];
+    mutable size_t next_verified_token_ = 0;
 };
 
 }  // namespace keymaster
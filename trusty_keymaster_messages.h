@@ -19,6 +19,8 @@
 
 #include <keymaster/android_keymaster_messages.h>
 
+#include <new>
+
 namespace keymaster {
 
 static inline bool copy_keymaster_algorithm_from_buf(
@@ -233,6 +235,425 @@ using AtapSetProductIdResponse = EmptyKeymasterResponse;
 using AtapReadUuidRequest = EmptyKeymasterRequest;
 using AtapReadUuidResponse = RawBufferResponse;
 
+/**
+ * Upper bounds on the contents of a single ProvisionAttestationBatchRequest.
+ */
+constexpr uint32_t kMaxProvisionBatchKeys = 2;
+constexpr uint32_t kMaxProvisionBatchCerts = 3;
+
+/**
+ * ProvisionedAttestationKey is an attestation key and the certificate chain
+ * that replaces the stored one, as part of a ProvisionAttestationBatchRequest.
+ */
+struct ProvisionedAttestationKey {
+    size_t SerializedSize() const {
+        size_t size = sizeof(uint32_t) + key_data.SerializedSize() +
+                      sizeof(uint32_t);
+        for (uint32_t i = 0; i < cert_count; ++i) {
+            size += certs[i].SerializedSize();
+        }
+        return size;
+    }
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const {
+        buf = append_uint32_to_buf(buf, end, algorithm);
+        buf = key_data.Serialize(buf, end);
+        buf = append_uint32_to_buf(buf, end, cert_count);
+        for (uint32_t i = 0; i < cert_count; ++i) {
+            buf = certs[i].Serialize(buf, end);
+        }
+        return buf;
+    }
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+        if (!copy_keymaster_algorithm_from_buf(buf_ptr, end, &algorithm) ||
+            !key_data.Deserialize(buf_ptr, end) ||
+            !copy_uint32_from_buf(buf_ptr, end, &cert_count) ||
+            cert_count > kMaxProvisionBatchCerts) {
+            return false;
+        }
+        for (uint32_t i = 0; i < cert_count; ++i) {
+            if (!certs[i].Deserialize(buf_ptr, end)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    keymaster_algorithm_t algorithm;
+    Buffer key_data;
+    uint32_t cert_count = 0;
+    Buffer certs[kMaxProvisionBatchCerts];
+};
+
+/**
+ * ProvisionAttestationBatchRequest carries everything the bootloader would
+ * otherwise provision with separate SetAttestationKey,
+ * AppendAttestationCertChain, SetAttestationIds and SetProductId requests.
+ * All of it is written in one secure storage transaction, so either all of
+ * it is stored or none of it is.  |attestation_ids| is only used if
+ * |set_attestation_ids| is set, and an empty |product_id| leaves the product
+ * ID unchanged.
+ */
+struct ProvisionAttestationBatchRequest : public KeymasterMessage {
+    explicit ProvisionAttestationBatchRequest(int32_t ver)
+            : KeymasterMessage(ver), attestation_ids(ver) {}
+
+    size_t SerializedSize() const override {
+        size_t size = sizeof(uint32_t);
+        for (uint32_t i = 0; i < key_count; ++i) {
+            size += keys[i].SerializedSize();
+        }
+        return size + sizeof(uint32_t) + attestation_ids.SerializedSize() +
+               product_id.SerializedSize();
+    }
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override {
+        buf = append_uint32_to_buf(buf, end, key_count);
+        for (uint32_t i = 0; i < key_count; ++i) {
+            buf = keys[i].Serialize(buf, end);
+        }
+        buf = append_uint32_to_buf(buf, end, set_attestation_ids);
+        buf = attestation_ids.Serialize(buf, end);
+        return product_id.Serialize(buf, end);
+    }
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
+        if (!copy_uint32_from_buf(buf_ptr, end, &key_count) ||
+            key_count > kMaxProvisionBatchKeys) {
+            return false;
+        }
+        for (uint32_t i = 0; i < key_count; ++i) {
+            if (!keys[i].Deserialize(buf_ptr, end)) {
+                return false;
+            }
+        }
+        return copy_uint32_from_buf(buf_ptr, end, &set_attestation_ids) &&
+               attestation_ids.Deserialize(buf_ptr, end) &&
+               product_id.Deserialize(buf_ptr, end);
+    }
+
+    uint32_t key_count = 0;
+    ProvisionedAttestationKey keys[kMaxProvisionBatchKeys];
+    uint32_t set_attestation_ids = 0;
+    SetAttestationIdsRequest attestation_ids;
+    Buffer product_id;
+};
+using ProvisionAttestationBatchResponse = EmptyKeymasterResponse;
+
+/**
+ * Upper bound on the number of update chunks in a single
+ * UpdateOperationBatchRequest.
+ */
+constexpr uint32_t kMaxUpdateBatchChunks = 64;
+
+/**
+ * UpdateOperationBatchRequest carries several update chunks for one operation,
+ * optionally followed by a finish, so that streaming callers need a single
+ * round trip instead of one per chunk.  |additional_params| are passed with
+ * the first update only.  |signature| and |finish_params| are only used if
+ * |finish| is set.
+ */
+struct UpdateOperationBatchRequest : public KeymasterMessage {
+    explicit UpdateOperationBatchRequest(int32_t ver) : KeymasterMessage(ver) {}
+
+    size_t SerializedSize() const override {
+        size_t size = sizeof(uint64_t) + additional_params.SerializedSize() +
+                      sizeof(uint32_t) + sizeof(uint32_t) +
+                      signature.SerializedSize() +
+                      finish_params.SerializedSize();
+        for (uint32_t i = 0; i < chunk_count; ++i) {
+            size += chunks[i].SerializedSize();
+        }
+        return size;
+    }
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override {
+        buf = append_uint64_to_buf(buf, end, op_handle);
+        buf = additional_params.Serialize(buf, end);
+        buf = append_uint32_to_buf(buf, end, chunk_count);
+        for (uint32_t i = 0; i < chunk_count; ++i) {
+            buf = chunks[i].Serialize(buf, end);
+        }
+        buf = append_uint32_to_buf(buf, end, finish);
+        buf = signature.Serialize(buf, end);
+        return finish_params.Serialize(buf, end);
+    }
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
+        if (!copy_uint64_from_buf(buf_ptr, end, &op_handle) ||
+            !additional_params.Deserialize(buf_ptr, end) ||
+            !copy_uint32_from_buf(buf_ptr, end, &chunk_count) ||
+            chunk_count > kMaxUpdateBatchChunks) {
+            return false;
+        }
+        chunks.reset(new (std::nothrow) Buffer[chunk_count]);
+        if (chunk_count && !chunks) {
+            return false;
+        }
+        for (uint32_t i = 0; i < chunk_count; ++i) {
+            if (!chunks[i].Deserialize(buf_ptr, end)) {
+                return false;
+            }
+        }
+        return copy_uint32_from_buf(buf_ptr, end, &finish) &&
+               signature.Deserialize(buf_ptr, end) &&
+               finish_params.Deserialize(buf_ptr, end);
+    }
+
+    uint64_t op_handle;
+    AuthorizationSet additional_params;
+    uint32_t chunk_count = 0;
+    UniquePtr<Buffer[]> chunks;
+    uint32_t finish = 0;
+    Buffer signature;
+    AuthorizationSet finish_params;
+};
+
+/**
+ * UpdateOperationBatchResponse holds the output of all updates, and of the
+ * finish if one was requested, concatenated in order.  |output_params| are
+ * the parameters returned by the last step.
+ */
+struct UpdateOperationBatchResponse : public KeymasterResponse {
+    explicit UpdateOperationBatchResponse(int32_t ver)
+            : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override {
+        return output.SerializedSize() + output_params.SerializedSize();
+    }
+    uint8_t* NonErrorSerialize(uint8_t* buf,
+                               const uint8_t* end) const override {
+        buf = output.Serialize(buf, end);
+        return output_params.Serialize(buf, end);
+    }
+    bool NonErrorDeserialize(const uint8_t** buf_ptr,
+                             const uint8_t* end) override {
+        return output.Deserialize(buf_ptr, end) &&
+               output_params.Deserialize(buf_ptr, end);
+    }
+
+    Buffer output;
+    AuthorizationSet output_params;
+};
+
+/**
+ * SharedMemoryOperationRequest runs an update, or a finish if |finish| is set,
+ * on data in a shared memory buffer attached to the request message as a
+ * memref handle.  The input is the |input_size| bytes at |input_offset| in the
+ * buffer, and the output is written to the buffer at |output_offset|, up to
+ * |output_capacity| bytes.  |signature| is only used by a finish.
+ *
+ * If no buffer is attached, for instance because the client cannot share
+ * memory with Trusty, |input| is used instead and the output is returned in
+ * the response.
+ */
+struct SharedMemoryOperationRequest : public KeymasterMessage {
+    explicit SharedMemoryOperationRequest(int32_t ver)
+            : KeymasterMessage(ver) {}
+
+    size_t SerializedSize() const override {
+        return sizeof(uint64_t) + additional_params.SerializedSize() +
+               sizeof(uint32_t) * 5 + signature.SerializedSize() +
+               input.SerializedSize();
+    }
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override {
+        buf = append_uint64_to_buf(buf, end, op_handle);
+        buf = additional_params.Serialize(buf, end);
+        buf = append_uint32_to_buf(buf, end, input_offset);
+        buf = append_uint32_to_buf(buf, end, input_size);
+        buf = append_uint32_to_buf(buf, end, output_offset);
+        buf = append_uint32_to_buf(buf, end, output_capacity);
+        buf = append_uint32_to_buf(buf, end, finish);
+        buf = signature.Serialize(buf, end);
+        return input.Serialize(buf, end);
+    }
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
+        return copy_uint64_from_buf(buf_ptr, end, &op_handle) &&
+               additional_params.Deserialize(buf_ptr, end) &&
+               copy_uint32_from_buf(buf_ptr, end, &input_offset) &&
+               copy_uint32_from_buf(buf_ptr, end, &input_size) &&
+               copy_uint32_from_buf(buf_ptr, end, &output_offset) &&
+               copy_uint32_from_buf(buf_ptr, end, &output_capacity) &&
+               copy_uint32_from_buf(buf_ptr, end, &finish) &&
+               signature.Deserialize(buf_ptr, end) &&
+               input.Deserialize(buf_ptr, end);
+    }
+
+    uint64_t op_handle;
+    AuthorizationSet additional_params;
+    uint32_t input_offset = 0;
+    uint32_t input_size = 0;
+    uint32_t output_offset = 0;
+    uint32_t output_capacity = 0;
+    uint32_t finish = 0;
+    Buffer signature;
+    Buffer input;
+};
+
+/**
+ * SharedMemoryOperationResponse reports the number of bytes written to the
+ * shared memory buffer in |shared_output_size|.  If no buffer was attached to
+ * the request, the output is returned in |output| instead.
+ */
+struct SharedMemoryOperationResponse : public KeymasterResponse {
+    explicit SharedMemoryOperationResponse(int32_t ver)
+            : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override {
+        return sizeof(uint32_t) + output.SerializedSize() +
+               output_params.SerializedSize();
+    }
+    uint8_t* NonErrorSerialize(uint8_t* buf,
+                               const uint8_t* end) const override {
+        buf = append_uint32_to_buf(buf, end, shared_output_size);
+        buf = output.Serialize(buf, end);
+        return output_params.Serialize(buf, end);
+    }
+    bool NonErrorDeserialize(const uint8_t** buf_ptr,
+                             const uint8_t* end) override {
+        return copy_uint32_from_buf(buf_ptr, end, &shared_output_size) &&
+               output.Deserialize(buf_ptr, end) &&
+               output_params.Deserialize(buf_ptr, end);
+    }
+
+    uint32_t shared_output_size = 0;
+    Buffer output;
+    AuthorizationSet output_params;
+};
+
+/**
+ * Upper bound on the number of keys in a single GenerateRkpKeyBatchRequest.
+ */
+constexpr uint32_t kMaxRkpKeyBatchKeys = 32;
+
+/**
+ * GenerateRkpKeyBatchRequest asks for |key_count| remote provisioning keys,
+ * all generated in the same |test_mode|, in a single round trip.
+ */
+struct GenerateRkpKeyBatchRequest : public KeymasterMessage {
+    explicit GenerateRkpKeyBatchRequest(int32_t ver) : KeymasterMessage(ver) {}
+
+    size_t SerializedSize() const override { return 2 * sizeof(uint32_t); }
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override {
+        buf = append_uint32_to_buf(buf, end, test_mode);
+        return append_uint32_to_buf(buf, end, key_count);
+    }
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
+        return copy_uint32_from_buf(buf_ptr, end, &test_mode) &&
+               copy_uint32_from_buf(buf_ptr, end, &key_count) &&
+               key_count <= kMaxRkpKeyBatchKeys;
+    }
+
+    uint32_t test_mode = 0;
+    uint32_t key_count = 0;
+};
+
+/**
+ * GenerateRkpKeyBatchResponse holds, for each generated key, its key blob and
+ * its MACed COSE_Key public key, as GenerateRkpKeyResponse does for one key.
+ * If any key fails, the response carries the error and no keys.
+ */
+struct GenerateRkpKeyBatchResponse : public KeymasterResponse {
+    explicit GenerateRkpKeyBatchResponse(int32_t ver)
+            : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override {
+        size_t size = sizeof(uint32_t);
+        for (uint32_t i = 0; i < key_count; ++i) {
+            size += key_blobs[i].SerializedSize() +
+                    maced_public_keys[i].SerializedSize();
+        }
+        return size;
+    }
+    uint8_t* NonErrorSerialize(uint8_t* buf,
+                               const uint8_t* end) const override {
+        buf = append_uint32_to_buf(buf, end, key_count);
+        for (uint32_t i = 0; i < key_count; ++i) {
+            buf = key_blobs[i].Serialize(buf, end);
+            buf = maced_public_keys[i].Serialize(buf, end);
+        }
+        return buf;
+    }
+    bool NonErrorDeserialize(const uint8_t** buf_ptr,
+                             const uint8_t* end) override {
+        if (!copy_uint32_from_buf(buf_ptr, end, &key_count) ||
+            !Allocate(key_count)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < key_count; ++i) {
+            if (!key_blobs[i].Deserialize(buf_ptr, end) ||
+                !maced_public_keys[i].Deserialize(buf_ptr, end)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Makes room for |count| keys and sets |key_count| to it.
+     */
+    bool Allocate(uint32_t count) {
+        key_count = 0;
+        if (count > kMaxRkpKeyBatchKeys) {
+            return false;
+        }
+        key_blobs.reset(new (std::nothrow) Buffer[count]);
+        maced_public_keys.reset(new (std::nothrow) Buffer[count]);
+        if (count && (!key_blobs || !maced_public_keys)) {
+            return false;
+        }
+        key_count = count;
+        return true;
+    }
+
+    uint32_t key_count = 0;
+    UniquePtr<Buffer[]> key_blobs;
+    UniquePtr<Buffer[]> maced_public_keys;
+};
+
+/**
+ * Upper bound on the number of keys in a single DeleteKeysRequest.
+ */
+constexpr uint32_t kMaxDeleteKeysBatchKeys = 32;
+
+/**
+ * DeleteKeysRequest carries the blobs of several keys to delete at once, for
+ * instance all the keys of an uninstalled app.
+ */
+struct DeleteKeysRequest : public KeymasterMessage {
+    explicit DeleteKeysRequest(int32_t ver) : KeymasterMessage(ver) {}
+
+    size_t SerializedSize() const override {
+        size_t size = sizeof(uint32_t);
+        for (uint32_t i = 0; i < key_count; ++i) {
+            size += key_blobs[i].SerializedSize();
+        }
+        return size;
+    }
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override {
+        buf = append_uint32_to_buf(buf, end, key_count);
+        for (uint32_t i = 0; i < key_count; ++i) {
+            buf = key_blobs[i].Serialize(buf, end);
+        }
+        return buf;
+    }
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
+        if (!copy_uint32_from_buf(buf_ptr, end, &key_count) ||
+            key_count > kMaxDeleteKeysBatchKeys) {
+            return false;
+        }
+        key_blobs.reset(new (std::nothrow) Buffer[key_count]);
+        if (key_count && !key_blobs) {
+            return false;
+        }
+        for (uint32_t i = 0; i < key_count; ++i) {
+            if (!key_blobs[i].Deserialize(buf_ptr, end)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    uint32_t key_count = 0;
+    UniquePtr<Buffer[]> key_blobs;
+};
+using DeleteKeysResponse = EmptyKeymasterResponse;
+
 }  // namespace keymaster
 
 #endif  // TRUSTY_APP_KEYMASTER_TRUSTY_KEYMASTER_MESSAGES_H_
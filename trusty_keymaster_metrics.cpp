@@ -0,0 +1,110 @@
+/*
+ * Copyright 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "trusty_keymaster_metrics.h"
+
+#include <string.h>
+
+#include <trusty/time.h>
+
+namespace keymaster {
+
+KeymasterMetrics* KeymasterMetrics::get_instance() {
+    static KeymasterMetrics metrics;
+    return &metrics;
+}
+
+uint64_t KeymasterMetrics::NowUs() {
+    int64_t now_ns = 0;
+    if (trusty_gettime(0, &now_ns) || now_ns < 0) {
+        return 0;
+    }
+    return static_cast<uint64_t>(now_ns) / 1000;
+}
+
+void KeymasterMetrics::Record(KeymasterLatencyStats* stats,
+                              uint64_t elapsed_us,
+                              bool failed) {
+    size_t bucket = 0;
+    if (elapsed_us > 1) {
+        bucket = 63 - __builtin_clzll(elapsed_us);
+    }
+    if (bucket >= kMetricsLatencyBuckets) {
+        bucket = kMetricsLatencyBuckets - 1;
+    }
+
+    stats->count++;
+    stats->buckets[bucket]++;
+    if (failed) {
+        stats->errors++;
+    }
+    stats->total_us += elapsed_us;
+    if (elapsed_us > stats->max_us) {
+        stats->max_us = elapsed_us;
+    }
+}
+
+void KeymasterMetrics::RecordCommand(uint32_t cmd,
+                                     uint64_t elapsed_us,
+                                     bool failed) {
+    KeymasterLatencyStats* stats = nullptr;
+    for (size_t i = 0; i < command_count_; ++i) {
+        if (commands_[i].id == cmd) {
+            stats = &commands_[i];
+            break;
+        }
+    }
+    if (!stats) {
+        if (command_count_ == kMaxCommands) {
+            return;
+        }
+        stats = &commands_[command_count_++];
+        stats->id = cmd;
+    }
+    Record(stats, elapsed_us, failed);
+}
+
+void KeymasterMetrics::RecordPhase(MetricsPhase phase, uint64_t elapsed_us) {
+    Record(&phases_[static_cast<size_t>(phase)], elapsed_us,
+           false /* failed */);
+}
+
+size_t KeymasterMetrics::SerializedSize() const {
+    return sizeof(KeymasterMetricsHeader) +
+           (command_count_ + static_cast<size_t>(MetricsPhase::kCount)) *
+                   sizeof(KeymasterLatencyStats);
+}
+
+void KeymasterMetrics::Serialize(uint8_t* buf) const {
+    KeymasterMetricsHeader header = {
+            .version = kVersion,
+            .command_count = static_cast<uint32_t>(command_count_),
+            .phase_count = static_cast<uint32_t>(MetricsPhase::kCount),
+            .bucket_count = kMetricsLatencyBuckets,
+    };
+    memcpy(buf, &header, sizeof(header));
+    buf += sizeof(header);
+    memcpy(buf, commands_, command_count_ * sizeof(commands_[0]));
+    buf += command_count_ * sizeof(commands_[0]);
+    for (size_t i = 0; i < static_cast<size_t>(MetricsPhase::kCount); ++i) {
+        KeymasterLatencyStats stats = phases_[i];
+        stats.id = static_cast<uint32_t>(i);
+        memcpy(buf, &stats, sizeof(stats));
+        buf += sizeof(stats);
+    }
+}
+
+}  // namespace keymaster
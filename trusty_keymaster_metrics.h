@@ -0,0 +1,139 @@
+/*
+ * Copyright 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace keymaster {
+
+/**
+ * Sub-phases of request handling that are timed separately from the commands
+ * that run them.
+ */
+enum class MetricsPhase : uint32_t {
+    kDeriveMasterKey = 0,
+    kSecureStorage = 1,
+    kDecryptKey = 2,
+    kLoadKey = 3,
+    kCount,
+};
+
+/**
+ * Wire format of the metrics returned by KM_GET_METRICS: one
+ * KeymasterMetricsHeader, then |command_count| KeymasterLatencyStats for the
+ * commands seen so far, each with |id| set to the command, then
+ * |phase_count| KeymasterLatencyStats with |id| set to the MetricsPhase.
+ * All fields are little endian.
+ */
+struct KeymasterMetricsHeader {
+    uint32_t version;
+    uint32_t command_count;
+    uint32_t phase_count;
+    uint32_t bucket_count;
+};
+
+/*
+ * Bucket 0 counts latencies under 2us, bucket i latencies in [2^i, 2^(i+1))
+ * us, and the last bucket everything above, about 8s.
+ */
+constexpr size_t kMetricsLatencyBuckets = 24;
+
+struct KeymasterLatencyStats {
+    uint32_t id;
+    uint32_t count;
+    uint32_t errors;
+    uint32_t reserved;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint32_t buckets[kMetricsLatencyBuckets];
+};
+
+/**
+ * KeymasterMetrics counts requests per command and keeps fixed-bucket latency
+ * histograms for them and for the sub-phases in MetricsPhase, so that p50 and
+ * p99 latencies can be read from a device.  Counters are kept from boot and
+ * are never reset.
+ */
+class KeymasterMetrics {
+public:
+    static constexpr uint32_t kVersion = 1;
+    static constexpr size_t kMaxCommands = 48;
+
+    static KeymasterMetrics* get_instance();
+
+    /**
+     * Returns the secure time in microseconds, or 0 if it can't be read.
+     */
+    static uint64_t NowUs();
+
+    /**
+     * Records one request for |cmd| that took |elapsed_us|, not counting
+     * secure requests served while it ran.  |failed| is set if the request
+     * could not be handled or its response carries an error.  Requests for
+     * commands beyond the first kMaxCommands seen are not recorded.
+     */
+    void RecordCommand(uint32_t cmd, uint64_t elapsed_us, bool failed);
+
+    void RecordPhase(MetricsPhase phase, uint64_t elapsed_us);
+
+    /**
+     * Returns the size of the wire format written by Serialize().
+     */
+    size_t SerializedSize() const;
+
+    /**
+     * Writes the metrics to |buf|, which must hold SerializedSize() bytes.
+     */
+    void Serialize(uint8_t* buf) const;
+
+private:
+    KeymasterMetrics() = default;
+    KeymasterMetrics(const KeymasterMetrics&) = delete;
+    KeymasterMetrics& operator=(const KeymasterMetrics&) = delete;
+
+    static void Record(KeymasterLatencyStats* stats,
+                       uint64_t elapsed_us,
+                       bool failed);
+
+    KeymasterLatencyStats commands_[kMaxCommands] = {};
+    size_t command_count_ = 0;
+    KeymasterLatencyStats phases_[static_cast<size_t>(MetricsPhase::kCount)] =
+            {};
+};
+
+/**
+ * Records the time from its construction to its destruction as |phase|.
+ */
+class ScopedPhaseTimer {
+public:
+    explicit ScopedPhaseTimer(MetricsPhase phase)
+            : phase_(phase), start_us_(KeymasterMetrics::NowUs()) {}
+    ~ScopedPhaseTimer() {
+        KeymasterMetrics::get_instance()->RecordPhase(
+                phase_, KeymasterMetrics::NowUs() - start_us_);
+    }
+
+    ScopedPhaseTimer(const ScopedPhaseTimer&) = delete;
+    ScopedPhaseTimer& operator=(const ScopedPhaseTimer&) = delete;
+
+private:
+    MetricsPhase phase_;
+    uint64_t start_us_;
+};
+
+}  // namespace keymaster
@@ -17,10 +17,10 @@
 #include "trusty_remote_provisioning_context.h"
 
 #include <assert.h>
+#include <keymaster/android_keymaster_utils.h>
 #include <keymaster/cppcose/cppcose.h>
 #include <keymaster/logger.h>
 #include <lib/hwbcc/client/hwbcc.h>
-#include <lib/hwkey/hwkey.h>
 #include <lib/system_state/system_state.h>
 #include <openssl/bn.h>
 #include <openssl/ec.h>
@@ -30,6 +30,7 @@
 
 #include "keymaster_attributes.pb.h"
 #include "secure_storage_manager.h"
+#include "trusty_keymaster_metrics.h"
 
 namespace keymaster {
 
@@ -47,37 +48,30 @@ constexpr uint32_t kMacKeyLength = 32;
 static const uint8_t kMasterKeyDerivationData[kMacKeyLength] =
         "RemoteKeyProvisioningMasterKey";
 
+TrustyRemoteProvisioningContext::TrustyRemoteProvisioningContext()
+        : hw_backed_key_(kMasterKeyDerivationData, kMacKeyLength) {}
+
+TrustyRemoteProvisioningContext::~TrustyRemoteProvisioningContext() {
+    InvalidateHbk();
+}
+
 std::vector<uint8_t> TrustyRemoteProvisioningContext::DeriveBytesFromHbk(
         const std::string& context,
         size_t num_bytes) const {
-    long rc = hwkey_open();
-    if (rc < 0) {
-        LOG_S("Couldn't open hwkey session: %d", rc);
+    KeymasterKeyBlob hw_backed_key;
+    if (hw_backed_key_.GetKey(&hw_backed_key) != KM_ERROR_OK) {
+        LOG_S("Couldn't derive hardware-backed key", 0);
         return {};
     }
 
-    hwkey_session_t session = static_cast<hwkey_session_t>(rc);
-    std::array<uint8_t, kMacKeyLength> hw_backed_key;
-
-    uint32_t kdf_version = HWKEY_KDF_VERSION_1;
-    rc = hwkey_derive(session, &kdf_version, kMasterKeyDerivationData,
-                      hw_backed_key.data(), kMacKeyLength);
-
-    if (rc < 0) {
-        LOG_S("Error deriving master key: %d", rc);
-        return {};
-    }
-
-    hwkey_close(session);
-
     std::vector<uint8_t> result(num_bytes);
 
     // TODO: Figure out if HKDF can fail.  It doesn't seem like it should be
     // able to, but the function does return an error code.
-    HKDF(result.data(), num_bytes,                    //
-         EVP_sha256(),                                //
-         hw_backed_key.data(), hw_backed_key.size(),  //
-         nullptr /* salt */, 0 /* salt len */,        //
+    HKDF(result.data(), num_bytes,                     //
+         EVP_sha256(),                                 //
+         hw_backed_key.begin(), hw_backed_key.size(),  //
+         nullptr /* salt */, 0 /* salt len */,         //
          reinterpret_cast<const uint8_t*>(context.data()), context.size());
 
     return result;
@@ -92,19 +86,51 @@ std::vector<uint8_t> TrustyRemoteProvisioningContext::DeriveBytesFromHbk(
 
 std::unique_ptr<cppbor::Map> TrustyRemoteProvisioningContext::CreateDeviceInfo()
         const {
-    auto result = std::make_unique<cppbor::Map>();
+    SecureStorageManager* ss_manager;
+    uint32_t ids_generation;
+    {
+        ScopedPhaseTimer timer(MetricsPhase::kSecureStorage);
+        ss_manager = SecureStorageManager::get_instance();
+        if (ss_manager == nullptr) {
+            LOG_E("Failed to open secure storage session.", 0);
+            return std::make_unique<cppbor::Map>();
+        }
+        ids_generation = ss_manager->AttestationIdsGeneration();
+    }
 
-    SecureStorageManager* ss_manager = SecureStorageManager::get_instance();
-    if (ss_manager == nullptr) {
-        LOG_E("Failed to open secure storage session.", 0);
-        return result;
+    bool fused = !system_state_get_flag_default(
+            SYSTEM_STATE_FLAG_APP_LOADING_UNLOCKED, 0 /* default */);
+    if (!device_info_ || device_info_ids_generation_ != ids_generation ||
+        device_info_fused_ != fused) {
+        auto result = std::make_unique<cppbor::Map>();
+        if (!BuildDeviceInfo(ss_manager, fused, result.get()) ||
+            !bootParams_) {
+            // Don't keep a map that is missing fields.
+            return result;
+        }
+        device_info_ = std::move(result);
+        device_info_ids_generation_ = ids_generation;
+        device_info_fused_ = fused;
     }
 
+    // The copy keeps the canonical order of the cached map.
+    return std::unique_ptr<cppbor::Map>(
+            static_cast<cppbor::Map*>(device_info_->clone().release()));
+}
+
+bool TrustyRemoteProvisioningContext::BuildDeviceInfo(
+        SecureStorageManager* ss_manager,
+        bool fused,
+        cppbor::Map* result) const {
     AttestationIds ids;
-    auto err = ss_manager->ReadAttestationIds(&ids);
+    keymaster_error_t err;
+    {
+        ScopedPhaseTimer timer(MetricsPhase::kSecureStorage);
+        err = ss_manager->ReadAttestationIds(&ids);
+    }
     if (err != KM_ERROR_OK) {
         LOG_E("Failed to read attestation IDs", 0);
-        return result;
+        return false;
     }
     ADD_ID_FIELD(result, ids.brand, "brand")
     ADD_ID_FIELD(result, ids.manufacturer, "manufacturer")
@@ -137,17 +163,13 @@ std::unique_ptr<cppbor::Map> TrustyRemoteProvisioningContext::CreateDeviceInfo()
                     cppbor::Uint(bootParams_->boot_os_patchlevel));
         result->add("boot_patch_level", cppbor::Uint(boot_patchlevel_));
         result->add("vendor_patch_level", cppbor::Uint(vendor_patchlevel_));
-        result->add("fused", system_state_get_flag_default(
-                                     SYSTEM_STATE_FLAG_APP_LOADING_UNLOCKED,
-                                     0 /* default */)
-                                     ? 0
-                                     : 1);
+        result->add("fused", fused ? 1 : 0);
         result->add("security_level", "tee");
         result->add("version", 2);
     }
 
     result->canonicalize();
-    return result;
+    return true;
 }
 
 cppcose::ErrMsgOr<std::vector<uint8_t>>
@@ -155,31 +177,49 @@ TrustyRemoteProvisioningContext::BuildProtectedDataPayload(
         bool testMode,
         const std::vector<uint8_t>& macKey,
         const std::vector<uint8_t>& aad) const {
-    std::vector<uint8_t> signedOutput(HWBCC_MAX_RESP_PAYLOAD_SIZE);
-    std::vector<uint8_t> bcc(HWBCC_MAX_RESP_PAYLOAD_SIZE);
+    signed_mac_key_buf_.resize(HWBCC_MAX_RESP_PAYLOAD_SIZE);
+    bcc_buf_.resize(HWBCC_MAX_RESP_PAYLOAD_SIZE);
     size_t actualBccSize = 0;
     size_t actualSignedMacKeySize = 0;
     int rc = hwbcc_get_protected_data(
             testMode, EDDSA, macKey.data(), aad.data(), aad.size(),
-            signedOutput.data(), signedOutput.size(), &actualSignedMacKeySize,
-            bcc.data(), bcc.size(), &actualBccSize);
+            signed_mac_key_buf_.data(), signed_mac_key_buf_.size(),
+            &actualSignedMacKeySize, bcc_buf_.data(), bcc_buf_.size(),
+            &actualBccSize);
     if (rc != 0) {
         LOG_E("Error: [%d] Failed to sign the MAC key on WHI", rc);
         return "Failed to sign the MAC key on WHI";
     }
-    signedOutput.resize(actualSignedMacKeySize);
-    bcc.resize(actualBccSize);
-    return cppbor::Array()
-            .add(cppbor::EncodedItem(std::move(signedOutput)))
-            .add(cppbor::EncodedItem(std::move(bcc)))
-            .encode();
+    if (actualSignedMacKeySize > signed_mac_key_buf_.size() ||
+        actualBccSize > bcc_buf_.size()) {
+        LOG_E("Protected data larger than its buffer", 0);
+        return "Protected data larger than its buffer";
+    }
+    auto signedOutput = signed_mac_key_buf_.begin();
+    auto bcc = bcc_buf_.begin();
+    auto payload =
+            cppbor::Array()
+                    .add(cppbor::EncodedItem(std::vector<uint8_t>(
+                            signedOutput,
+                            signedOutput + actualSignedMacKeySize)))
+                    .add(cppbor::EncodedItem(
+                            std::vector<uint8_t>(bcc, bcc + actualBccSize)))
+                    .encode();
+    // The signed output carries the MAC key, don't leave it in the buffer.
+    memset_s(signed_mac_key_buf_.data(), 0, actualSignedMacKeySize);
+    return payload;
 }
 
 std::optional<cppcose::HmacSha256>
 TrustyRemoteProvisioningContext::GenerateHmacSha256(
         const cppcose::bytevec& input) const {
-    auto key = DeriveBytesFromHbk("Key to MAC public keys", kMacKeyLength);
-    auto result = cppcose::generateHmacSha256(key, input);
+    if (mac_key_.empty()) {
+        mac_key_ = DeriveBytesFromHbk("Key to MAC public keys", kMacKeyLength);
+        if (mac_key_.empty()) {
+            return std::nullopt;
+        }
+    }
+    auto result = cppcose::generateHmacSha256(mac_key_, input);
     if (!result) {
         LOG_E("Error signing MAC: %s", result.message().c_str());
         return std::nullopt;
@@ -195,6 +235,15 @@ void TrustyRemoteProvisioningContext::SetBootParams(
     }
     bootParamsSet_ = true;
     bootParams_ = bootParams;
+    device_info_.reset();
+}
+
+void TrustyRemoteProvisioningContext::InvalidateHbk() const {
+    hw_backed_key_.Invalidate();
+    if (!mac_key_.empty()) {
+        memset_s(mac_key_.data(), 0, mac_key_.size());
+        mac_key_.clear();
+    }
 }
 
 }  // namespace keymaster
@@ -21,6 +21,9 @@
 
 #include <cppbor.h>
 
+#include "secure_storage_manager.h"
+#include "trusty_hwkey_derived_key.h"
+
 namespace keymaster {
 
 struct BootParams {
@@ -38,8 +41,8 @@ struct BootParams {
  */
 class TrustyRemoteProvisioningContext : public RemoteProvisioningContext {
 public:
-    TrustyRemoteProvisioningContext(){};
-    ~TrustyRemoteProvisioningContext() override{};
+    TrustyRemoteProvisioningContext();
+    ~TrustyRemoteProvisioningContext() override;
     std::vector<uint8_t> DeriveBytesFromHbk(const std::string& context,
                                             size_t numBytes) const override;
     std::unique_ptr<cppbor::Map> CreateDeviceInfo() const override;
@@ -52,17 +55,55 @@ public:
     void SetBootParams(const BootParams* bootParams);
     void SetVendorPatchlevel(uint32_t vendor_patchlevel) {
         vendor_patchlevel_ = vendor_patchlevel;
+        device_info_.reset();
     }
 
     void SetBootPatchlevel(uint32_t boot_patchlevel) {
         boot_patchlevel_ = boot_patchlevel;
+        device_info_.reset();
     }
 
+    /**
+     * Drops the cached DeviceInfo map.  Must be called when a boot parameter
+     * it reports changes, e.g. the OS version set by Configure.
+     */
+    void InvalidateDeviceInfo() { device_info_.reset(); }
+
+    /**
+     * Wipes the cached hardware-backed key used by DeriveBytesFromHbk, and
+     * the MAC key derived from it.
+     */
+    void InvalidateHbk() const;
+
 private:
+    bool BuildDeviceInfo(SecureStorageManager* ss_manager,
+                         bool fused,
+                         cppbor::Map* result) const;
+
     bool bootParamsSet_ = false;
     const BootParams* bootParams_ = nullptr;
     uint32_t vendor_patchlevel_ = 0;
     uint32_t boot_patchlevel_ = 0;
+    HwkeyDerivedKey hw_backed_key_;
+
+    /*
+     * The DeviceInfo map only changes when the boot parameters, patchlevels,
+     * attestation IDs or fused state do, so the last one built is kept and
+     * copied for each CSR.  It is only cached once boot params are set.
+     */
+    mutable std::unique_ptr<cppbor::Map> device_info_;
+    mutable uint32_t device_info_ids_generation_ = 0;
+    mutable bool device_info_fused_ = false;
+
+    /* Key used to MAC public keys, derived from the HBK on first use. */
+    mutable std::vector<uint8_t> mac_key_;
+
+    /*
+     * Output buffers for hwbcc_get_protected_data, allocated on first use
+     * and kept for later CSRs.
+     */
+    mutable std::vector<uint8_t> signed_mac_key_buf_;
+    mutable std::vector<uint8_t> bcc_buf_;
 };
 
 }  // namespace keymaster
@@ -0,0 +1,221 @@
+/*
+ * Copyright 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "trusty_rsa_key.h"
+
+#include <keymaster/km_openssl/openssl_err.h>
+#include <keymaster/km_openssl/openssl_utils.h>
+#include <keymaster/logger.h>
+#include <openssl/evp.h>
+
+namespace keymaster {
+
+namespace {
+
+struct RsaDelete {
+    void operator()(RSA* p) const { RSA_free(p); }
+};
+typedef UniquePtr<RSA, RsaDelete> Unique_RSA;
+
+struct EvpPkeyDelete {
+    void operator()(EVP_PKEY* p) const { EVP_PKEY_free(p); }
+};
+typedef UniquePtr<EVP_PKEY, EvpPkeyDelete> Unique_EVP_PKEY;
+
+struct BignumDelete {
+    void operator()(BIGNUM* p) const { BN_free(p); }
+};
+typedef UniquePtr<BIGNUM, BignumDelete> Unique_BIGNUM;
+
+}  // namespace
+
+TrustyRsaKeyFactory::~TrustyRsaKeyFactory() {
+    idle_scheduler_ = nullptr;
+    ClearPool();
+}
+
+keymaster_error_t TrustyRsaKeyFactory::GenerateKey(
+        const AuthorizationSet& key_description,
+        UniquePtr<Key> attestation_signing_key,
+        const KeymasterBlob& issuer_subject,
+        KeymasterKeyBlob* key_blob,
+        AuthorizationSet* hw_enforced,
+        AuthorizationSet* sw_enforced,
+        CertificateChain* cert_chain) const {
+    uint32_t key_size;
+    uint64_t public_exponent;
+    RSA* rsa = nullptr;
+    if (key_description.GetTagValue(TAG_KEY_SIZE, &key_size) &&
+        key_description.GetTagValue(TAG_RSA_PUBLIC_EXPONENT,
+                                    &public_exponent) &&
+        key_size == kPooledKeySize && public_exponent == kPublicExponent) {
+        rsa = TakePooledKey();
+    }
+    if (!rsa) {
+        return RsaKeyFactory::GenerateKey(
+                key_description, move(attestation_signing_key), issuer_subject,
+                key_blob, hw_enforced, sw_enforced, cert_chain);
+    }
+
+    LOG_D("Using pooled RSA keypair, %zu left", pool_count_);
+    return GenerateFromRsa(key_description, rsa,
+                           move(attestation_signing_key), issuer_subject,
+                           key_blob, hw_enforced, sw_enforced, cert_chain);
+}
+
+int TrustyRsaKeyFactory::GenerateCallback(int event, int n, BN_GENCB* cb) {
+    auto factory = static_cast<const TrustyRsaKeyFactory*>(cb->arg);
+    if (factory->checkpoint_handler_ &&
+        ++factory->checkpoint_events_ % kCheckpointInterval == 0) {
+        factory->checkpoint_handler_(factory->checkpoint_arg_);
+    }
+    return 1;
+}
+
+RSA* TrustyRsaKeyFactory::GenerateRsa(uint32_t key_size) const {
+    BN_GENCB callback;
+    BN_GENCB_set(&callback, GenerateCallback,
+                 const_cast<TrustyRsaKeyFactory*>(this));
+
+    Unique_BIGNUM exponent(BN_new());
+    Unique_RSA rsa(RSA_new());
+    if (!exponent.get() || !rsa.get() ||
+        !BN_set_word(exponent.get(), kPublicExponent) ||
+        !RSA_generate_key_ex(rsa.get(), key_size, exponent.get(), &callback)) {
+        return nullptr;
+    }
+    return rsa.release();
+}
+
+RSA* TrustyRsaKeyFactory::TakePooledKey() const {
+    if (!pool_count_) {
+        return nullptr;
+    }
+    RSA* rsa = pool_[--pool_count_];
+    pool_[pool_count_] = nullptr;
+    if (idle_scheduler_) {
+        idle_scheduler_->Schedule(refill_task_);
+    }
+    return rsa;
+}
+
+keymaster_error_t TrustyRsaKeyFactory::GenerateFromRsa(
+        const AuthorizationSet& key_description,
+        RSA* rsa,
+        UniquePtr<Key> attestation_signing_key,
+        const KeymasterBlob& issuer_subject,
+        KeymasterKeyBlob* key_blob,
+        AuthorizationSet* hw_enforced,
+        AuthorizationSet* sw_enforced,
+        CertificateChain* cert_chain) const {
+    Unique_RSA rsa_key(rsa);
+    if (!key_blob || !hw_enforced || !sw_enforced) {
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+    }
+
+    Unique_EVP_PKEY pkey(EVP_PKEY_new());
+    if (!pkey.get()) {
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    if (EVP_PKEY_set1_RSA(pkey.get(), rsa_key.get()) != 1) {
+        return TranslateLastOpenSslError();
+    }
+
+    KeymasterKeyBlob key_material;
+    keymaster_error_t error = EvpKeyToKeyMaterial(pkey.get(), &key_material);
+    if (error != KM_ERROR_OK) {
+        return error;
+    }
+
+    error = blob_maker_.CreateKeyBlob(key_description, KM_ORIGIN_GENERATED,
+                                      key_material, key_blob, hw_enforced,
+                                      sw_enforced);
+    if (error != KM_ERROR_OK) {
+        return error;
+    }
+
+    if (context_.GetKmVersion() < KmVersion::KEYMINT_1) {
+        return KM_ERROR_OK;
+    }
+    if (!cert_chain) {
+        return KM_ERROR_UNEXPECTED_NULL_POINTER;
+    }
+
+    // Load the key the same way a later request would, so that the
+    // certificate is built from exactly what was stored in the blob.
+    UniquePtr<Key> key;
+    error = LoadKey(move(key_material), {} /* additional_params */,
+                    AuthorizationSet(*hw_enforced),
+                    AuthorizationSet(*sw_enforced), &key);
+    if (error != KM_ERROR_OK) {
+        return error;
+    }
+
+    if (key_description.Contains(TAG_ATTESTATION_CHALLENGE)) {
+        *cert_chain = context_.GenerateAttestation(
+                *key, key_description, move(attestation_signing_key),
+                issuer_subject, &error);
+    } else if (attestation_signing_key.get() != nullptr) {
+        return KM_ERROR_INCOMPATIBLE_PURPOSE;
+    } else {
+        // Only keys that may sign get a real self-signature, as in
+        // RsaKeyFactory::GenerateKey.  Pooled keys are always large enough.
+        bool fake_signature =
+                !key_description.Contains(TAG_PURPOSE, KM_PURPOSE_SIGN) &&
+                !key_description.Contains(TAG_PURPOSE, KM_PURPOSE_ATTEST_KEY);
+        *cert_chain = context_.GenerateSelfSignedCertificate(
+                *key, key_description, fake_signature, &error);
+    }
+    return error;
+}
+
+void TrustyRsaKeyFactory::RegisterIdleTasks(IdleScheduler* scheduler) {
+    if (!kPoolSize) {
+        return;
+    }
+    idle_scheduler_ = scheduler;
+    refill_task_ =
+            scheduler->Register("fill RSA key pool", RefillPoolTask, this);
+}
+
+bool TrustyRsaKeyFactory::RefillPoolTask(void* arg) {
+    auto factory = static_cast<TrustyRsaKeyFactory*>(arg);
+    if (factory->pool_count_ >= kPoolSize) {
+        return false;
+    }
+
+    RSA* rsa = factory->GenerateRsa(kPooledKeySize);
+    if (!rsa) {
+        LOG_E("Failed to generate pooled RSA keypair: %d",
+              TranslateLastOpenSslError());
+        return false;
+    }
+    factory->pool_[factory->pool_count_++] = rsa;
+    return factory->pool_count_ < kPoolSize;
+}
+
+void TrustyRsaKeyFactory::ClearPool() const {
+    // RSA_free clears the private values before freeing them.
+    while (pool_count_) {
+        RSA_free(pool_[--pool_count_]);
+        pool_[pool_count_] = nullptr;
+    }
+    if (idle_scheduler_) {
+        idle_scheduler_->Schedule(refill_task_);
+    }
+}
+
+}  // namespace keymaster
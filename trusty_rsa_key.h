@@ -0,0 +1,119 @@
+/*
+ * Copyright 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <keymaster/km_openssl/rsa_key_factory.h>
+#include <openssl/bn.h>
+#include <openssl/rsa.h>
+
+#include "trusty_idle_scheduler.h"
+
+/*
+ * Number of RSA keypairs to generate ahead of time, while the keymaster is
+ * idle. Defaults to 0, which disables the pool.
+ */
+#ifndef TRUSTY_KM_RSA_KEY_POOL_SIZE
+#define TRUSTY_KM_RSA_KEY_POOL_SIZE 0
+#endif
+
+namespace keymaster {
+
+/**
+ * TrustyRsaKeyFactory serves generate requests for the most common RSA
+ * parameters, 2048 bits with a public exponent of 65537, from a pool of
+ * keypairs generated while the keymaster is idle.  A pooled keypair is
+ * removed from the pool when it is used, so it is never handed out twice.
+ * Other requests, and requests made while the pool is empty or disabled, are
+ * passed to RsaKeyFactory unchanged.
+ *
+ * Filling the pool calls the checkpoint handler, if one is set, every few
+ * steps of the prime search, so that the caller can serve latency-critical
+ * requests in the meantime.  Requests passed to RsaKeyFactory take no
+ * checkpoints.
+ */
+class TrustyRsaKeyFactory : public RsaKeyFactory {
+public:
+    static constexpr size_t kPoolSize = TRUSTY_KM_RSA_KEY_POOL_SIZE;
+    static constexpr uint32_t kPooledKeySize = 2048;
+    static constexpr uint64_t kPublicExponent = 65537;
+    static constexpr uint32_t kCheckpointInterval = 16;
+
+    typedef void (*CheckpointHandler)(void* arg);
+
+    TrustyRsaKeyFactory(const SoftwareKeyBlobMaker& blob_maker,
+                        const KeymasterContext& context)
+            : RsaKeyFactory(blob_maker, context) {}
+    ~TrustyRsaKeyFactory();
+
+    keymaster_error_t GenerateKey(const AuthorizationSet& key_description,
+                                  UniquePtr<Key> attestation_signing_key,
+                                  const KeymasterBlob& issuer_subject,
+                                  KeymasterKeyBlob* key_blob,
+                                  AuthorizationSet* hw_enforced,
+                                  AuthorizationSet* sw_enforced,
+                                  CertificateChain* cert_chain) const override;
+
+    /**
+     * Registers the idle task that fills the pool, one keypair per step.
+     * Does nothing if the pool is disabled.
+     */
+    void RegisterIdleTasks(IdleScheduler* scheduler);
+
+    /**
+     * Frees all pooled keypairs, wiping their private values, and schedules
+     * the pool to be filled again.
+     */
+    void ClearPool() const;
+
+    /**
+     * Sets the function called at checkpoints during key generation.  The
+     * handler must not use this factory.
+     */
+    void SetCheckpointHandler(CheckpointHandler handler, void* arg) {
+        checkpoint_handler_ = handler;
+        checkpoint_arg_ = arg;
+    }
+
+private:
+    static bool RefillPoolTask(void* arg);
+
+    static int GenerateCallback(int event, int n, BN_GENCB* cb);
+    RSA* TakePooledKey() const;
+    RSA* GenerateRsa(uint32_t key_size) const;
+    keymaster_error_t GenerateFromRsa(const AuthorizationSet& key_description,
+                                      RSA* rsa,
+                                      UniquePtr<Key> attestation_signing_key,
+                                      const KeymasterBlob& issuer_subject,
+                                      KeymasterKeyBlob* key_blob,
+                                      AuthorizationSet* hw_enforced,
+                                      AuthorizationSet* sw_enforced,
+                                      CertificateChain* cert_chain) const;
+
+    // Sized to at least one entry, so the array is valid with the pool off.
+    mutable RSA* pool_[kPoolSize ? kPoolSize : 1] = {};
+    mutable size_t pool_count_ = 0;
+    IdleScheduler* idle_scheduler_ = nullptr;
+    int refill_task_ = IdleScheduler::kInvalidTask;
+    CheckpointHandler checkpoint_handler_ = nullptr;
+    void* checkpoint_arg_ = nullptr;
+    mutable uint32_t checkpoint_events_ = 0;
+};
+
+}  // namespace keymaster
@@ -16,13 +16,16 @@
 
 #include "trusty_secure_deletion_secret_storage.h"
 
+#include <algorithm>
 #include <array>
+#include <new>
 #include <optional>
 #include <vector>
 
 #include <lib/storage/storage.h>
 #include <uapi/err.h>
 
+#include <keymaster/android_keymaster_utils.h>
 #include <keymaster/logger.h>
 #include <keymaster/random_source.h>
 
@@ -72,6 +75,8 @@ constexpr storage_off_t kMaxSecretFileSizeForUpgrades =
 // use.  This reduces the maximum entropy of each slot to 127 bits.
 constexpr uint8_t kInUseFlag = 0x80;
 
+}  // namespace
+
 /**
  * StorageFile represents a secure storage file, and provides operations on it.
  * Use StorageSession::OpenFile to create a StorageFile.
@@ -178,6 +183,27 @@ public:
         return true;
     }
 
+    /**
+     * Write zeros to the range [`begin`, `end`) of the file.  Will not extend
+     * the file.  The range is written with one storage_write per kBlockSize
+     * bytes, rather than one per secret.
+     *
+     * Returns false if the write would go past the end of the file, or if an
+     * error occurs (all errors are logged).
+     */
+    bool ZeroRange(storage_off_t begin, storage_off_t end) const {
+        static const uint8_t zero_buf[kBlockSize] = {};
+
+        for (storage_off_t pos = begin; pos < end;) {
+            size_t size = std::min(end - pos, kBlockSize);
+            if (!WriteBlock(pos, zero_buf, size)) {
+                return false;
+            }
+            pos += size;
+        }
+        return true;
+    }
+
     /**
      * Resize the file to `newSize` bytes.
      *
@@ -334,6 +360,8 @@ private:
     storage_session_t session_;
 };
 
+namespace {
+
 /**
  * Zeros each secret from position `begin` to position `end`.
  */
@@ -345,54 +373,14 @@ bool zero_entries(const StorageFile& file,
         return false;
     }
 
-    for (storage_off_t pos = begin; pos < end; pos += kSecretSize) {
-        uint8_t zero_buf[kSecretSize] = {0x00, 0x00, 0x00, 0x00,  //
-                                         0x00, 0x00, 0x00, 0x00,  //
-                                         0x00, 0x00, 0x00, 0x00,  //
-                                         0x00, 0x00, 0x00, 0x00};
-        if (!file.WriteBlock(pos, zero_buf, sizeof(zero_buf))) {
-            LOG_E("Failed to zero secret at offset %llu", pos);
-            return false;
-        }
+    if (!file.ZeroRange(begin, end)) {
+        LOG_E("Failed to zero secrets from offset %llu to %llu", begin, end);
+        return false;
     }
 
     return true;
 }
 
-/**
- * Finds an empty slot in file.  Returns empty on error, 0 on failure to
- * find an empty slot and a valid (>0) slot number otherwise.
- */
-std::optional<uint32_t /* keySlot */> find_empty_slot(const StorageFile& file,
-                                                      bool isUpgrade) {
-    storage_off_t end =
-            std::min(file.size(), isUpgrade ? kMaxSecretFileSizeForUpgrades
-                                            : kMaxSecretFileSize);
-
-    uint32_t retval = 0;
-    for (storage_off_t filePos = 0; filePos < end; filePos += kBlockSize) {
-        std::optional<Buffer> block = file.ReadBlock(filePos, kBlockSize);
-        if (!block) {
-            LOG_E("Failed to read block of secrets", 0);
-            return std::nullopt;
-        }
-
-        size_t blockPos =
-                filePos == kFactoryResetSecretPos ? kFactoryResetSecretSize : 0;
-        for (; blockPos < block->available_read(); blockPos += kSecretSize) {
-            uint8_t first_byte = *(block->begin() + blockPos);
-            if ((first_byte & kInUseFlag) == 0 && retval == 0) {
-                static_assert(kBlockSize % kSecretSize == 0 &&
-                              kFactoryResetSecretSize % kSecretSize == 0);
-                retval = static_cast<uint32_t>((filePos + blockPos) /
-                                               kSecretSize);
-            }
-        }
-    }
-
-    return retval;
-}
-
 // Helper class that calls the provided function (probably a lambda) on
 // destruction if not disarmed.
 template <typename F>
@@ -414,6 +402,139 @@ private:
 
 }  // namespace
 
+TrustySecureDeletionSecretStorage::TrustySecureDeletionSecretStorage(
+        const RandomSource& random)
+        : SecureDeletionSecretStorage(random) {}
+
+TrustySecureDeletionSecretStorage::~TrustySecureDeletionSecretStorage() {
+    ResetStorage();
+}
+
+StorageFile* TrustySecureDeletionSecretStorage::OpenSecretsFile(
+        bool wait_for_port) const {
+    if (file_) {
+        return file_.get();
+    }
+
+    if (!session_) {
+        std::optional<StorageSession> session =
+                StorageSession::CreateSession(wait_for_port);
+        if (!session) {
+            return nullptr;
+        }
+        session_.reset(new (std::nothrow) StorageSession(std::move(*session)));
+        if (!session_) {
+            LOG_E("Failed to allocate storage session", 0);
+            return nullptr;
+        }
+    }
+
+    std::optional<StorageFile> file =
+            session_->OpenFile(kSecureDeletionSecretFileName);
+    if (!file) {
+        // The session may have gone away, e.g. because the storageproxy was
+        // restarted.  Drop it so the next attempt reconnects.
+        ResetStorage();
+        return nullptr;
+    }
+
+    file_.reset(new (std::nothrow) StorageFile(std::move(*file)));
+    if (!file_) {
+        LOG_E("Failed to allocate storage file", 0);
+        ResetStorage();
+        return nullptr;
+    }
+    LOG_D("Opened secure secrets file, size %llu", file_->size());
+    return file_.get();
+}
+
+void TrustySecureDeletionSecretStorage::ResetStorage() const {
+    // Closing the session discards any uncommitted changes.
+    file_.reset();
+    session_.reset();
+    // The slot map may describe changes that were never committed.  Rebuild it
+    // from the file on next use.
+    slot_in_use_ = std::nullopt;
+}
+
+bool TrustySecureDeletionSecretStorage::LoadSlotMap(
+        const StorageFile& file) const {
+    static_assert(kBlockSize % kSecretSize == 0 &&
+                  kFactoryResetSecretSize % kSecretSize == 0);
+
+    std::vector<bool> slot_in_use(file.size() / kSecretSize, false);
+    for (storage_off_t filePos = 0; filePos < file.size();
+         filePos += kBlockSize) {
+        std::optional<Buffer> block = file.ReadBlock(filePos, kBlockSize);
+        if (!block) {
+            LOG_E("Failed to read block of secrets", 0);
+            return false;
+        }
+
+        for (size_t blockPos = 0; blockPos < block->available_read();
+             blockPos += kSecretSize) {
+            uint8_t first_byte = *(block->begin() + blockPos);
+            slot_in_use[(filePos + blockPos) / kSecretSize] =
+                    (first_byte & kInUseFlag) != 0;
+        }
+    }
+
+    // The factory reset secret occupies the first slots, whatever their
+    // contents.
+    size_t first_slot = kFirstSecureDeletionSecretPos / kSecretSize;
+    for (size_t slot = 0; slot < first_slot && slot < slot_in_use.size();
+         ++slot) {
+        slot_in_use[slot] = true;
+    }
+
+    LOG_D("Loaded map of %zu secure deletion slots", slot_in_use.size());
+    slot_in_use_ = std::move(slot_in_use);
+    first_free_slot_hint_ = first_slot;
+    return true;
+}
+
+std::optional<uint32_t> TrustySecureDeletionSecretStorage::FindEmptySlot(
+        const StorageFile& file,
+        bool is_upgrade) const {
+    if (!slot_in_use_ && !LoadSlotMap(file)) {
+        return std::nullopt;
+    }
+
+    storage_off_t end =
+            std::min(file.size(), is_upgrade ? kMaxSecretFileSizeForUpgrades
+                                             : kMaxSecretFileSize);
+    size_t end_slot = std::min<size_t>(end / kSecretSize, slot_in_use_->size());
+
+    // All slots below first_free_slot_hint_ are known to be in use.
+    for (size_t slot = first_free_slot_hint_; slot < end_slot; ++slot) {
+        if (!(*slot_in_use_)[slot]) {
+            first_free_slot_hint_ = slot;
+            return static_cast<uint32_t>(slot);
+        }
+    }
+
+    return 0;
+}
+
+void TrustySecureDeletionSecretStorage::MarkSlot(uint32_t key_slot,
+                                                 bool in_use) const {
+    if (!slot_in_use_) {
+        // Not loaded yet, the file will be read when it's needed.
+        return;
+    }
+
+    if (key_slot >= slot_in_use_->size()) {
+        slot_in_use_->resize(key_slot + 1, false);
+    }
+    (*slot_in_use_)[key_slot] = in_use;
+
+    if (in_use && key_slot == first_free_slot_hint_) {
+        ++first_free_slot_hint_;
+    } else if (!in_use && key_slot < first_free_slot_hint_) {
+        first_free_slot_hint_ = key_slot;
+    }
+}
+
 bool TrustySecureDeletionSecretStorage::LoadOrCreateFactoryResetSecret(
         bool wait_for_port) const {
     if (factory_reset_secret_) {
@@ -421,18 +542,9 @@ bool TrustySecureDeletionSecretStorage::LoadOrCreateFactoryResetSecret(
         return true;
     }
 
-    LOG_D("Trying to open a session to read factory reset secret", 0);
-    std::optional<StorageSession> session =
-            StorageSession::CreateSession(wait_for_port);
-    if (!session) {
-        return false;
-    }
-
     LOG_D("Trying to open secure secrets file", 0);
-    std::optional<StorageFile> file =
-            session->OpenFile(kSecureDeletionSecretFileName);
+    StorageFile* file = OpenSecretsFile(wait_for_port);
     if (!file) {
-        // This shouldn't be possible, unless maybe the session just went away?
         LOG_E("Can't open secure secrets file.", 0);
         return false;
     }
@@ -443,6 +555,7 @@ bool TrustySecureDeletionSecretStorage::LoadOrCreateFactoryResetSecret(
                                                       kFactoryResetSecretSize);
         if (!block) {
             LOG_E("Failed to read factory reset secret", 0);
+            ResetStorage();
             return false;
         }
 
@@ -455,37 +568,41 @@ bool TrustySecureDeletionSecretStorage::LoadOrCreateFactoryResetSecret(
     LOG_I("Created new secure secrets file, size %llu", file->size());
     if (file->Resize(kBlockSize) != NO_ERROR) {
         LOG_E("Failed to grow new file from 0 to %llu bytes", kBlockSize);
+        ResetStorage();
         return false;
     }
     LOG_D("Resized secure secrets file to size %llu", file->size());
 
+    // Write the factory reset secret and zero the remaining secure deletion
+    // secret entries of the first block in a single write.
     static_assert(kBlockSize >= kFactoryResetSecretSize);
+    static_assert(kFactoryResetSecretPos == 0);
+    uint8_t first_block[kBlockSize] = {};
+    auto first_block_cleanup = OnExit(
+            [&]() { memset_s(first_block, 0, kFactoryResetSecretSize); });
+
     Buffer buf(kFactoryResetSecretSize);
     keymaster_error_t error =
             random_.GenerateRandom(buf.peek_write(), buf.available_write());
     if (error != KM_ERROR_OK || !buf.advance_write(kFactoryResetSecretSize)) {
         LOG_E("Failed to generate %zu random bytes for factory reset secret",
               kFactoryResetSecretSize);
+        ResetStorage();
         return false;
     }
+    memcpy(first_block + kFactoryResetSecretPos, buf.peek_read(),
+           buf.available_read());
 
-    if (!file->WriteBlock(kFactoryResetSecretPos, buf.peek_read(),
-                          buf.available_read())) {
+    if (!file->WriteBlock(0, first_block, sizeof(first_block))) {
         LOG_E("Failed to write factory reset secret", 0);
+        ResetStorage();
         return false;
     }
-    LOG_D("Wrote new factory reset secret.", 0);
-
-    if (!zero_entries(*file, kFirstSecureDeletionSecretPos /* begin */,
-                      kBlockSize /* end */)) {
-        LOG_E("Failed to zero secure deletion secret entries in first block",
-              0);
-        return false;
-    }
-    LOG_D("Zeroed secrets.", 0);
+    LOG_D("Wrote new factory reset secret and zeroed secrets.", 0);
 
-    if (!session->EndTransaction(true /* commit */)) {
+    if (!session_->EndTransaction(true /* commit */)) {
         LOG_E("Failed to commit transaction creating secure secrets file", 0);
+        ResetStorage();
         return false;
     }
     LOG_D("Committed new secrets file.", 0);
@@ -532,24 +649,18 @@ TrustySecureDeletionSecretStorage::CreateDataForNewKey(bool secure_deletion,
 
     auto sds_cleanup = OnExit([&]() { retval.secure_deletion_secret.Clear(); });
 
-    std::optional<StorageSession> session =
-            StorageSession::CreateSession();  // Will block
+    // Any failure below leaves the session in an unknown state; drop it so the
+    // next call reconnects and no partial changes are committed later.
+    auto storage_cleanup = OnExit([&]() { ResetStorage(); });
 
-    if (!session) {
-        LOG_E("Failed to open session in CreateDateForNewKey", 0);
-        return retval;
-    }
-    LOG_D("Opened session to store secure deletion secret.", 0);
-
-    std::optional<StorageFile> file =
-            session->OpenFile(kSecureDeletionSecretFileName);
+    StorageFile* file = OpenSecretsFile(true /* wait_for_port */);
     if (!file) {
         LOG_E("Failed to open file in CreateDateForNewKey", 0);
         return retval;
     }
     LOG_D("Opened file to store secure deletion secret.", 0);
 
-    std::optional<uint32_t> keySlot = find_empty_slot(*file, is_upgrade);
+    std::optional<uint32_t> keySlot = FindEmptySlot(*file, is_upgrade);
     if (!keySlot) {
         LOG_E("Error while searching for key slot", 0);
         return retval;
@@ -563,6 +674,7 @@ TrustySecureDeletionSecretStorage::CreateDataForNewKey(bool secure_deletion,
         if (!can_resize) {
             LOG_I("Didn't find a slot and can't grow the file larger than %llu",
                   file->size());
+            storage_cleanup.disarm();  // Nothing was written.
             return retval;
         }
 
@@ -581,6 +693,9 @@ TrustySecureDeletionSecretStorage::CreateDataForNewKey(bool secure_deletion,
             return retval;
         }
 
+        if (slot_in_use_) {
+            slot_in_use_->resize(file->size() / kSecretSize, false);
+        }
         keySlot = old_size / kSecretSize;
     }
 
@@ -592,13 +707,15 @@ TrustySecureDeletionSecretStorage::CreateDataForNewKey(bool secure_deletion,
         return retval;
     }
 
-    if (!session->EndTransaction(true /* commit */)) {
+    if (!session_->EndTransaction(true /* commit */)) {
         LOG_E("Failed to commit transaction writing new deletion secret to slot %u",
               *keySlot);
         return retval;
     }
     LOG_D("Committed new secret.", 0);
+    MarkSlot(*keySlot, true /* in_use */);
 
+    storage_cleanup.disarm();
     sds_cleanup.disarm();  // Secure deletion secret written; no need to wipe.
     retval.key_slot = *keySlot;
     return retval;
@@ -627,15 +744,7 @@ SecureDeletionData TrustySecureDeletionSecretStorage::GetDataForKey(
     LOG_D("Need to read secure deletion secret from slot %u", retval.key_slot);
 
     for (size_t tries = 0; tries < kMaxTries; ++tries) {
-        std::optional<StorageSession> session =
-                StorageSession::CreateSession();  // Will block
-        if (!session) {
-            LOG_E("Failed to open session to get secure deletion data.", 0);
-            continue;
-        }
-
-        std::optional<StorageFile> file =
-                session->OpenFile(kSecureDeletionSecretFileName);
+        StorageFile* file = OpenSecretsFile(true /* wait_for_port */);
         if (!file) {
             LOG_E("Failed to open file to get secure deletion data.", 0);
             continue;
@@ -654,6 +763,7 @@ SecureDeletionData TrustySecureDeletionSecretStorage::GetDataForKey(
                 file->ReadBlock(retval.key_slot * kSecretSize, kSecretSize);
         if (!secret) {
             LOG_E("Failed to read secret from slot %u", retval.key_slot);
+            ResetStorage();
             continue;
         }
 
@@ -667,82 +777,180 @@ SecureDeletionData TrustySecureDeletionSecretStorage::GetDataForKey(
 }
 
 void TrustySecureDeletionSecretStorage::DeleteKey(uint32_t key_slot) const {
-    if (key_slot == 0) {
-        LOG_D("key_slot == 0, nothing to delete", 0);
+    DeleteKeys(&key_slot, 1);
+}
+
+void TrustySecureDeletionSecretStorage::DeleteKeys(const uint32_t* key_slots,
+                                                   size_t count) const {
+    std::vector<uint32_t> slots;
+    for (size_t i = 0; i < count; ++i) {
+        if (key_slots[i] != 0) {
+            slots.push_back(key_slots[i]);
+        }
+    }
+    if (slots.empty()) {
+        LOG_D("No key slots to delete", 0);
         return;
     }
+    std::sort(slots.begin(), slots.end());
+    slots.erase(std::unique(slots.begin(), slots.end()), slots.end());
 
     for (;;) {
-        std::optional<StorageSession> session =
-                StorageSession::CreateSession();  // Will block
-        if (!session) {
-            LOG_E("Failed to open session to retrieve secure deletion data.",
-                  0);
-            continue;
-        }
-
-        std::optional<StorageFile> file =
-                session->OpenFile(kSecureDeletionSecretFileName);
+        StorageFile* file = OpenSecretsFile(true /* wait_for_port */);
         if (!file) {
             LOG_E("Failed to open file to retrieve secure deletion data.", 0);
             continue;
         }
 
-        storage_off_t key_slot_begin = key_slot * kSecretSize;
-        storage_off_t key_slot_end = key_slot_begin + kSecretSize;
-        if (key_slot_begin <
-                    kFactoryResetSecretPos + kFactoryResetSecretSize  //
-            || key_slot_end > file->size()) {
-            LOG_E("Attempted to delete invalid key slot %u", key_slot);
+        // Drop slots outside the secrets file.  The rest are sorted, so
+        // adjacent slots are zeroed with a single range write.
+        std::vector<uint32_t> valid_slots;
+        for (uint32_t key_slot : slots) {
+            storage_off_t key_slot_begin = key_slot * kSecretSize;
+            if (key_slot_begin < kFirstSecureDeletionSecretPos ||
+                key_slot_begin + kSecretSize > file->size()) {
+                LOG_E("Attempted to delete invalid key slot %u", key_slot);
+                continue;
+            }
+            valid_slots.push_back(key_slot);
+        }
+        if (valid_slots.empty()) {
             return;
         }
 
-        if (!zero_entries(*file, key_slot_begin, key_slot_end)) {
+        bool zeroed = true;
+        for (size_t i = 0; zeroed && i < valid_slots.size();) {
+            size_t run_end = i + 1;
+            while (run_end < valid_slots.size() &&
+                   valid_slots[run_end] == valid_slots[run_end - 1] + 1) {
+                ++run_end;
+            }
+            storage_off_t range_begin = valid_slots[i] * kSecretSize;
+            storage_off_t range_end =
+                    (valid_slots[run_end - 1] + 1) * kSecretSize;
+            zeroed = zero_entries(*file, range_begin, range_end);
+            LOG_D("Deleted secure key slots %u to %u, zeroing %llu to %llu",
+                  valid_slots[i], valid_slots[run_end - 1], range_begin,
+                  range_end);
+            i = run_end;
+        }
+        if (!zeroed) {
+            ResetStorage();
             continue;
         }
-        LOG_D("Deleted secure key slot %u, zeroing %llu to %llu", key_slot,
-              key_slot_begin, key_slot_end);
 
-        if (!session->EndTransaction(true /* commit */)) {
-            LOG_E("Failed to commit transaction deleting key at slot %u",
-                  key_slot);
+        if (!session_->EndTransaction(true /* commit */)) {
+            LOG_E("Failed to commit transaction deleting %zu key slots",
+                  valid_slots.size());
+            ResetStorage();
             continue;
         }
-        LOG_D("Committed deletion", 0);
+        LOG_D("Committed deletion of %zu key slots", valid_slots.size());
+        for (uint32_t key_slot : valid_slots) {
+            MarkSlot(key_slot, false /* in_use */);
+        }
+        // Slots are sorted, so only the last one can be in the last block.
+        if ((valid_slots.back() + 1) * kSecretSize + kBlockSize >
+            file->size()) {
+            shrink_pending_ = true;
+        }
 
         return;
     }
 }
 
+bool TrustySecureDeletionSecretStorage::ShrinkSecretsFile() const {
+    StorageFile* file = OpenSecretsFile(false /* wait_for_port */);
+    if (!file) {
+        LOG_E("Failed to open file to shrink secrets file.", 0);
+        return false;
+    }
+
+    if (!slot_in_use_ && !LoadSlotMap(*file)) {
+        ResetStorage();
+        return false;
+    }
+
+    // The slot map marks the factory reset secret as in use, so the first
+    // block of a non-empty file is always kept.
+    size_t end_slot =
+            std::min<size_t>(slot_in_use_->size(), file->size() / kSecretSize);
+    while (end_slot > 0 && !(*slot_in_use_)[end_slot - 1]) {
+        --end_slot;
+    }
+    storage_off_t new_size =
+            (end_slot * kSecretSize + kBlockSize - 1) / kBlockSize * kBlockSize;
+    storage_off_t old_size = file->size();
+    if (new_size >= old_size) {
+        shrink_pending_ = false;
+        return true;
+    }
+
+    int rc = file->Resize(new_size);
+    if (rc != NO_ERROR) {
+        LOG_E("Failed (%d) to shrink secrets file to %llu", rc, new_size);
+        ResetStorage();
+        return false;
+    }
+
+    if (!session_->EndTransaction(true /* commit */)) {
+        LOG_E("Failed to commit transaction shrinking secrets file", 0);
+        ResetStorage();
+        return false;
+    }
+    LOG_I("Shrank secure secrets file from %llu to %llu", old_size, new_size);
+
+    slot_in_use_->resize(new_size / kSecretSize);
+    first_free_slot_hint_ =
+            std::min<size_t>(first_free_slot_hint_, slot_in_use_->size());
+    shrink_pending_ = false;
+    return true;
+}
+
 void TrustySecureDeletionSecretStorage::DeleteAllKeys() const {
     for (;;) {
-        std::optional<StorageSession> session =
-                StorageSession::CreateSession();  // Will block
-        if (!session) {
-            LOG_E("Failed to open session to delete secrets file.", 0);
-            continue;
+        // The file is about to be deleted; don't keep a handle to it.
+        file_.reset();
+        slot_in_use_ = std::nullopt;
+
+        if (!session_) {
+            std::optional<StorageSession> session =
+                    StorageSession::CreateSession();  // Will block
+            if (!session) {
+                LOG_E("Failed to open session to delete secrets file.", 0);
+                continue;
+            }
+            session_.reset(
+                    new (std::nothrow) StorageSession(std::move(*session)));
+            if (!session_) {
+                LOG_E("Failed to allocate storage session", 0);
+                continue;
+            }
+            LOG_D("Opened session to delete secrets file.", 0);
         }
-        LOG_D("Opened session to delete secrets file.", 0);
 
-        auto error = session->DeleteFile(kSecureDeletionSecretFileName);
+        auto error = session_->DeleteFile(kSecureDeletionSecretFileName);
         if (error == StorageSession::Error::OK) {
             LOG_D("Deleted secrets file", 0);
 
-            if (!session->EndTransaction(true /* commit */)) {
+            if (!session_->EndTransaction(true /* commit */)) {
                 LOG_E("Failed to commit deletion of secrets file.", 0);
+                ResetStorage();
             }
             LOG_D("Committed deletion of secrets file.", 0);
         } else if (error == StorageSession::Error::NOT_FOUND) {
-            // File does not exist, may as well abandon the session.
+            // File does not exist, nothing to commit.
             LOG_D("No secrets file existed.", 0);
         } else {
-            // Assuming transient error. Log and retry.
+            // Assuming transient error. Log, reconnect and retry.
             LOG_E("Failed to delete secrets file", 0);
+            ResetStorage();
             continue;
         }
 
         // Success
         factory_reset_secret_ = {};
+        shrink_pending_ = false;
         return;
     }
 }
@@ -17,32 +17,102 @@
 #pragma once
 
 #include <optional>
+#include <vector>
 
+#include <keymaster/UniquePtr.h>
 #include <keymaster/key_blob_utils/auth_encrypted_key_blob.h>
 #include <keymaster/secure_deletion_secret_storage.h>
 
 namespace keymaster {
 
 class RandomSource;
+class StorageFile;
+class StorageSession;
 
 class TrustySecureDeletionSecretStorage : public SecureDeletionSecretStorage {
 public:
-    TrustySecureDeletionSecretStorage(const RandomSource& random)
-            : SecureDeletionSecretStorage(random) {}
+    TrustySecureDeletionSecretStorage(const RandomSource& random);
+    ~TrustySecureDeletionSecretStorage();
 
     std::optional<SecureDeletionData> CreateDataForNewKey(
             bool secure_deletion,
             bool is_upgrade) const override;
     SecureDeletionData GetDataForKey(uint32_t key_slot) const override;
     void DeleteKey(uint32_t key_slot) const override;
+
+    /**
+     * Deletes the secrets in |count| |key_slots| in a single storage
+     * transaction.  Adjacent slots are zeroed together, and slots that are 0,
+     * repeated or out of range are skipped.
+     */
+    void DeleteKeys(const uint32_t* key_slots, size_t count) const;
+
     void DeleteAllKeys() const override;
 
+    /**
+     * Truncates the trailing blocks of the secrets file that hold no secrets,
+     * so that loading the slot map and searching for free slots only cover
+     * blocks that are in use.  The first block, which holds the factory reset
+     * secret, is always kept.  Returns false on error.
+     */
+    bool ShrinkSecretsFile() const;
+
+    /**
+     * Returns true if keys have been deleted from the last block of the
+     * secrets file since it was last shrunk.
+     */
+    bool ShrinkPending() const { return shrink_pending_; }
+
 private:
     bool LoadOrCreateFactoryResetSecret(bool wait_for_port) const;
 
+    /**
+     * Returns the secrets file, opening a storage session and the file first
+     * if they aren't open yet.  Both stay open across calls, so only the first
+     * access (or the first access after ResetStorage()) pays for connecting
+     * to storage and opening the file.  Returns nullptr on failure.
+     */
+    StorageFile* OpenSecretsFile(bool wait_for_port) const;
+
+    /**
+     * Closes the secrets file and the storage session, discarding any
+     * uncommitted changes.  Must be called after any storage error, so that
+     * the next access reconnects.
+     */
+    void ResetStorage() const;
+
+    /**
+     * Builds slot_in_use_ by reading the whole secrets file.
+     */
+    bool LoadSlotMap(const StorageFile& file) const;
+
+    /**
+     * Finds an empty slot in file, using (and if needed loading) the slot map.
+     * Returns empty on error, 0 on failure to find an empty slot and a valid
+     * (>0) slot number otherwise.
+     */
+    std::optional<uint32_t> FindEmptySlot(const StorageFile& file,
+                                          bool is_upgrade) const;
+
+    /**
+     * Records in the slot map that |key_slot| has been committed as in use or
+     * free.
+     */
+    void MarkSlot(uint32_t key_slot, bool in_use) const;
+
     // Holds the factory reset secret.  If not std::nullopt, also indicates that
     // secure storage has been read successfully at least once.
     mutable std::optional<Buffer> factory_reset_secret_;
+
+    mutable UniquePtr<StorageSession> session_;
+    mutable UniquePtr<StorageFile> file_;
+
+    // In-memory copy of the in-use flag of each slot of the secrets file, so
+    // that finding a free slot doesn't require reading the file.  Loaded on
+    // first use and dropped whenever it may be out of sync with the file.
+    mutable std::optional<std::vector<bool>> slot_in_use_;
+    mutable size_t first_free_slot_hint_ = 0;
+    mutable bool shrink_pending_ = false;
 };
 
 }  // namespace keymaster
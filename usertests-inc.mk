@@ -16,3 +16,10 @@
 TRUSTY_USER_TESTS += \
 	trusty/user/app/keymaster/device_unittest \
 
+# device_benchmark drives the non-secure port, which only accepts it when the
+# keymaster is built with KEYMASTER_ALLOW_TA_CONNECT.
+ifeq (true,$(call TOBOOL,$(KEYMASTER_ALLOW_TA_CONNECT)))
+TRUSTY_USER_TESTS += \
+	trusty/user/app/keymaster/device_benchmark \
+
+endif